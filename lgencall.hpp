@@ -30,8 +30,9 @@
 /* LCBC_USE_WIDESTRING defines the support for wide character (Unicode) strings:
    0 : wchar_t and wstring are not supported; to make sure they are #defined to dummy types;
    1 : wchar_t and wstring can be used as arguments to Input, Output and Script classes.
-       You have to call WideString::SetMode<>() template function to set the desired conversion.
-   The template parameter of SetMode can be one of these:
+       The conversion is selected at compile time with LCBC_WIDESTRING_MODE (Utf8Mode by default)
+       and can be changed at run time for a Lua state (and its threads) with WideString::SetMode<>(L).
+   The mode can be one of these:
    RawMode : no conversion, wide character strings are pushed verbatim to the stack (raw bytes);
        script snippets cannot be wchar_t* (you would get syntax errors looking like Chineese)
    LocaleMode : conversions between wchar_t* and char* use wctomb and mbtowc standard functions;
@@ -47,6 +48,10 @@
    - vector<T>, map<K,T>, list<T>, set<T>, deque<T>, multiset<T>, multimap<K,T>
    - queue<T,C>, priority_queue<T,C>, stack<T,C>
    - pair<T1,T2>, valarray<T>, bitset<N>
+   With a C++11 compiler, also:
+   - unordered_map<K,T>, unordered_set<T>, unordered_multimap<K,T>, unordered_multiset<T>
+   - array<T,N>, tuple<T...>, and when available optional<T> (C++17), span<T> (C++20),
+     flat_map<K,T>, flat_set<T>, flat_multimap<K,T>, flat_multiset<T> (C++23)
    0: no support;
    1: C++ Standard Library data can be exchanged with Lua. 
 */
@@ -86,6 +91,47 @@
 #define LCBC_USE_EXCEPTIONS 1
 #endif
 
+/* LCBC_USE_MMAP lets Snapshot::Load map files in memory instead of reading them.
+   It is enabled by default on Windows and Unix-like systems.
+*/
+#ifndef LCBC_USE_MMAP
+#if defined(_WIN32) || defined(__unix__) || defined(__APPLE__)
+#define LCBC_USE_MMAP 1
+#else
+#define LCBC_USE_MMAP 0
+#endif
+#endif
+
+/* LCBC_USE_CPP11 enables the parts of the library needing a C++11 compiler,
+   like move semantics. It is detected automatically but can be forced to 0 or 1.
+*/
+#if defined(_MSVC_LANG)
+#define LCBC_CPLUSPLUS _MSVC_LANG
+#else
+#define LCBC_CPLUSPLUS __cplusplus
+#endif
+#ifndef LCBC_USE_CPP11
+#if LCBC_CPLUSPLUS >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#define LCBC_USE_CPP11 1
+#else
+#define LCBC_USE_CPP11 0
+#endif
+#endif
+
+/* LCBC_THREAD_LOCAL is the storage class of the thread-local variables through which LuaT hands
+   the state of a call to the functions only given a lua_State, instead of looking it up in the
+   registry. It is detected automatically; without it, table recycling is not available.
+*/
+#ifndef LCBC_THREAD_LOCAL
+#if LCBC_USE_CPP11
+#define LCBC_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define LCBC_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define LCBC_THREAD_LOCAL __thread
+#endif
+#endif
+
 #ifndef LUA_VERSION_MAJOR
 extern "C" {
 #include "lua.h"
@@ -94,12 +140,26 @@ extern "C" {
 }
 #endif
 #include <cstring>
+#include <cctype>
 #include <cstdlib>
+#include <cstdio>
+#include <climits>
+#include <ctime>
+#include <new>
 
 #if LCBC_USE_WIDESTRING
 #include <cwchar>
 #endif
 
+#if LCBC_USE_MMAP && defined(_WIN32)
+#include <windows.h>
+#elif LCBC_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #if LCBC_USE_CSL
 #include <string>
 #include <vector>
@@ -111,6 +171,60 @@ extern "C" {
 #include <stack>
 #include <valarray>
 #include <bitset>
+#include <iterator>
+#include <algorithm>
+#endif
+
+#if LCBC_USE_CPP11
+#include <utility>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#define LCBC_MOVE(x) std::move(x)
+#else
+#define LCBC_MOVE(x) (x)
+#endif
+
+#define LCBC_HAS_COROUTINE 0
+#if LCBC_USE_CPP11 && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#undef LCBC_HAS_COROUTINE
+#define LCBC_HAS_COROUTINE 1
+#endif
+#endif
+
+#define LCBC_HAS_OPTIONAL 0
+#define LCBC_HAS_SPAN 0
+#define LCBC_HAS_FLAT 0
+#if LCBC_USE_CSL && LCBC_USE_CPP11
+#include <array>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#if defined(__has_include)
+#if LCBC_CPLUSPLUS >= 201703L && __has_include(<optional>)
+#include <optional>
+#undef LCBC_HAS_OPTIONAL
+#define LCBC_HAS_OPTIONAL 1
+#endif
+#if LCBC_CPLUSPLUS >= 202002L && __has_include(<span>)
+#include <span>
+#undef LCBC_HAS_SPAN
+#define LCBC_HAS_SPAN 1
+#endif
+#if LCBC_CPLUSPLUS > 202002L && __has_include(<flat_map>) && __has_include(<flat_set>)
+#include <flat_map>
+#include <flat_set>
+#if defined(__cpp_lib_flat_map) && defined(__cpp_lib_flat_set)
+#undef LCBC_HAS_FLAT
+#define LCBC_HAS_FLAT 1
+#endif
+#endif
+#endif
 #endif
 
 #if LCBC_USE_QT
@@ -140,6 +254,7 @@ namespace lua {
 using namespace std;
 
 enum eNil { nil };
+enum eOverwrite { overwrite };
 
 #if !LCBC_USE_WIDESTRING
 enum dummy_wchar_t {};
@@ -156,44 +271,114 @@ enum dummy_QString {};
 
 enum WideStringMode { RawMode, LocaleMode, Utf8Mode };
 
+#ifndef LCBC_WIDESTRING_MODE
+#define LCBC_WIDESTRING_MODE Utf8Mode
+#endif
+
 class WideString
 {
 public:
-	template<WideStringMode mode> static void SetMode(lua_State* L)
+	typedef void (*Encoder)(lua_State* L, const wchar_t* str, size_t len);
+	typedef void (*Decoder)(lua_State* L, const char* str, size_t len);
+	struct Converters 
+	{ 
+		Encoder encode; 
+		Decoder decode; 
+	};
+private:
+	struct Active
 	{
-		lua_pushcfunction(L, Push<mode>);
-		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedPushWideString"); 
-		lua_pushcfunction(L, Get<mode>);
-		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedGetWideString"); 
-	}
+		lua_State* L;
+		const Converters* Modes;
+	};
+public:
+	/* The modes of a state are kept in the registry userdata LuaClassBasedWideString, which LuaT resolves
+	   once and hands to the conversions of its calls through a Scope, instead of looking it up for each string */
+	template<WideStringMode mode> static void SetMode(lua_State* L) { SetMode<mode, mode>(L); }
 	template<WideStringMode input_mode, WideStringMode output_mode> static void SetMode(lua_State* L)
 	{
-		lua_pushcfunction(L, Push<input_mode>);
-		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedPushWideString"); 
-		lua_pushcfunction(L, Get<output_mode>);
-		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedGetWideString"); 
+		Converters* modes = Modes(L);
+		modes->encode = &Encode<input_mode>;
+		modes->decode = &Decode<output_mode>;
 	}
-	static void Push(lua_State* L, const wchar_t* str) { Push(L, str, wcslen(str)); }
-	static void Push(lua_State* L, const wchar_t* str, size_t len)
+	// Converters of the state, created with the default modes if needed; they live as long as the state
+	static Converters* Modes(lua_State* L)
 	{
-		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedPushWideString"); 
-		lua_pushlstring(L, (const char*)str, len*sizeof(wchar_t));
-		lua_call(L, 1, 1);
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedWideString");
+		Converters* modes = (Converters*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(!modes)
+		{
+			modes = (Converters*)lua_newuserdata(L, sizeof(Converters));
+			*modes = Default();
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedWideString");
+		}
+		return modes;
 	}
+	// Makes the conversions on L use modes during its lifetime
+	class Scope
+	{
+	public:
+#ifdef LCBC_THREAD_LOCAL
+		Scope(lua_State* L, const Converters* modes) : Saved(Current()) 
+		{ 
+			Current().L = L; 
+			Current().Modes = modes; 
+		}
+		~Scope() { Current() = Saved; }
+#else
+		Scope(lua_State* /*L*/, const Converters* /*modes*/) {}
+#endif
+	private:
+		Scope(const Scope&);
+		Scope& operator=(const Scope&);
+#ifdef LCBC_THREAD_LOCAL
+		Active Saved;
+#endif
+	};
+	static void Push(lua_State* L, const wchar_t* str) { Push(L, str, wcslen(str)); }
+	static void Push(lua_State* L, const wchar_t* str, size_t len) { Find(L)->encode(L, str, len); }
 	static const wchar_t* Get(lua_State* L, int idx) { size_t size; return Get(L, idx, size); }
 	static const wchar_t* Get(lua_State* L, int idx, size_t& size)
 	{
-		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedGetWideString");
-		lua_pushvalue(L, idx);
-		lua_call(L, 1, 1);
+		if(idx < 0 && idx > LUA_REGISTRYINDEX)
+			idx = lua_gettop(L) + idx + 1;
+		size_t len;
+		const char* str = luaL_checklstring(L, idx, &len);
+		Find(L)->decode(L, str, len);
 		lua_replace(L, idx);
 		const wchar_t* res = (const wchar_t*)lua_tolstring(L, idx, &size);
 		size /= sizeof(wchar_t);
 		return res;
 	}
+	/* Direct conversions, usable when the mode is known at compile time.
+	   Encode pushes the converted char string, Decode pushes the wchar_t string. */
+	template<WideStringMode mode> static void Encode(lua_State* L, const wchar_t* str, size_t len);
+	template<WideStringMode mode> static void Decode(lua_State* L, const char* str, size_t len);
 private:
-	template<WideStringMode mode> static int Push(lua_State* L);
-	template<WideStringMode mode> static int Get(lua_State* L);
+	// Converters of the scope of L, or of its state
+	static const Converters* Find(lua_State* L)
+	{
+#ifdef LCBC_THREAD_LOCAL
+		const Active& active = Current();
+		if(active.L == L)
+			return active.Modes;
+#endif
+		return Modes(L);
+	}
+#ifdef LCBC_THREAD_LOCAL
+	static Active& Current()
+	{
+		static LCBC_THREAD_LOCAL Active active = { NULL, NULL };
+		return active;
+	}
+#endif
+	static Converters Default();
+	static void AddTerminator(luaL_Buffer* b)
+	{
+		for(size_t i=1;i<sizeof(wchar_t);i++)
+			luaL_addchar(b, 0);
+	}
 };
 
 class QtString
@@ -204,7 +389,98 @@ public:
 	static void Push(lua_State* L, const QString& str);
 };
 
+enum eTypedArray { typedarray };
+enum eBuffer { buffer };
+enum ePacked { packed };
+
+enum NumberType { NotNumber, Int8, UInt8, Int16, UInt16, Int32, UInt32, Int64, UInt64, Float, Double };
+
+template<size_t size, bool sign> struct IntegerTraits { enum { type = NotNumber }; };
+template<> struct IntegerTraits<1,true> { enum { type = Int8 }; };
+template<> struct IntegerTraits<1,false> { enum { type = UInt8 }; };
+template<> struct IntegerTraits<2,true> { enum { type = Int16 }; };
+template<> struct IntegerTraits<2,false> { enum { type = UInt16 }; };
+template<> struct IntegerTraits<4,true> { enum { type = Int32 }; };
+template<> struct IntegerTraits<4,false> { enum { type = UInt32 }; };
+template<> struct IntegerTraits<8,true> { enum { type = Int64 }; };
+template<> struct IntegerTraits<8,false> { enum { type = UInt64 }; };
+
+// Maps C++ numeric types to the element types of typed arrays.
+// char and wchar_t are not numbers here: arrays of them are strings.
+template<class T> struct NumberTraits { enum { type = NotNumber }; };
+template<> struct NumberTraits<signed char> : IntegerTraits<1,true> {};
+template<> struct NumberTraits<unsigned char> : IntegerTraits<1,false> {};
+template<> struct NumberTraits<short> : IntegerTraits<sizeof(short),true> {};
+template<> struct NumberTraits<unsigned short> : IntegerTraits<sizeof(short),false> {};
+template<> struct NumberTraits<int> : IntegerTraits<sizeof(int),true> {};
+template<> struct NumberTraits<unsigned int> : IntegerTraits<sizeof(int),false> {};
+template<> struct NumberTraits<long> : IntegerTraits<sizeof(long),true> {};
+template<> struct NumberTraits<unsigned long> : IntegerTraits<sizeof(long),false> {};
+template<> struct NumberTraits<long long> : IntegerTraits<sizeof(long long),true> {};
+template<> struct NumberTraits<unsigned long long> : IntegerTraits<sizeof(long long),false> {};
+template<> struct NumberTraits<float> { enum { type = Float }; };
+template<> struct NumberTraits<double> { enum { type = Double }; };
+
+template<bool condition> struct StaticCheck;
+template<> struct StaticCheck<true> { enum { value = 1 }; };
+
+/* A typed array is a full userdata holding a header followed by contiguous numeric data.
+   From Lua, it behaves like a fixed size array (1-based indexing, # operator)
+   and has methods sum, min, max, totable([i [,j]]), copy, shape, type and at(row, col). */
+class TypedArray
+{
+public:
+	struct Header
+	{
+		int type;
+		size_t length;
+		size_t rows;
+		size_t columns;
+	};
+	static void* Push(lua_State* L, int type, size_t length, size_t rows = 0, size_t columns = 0);
+	static Header* To(lua_State* L, int idx);
+	static Header* Check(lua_State* L, int idx);
+	static void* Data(Header* h) { return (char*)h + HeaderSize(); }
+	static const void* Data(const Header* h) { return (const char*)h + HeaderSize(); }
+	static size_t ElementSize(int type);
+	static void PushAt(lua_State* L, const Header* h, size_t i);
+	static void SetAt(Header* h, size_t i, lua_Number value);
+	template<class T> static void CopyOut(const Header* h, T* dst, size_t len);
+	template<class Op> static void Apply(const Header* h, Op& op);
+private:
+	static size_t HeaderSize() { return (sizeof(Header) + sizeof(double) - 1) & ~(sizeof(double) - 1); }
+	static void PushMetatable(lua_State* L);
+	static size_t CheckIndex(lua_State* L, const Header* h, int arg);
+	static int Index(lua_State* L);
+	static int NewIndex(lua_State* L);
+	static int Len(lua_State* L);
+	static int ToString(lua_State* L);
+	static int Sum(lua_State* L);
+	static int Min(lua_State* L);
+	static int Max(lua_State* L);
+	static int ToTable(lua_State* L);
+	static int Copy(lua_State* L);
+	static int Shape(lua_State* L);
+	static int Type(lua_State* L);
+	static int At(lua_State* L);
+	static const char* TypeName(int type);
+};
+
 class Input;
+class TableView;
+class ResultsView;
+class FunctionView;
+#if LCBC_USE_CPP11
+template<class S> class LuaFunction;
+#endif
+class Snapshot;
+class Dataset;
+class Environment;
+#if LCBC_USE_CPP11
+class Channel;
+#endif
+struct StateValue;
+template<class H> struct Reference;
 class Registry
 {
 public:
@@ -224,12 +500,28 @@ public:
 	Input(lua_CFunction value) { pPush = &Input::PushFunction; FunctionValue = value; Size = 0;}
 	Input(lua_CFunction value, size_t len) { pPush = &Input::PushFunction; FunctionValue = value; Size=len; }
 	Input(const Registry& value) { pPush = &Input::PushRegistry; PointerValue = &value; }
+	Input(const TableView& value) { pPush = &Input::PushTableView; PointerValue = &value; }
+	Input(const ResultsView& value) { pPush = &Input::PushTableView; PointerValue = (const TableView*)&value; }
+	Input(const FunctionView& value) { pPush = &Input::PushFunctionView; PointerValue = &value; }
+	Input(const Environment& value) { pPush = &Input::PushEnvironment; PointerValue = &value; }
+#if LCBC_USE_CPP11
+	template<class S> Input(const LuaFunction<S>& value) { pPush = &Input::PushFunctionView; PointerValue = (const FunctionView*)&value; }
+	Input(const Channel& value) { pPush = &Input::PushChannel; PointerValue = &value; }
+#endif
+	Input(const Snapshot& value) { pPush = &Input::PushSnapshot; PointerValue = &value; }
+	Input(const Dataset& value) { pPush = &Input::PushDataset; PointerValue = &value; }
+	Input(const StateValue& value) { pPush = &Input::PushStateValue; PointerValue = &value; }
+	template<class H> Input(const Reference<H>& value) { pPush = &Input::PushReference<H>; PointerValue = &value; }
 	template<class T> Input(T value) { pPush = &Input::PushNumber; NumberValue = (lua_Number)value; }
 	template<class T> Input(T* value) { pPush = &Input::PushValue<T>; PointerValue = value; }
 	template<class T> Input(const T* value) { pPush = &Input::PushValue<T>; PointerValue = value; }
 	template<class T> Input(const T* value, size_t size) { pPush = &Input::PushSizedValue<T>; PointerValue = value; Size = size; }
 	template<class T> Input(size_t len, const T* value) { pPush = &Input::PushArray<T>; PointerValue = value; Size=len; }
 	template<class T, size_t L2> Input(size_t len1, const T value[][L2]) { pPush = &Input::Push2DArray<T,L2>; PointerValue = value; Size=len1; }
+	template<class T> Input(eTypedArray, size_t len, const T* value) { pPush = &Input::PushTypedArray<T>; PointerValue = value; Size=len; }
+	template<class T, size_t L2> Input(eTypedArray, size_t len1, const T value[][L2]) { pPush = &Input::PushTyped2DArray<T,L2>; PointerValue = value; Size=len1; }
+	Input(eBuffer, const void* data, size_t size) { pPush = &Input::PushBuffer<false>; PointerValue = data; Size = size; }
+	Input(eBuffer, void* data, size_t size) { pPush = &Input::PushBuffer<true>; PointerValue = data; Size = size; }
 #if LCBC_USE_CSL
 	Input(const string& value);
 	Input(const wstring& value);
@@ -246,6 +538,30 @@ public:
 	template<class T, class C, class P> Input(const priority_queue<T,C,P>& value) { pPush = &Input::PushQueue<priority_queue<T,C,P> >; PointerValue = &value; }
 	template<class T> Input(const valarray<T>& value) { pPush = &Input::PushValArray<valarray<T> >; PointerValue = &value; }
 	template<size_t N> Input(const bitset<N>& value) { pPush = &Input::PushValArray<bitset<N> >; PointerValue = &value; }
+	template<size_t N> Input(ePacked, const bitset<N>& value) { pPush = &Input::PushPacked<bitset<N> >; PointerValue = &value; }
+	template<class A> Input(ePacked, const vector<bool,A>& value) { pPush = &Input::PushPacked<vector<bool,A> >; PointerValue = &value; }
+#if LCBC_USE_CPP11
+	template<class K, class T, class H, class E, class A> Input(const unordered_map<K,T,H,E,A>& value) { pPush = &Input::PushMap<unordered_map<K,T,H,E,A> >; PointerValue = &value; }
+	template<class K, class T, class H, class E, class A> Input(const unordered_multimap<K,T,H,E,A>& value) { pPush = &Input::PushContainer<unordered_multimap<K,T,H,E,A> >; PointerValue = &value; }
+	template<class T, class H, class E, class A> Input(const unordered_set<T,H,E,A>& value) { pPush = &Input::PushSet<unordered_set<T,H,E,A> >; PointerValue = &value; }
+	template<class T, class H, class E, class A> Input(const unordered_multiset<T,H,E,A>& value) { pPush = &Input::PushSet<unordered_multiset<T,H,E,A> >; PointerValue = &value; }
+	template<class T, size_t N> Input(const array<T,N>& value) { pPush = &Input::PushArray<T>; PointerValue = value.data(); Size = N; }
+	template<class... T> Input(const tuple<T...>& value) { pPush = &Input::PushTuple<tuple<T...> >; PointerValue = &value; }
+#endif
+#if LCBC_HAS_OPTIONAL
+	template<class T> Input(const optional<T>& value) { pPush = &Input::PushOptional<T>; PointerValue = &value; }
+#endif
+#if LCBC_HAS_SPAN
+	template<class T, size_t E> Input(span<T,E> value) { pPush = &Input::PushArray<typename remove_const<T>::type>; PointerValue = value.data(); Size = value.size(); }
+#endif
+#if LCBC_HAS_FLAT
+	template<class K, class T, class C, class KC, class TC> Input(const flat_map<K,T,C,KC,TC>& value) { pPush = &Input::PushMap<flat_map<K,T,C,KC,TC> >; PointerValue = &value; }
+	template<class K, class T, class C, class KC, class TC> Input(const flat_multimap<K,T,C,KC,TC>& value) { pPush = &Input::PushContainer<flat_multimap<K,T,C,KC,TC> >; PointerValue = &value; }
+	template<class T, class C, class KC> Input(const flat_set<T,C,KC>& value) { pPush = &Input::PushSet<flat_set<T,C,KC> >; PointerValue = &value; }
+	template<class T, class C, class KC> Input(const flat_multiset<T,C,KC>& value) { pPush = &Input::PushSet<flat_multiset<T,C,KC> >; PointerValue = &value; }
+#endif
+	template<class T, class A> Input(eTypedArray, const vector<T,A>& value) { pPush = &Input::PushTypedContainer<vector<T,A>,T>; PointerValue = &value; }
+	template<class T> Input(eTypedArray, const valarray<T>& value) { pPush = &Input::PushTypedContainer<valarray<T>,T>; PointerValue = &value; }
 #endif
 #if LCBC_USE_MFC
 	Input(const CStringA& value);
@@ -301,17 +617,34 @@ private:
 	void PushNumber(lua_State* L) const { lua_pushnumber(L, NumberValue); }
 	void PushFunction(lua_State* L) const { lua_pushcclosure(L, FunctionValue, (int)Size); }
 	void PushRegistry(lua_State* L) const { ((const Registry*)PointerValue)->get().Push(L); lua_rawget(L, LUA_REGISTRYINDEX); }
+	void PushTableView(lua_State* L) const;
+	void PushFunctionView(lua_State* L) const;
+	void PushEnvironment(lua_State* L) const;
+#if LCBC_USE_CPP11
+	void PushChannel(lua_State* L) const;
+#endif
+	void PushSnapshot(lua_State* L) const;
+	void PushDataset(lua_State* L) const;
+	void PushStateValue(lua_State* L) const;
+	template<class H> void PushReference(lua_State* L) const;
 	template<class T> void PushNumber(lua_State* L) const { lua_pushnumber(L, lua_Number(*(T*)PointerValue)); }
 	template<class T> void PushValue(lua_State* L) const;
 	template<class T> void PushSizedValue(lua_State* L) const;
 	template<class T> void PushArray(lua_State* L) const;
 	template<class T, size_t L2> void Push2DArray(lua_State* L) const;
+	template<class T> void PushTypedArray(lua_State* L) const;
+	template<class T, size_t L2> void PushTyped2DArray(lua_State* L) const;
+	template<class C, class T> void PushTypedContainer(lua_State* L) const;
+	template<bool W> void PushBuffer(lua_State* L) const;
 	template<class T> void PushContainer(lua_State* L, const T* val) const;
 	template<class T> void PushContainer(lua_State* L) const { return PushContainer(L, (const T*)PointerValue); }
 	template<class T> void PushSet(lua_State* L) const;
 	template<class T> void PushMap(lua_State* L) const;
 	template<class T> void PushQueue(lua_State* L) const;
 	template<class T> void PushValArray(lua_State* L) const;
+	template<class T> void PushPacked(lua_State* L) const;
+	template<class T> void PushTuple(lua_State* L) const;
+	template<class T> void PushOptional(lua_State* L) const;
 	template<class T> void PushPair(lua_State* L) const;
 	template<class T> void PushCArray(lua_State* L) const;
 	template<class T> void PushCList(lua_State* L) const;
@@ -346,24 +679,79 @@ class Output
 public:
 	Output(eNil) { pGet = &Output::GetNil; }
 	Output(const Registry& value) { pGet = &Output::GetRegistry; PointerValue = (void*)&value; }
+	Output(TableView& value) { pGet = &Output::GetTableView; PointerValue = &value; }
+	Output(ResultsView& value) { pGet = &Output::GetResults; PointerValue = &value; }
+	Output(FunctionView& value) { pGet = &Output::GetFunctionView; PointerValue = &value; }
+#if LCBC_USE_CPP11
+	template<class S> Output(LuaFunction<S>& value) { pGet = &Output::GetFunctionView; PointerValue = (FunctionView*)&value; }
+	Output(Channel& value) { pGet = &Output::GetChannel; PointerValue = &value; }
+#endif
+	Output(Snapshot& value) { pGet = &Output::GetSnapshot; PointerValue = &value; }
 	template<class T> Output(T& value) { pGet = &Output::GetValue<T>; PointerValue = &value; }
-	template<class T> Output(size_t& size, T* value) { memset(value, 0, size*sizeof(T)); pGet = &Output::GetArray<T>; pSize = &size; PointerValue = value; }
+	template<class T> Output(size_t& size, T* value) { pGet = &Output::GetArray<T>; pSize = &size; PointerValue = value; }
 	template<class T> Output(const T*& value, size_t& size) { pGet = &Output::GetSizedValue<T>; pSize = &size; PointerValue = &value; }
 	template<class T, size_t L2> Output(size_t& len1, T value[][L2]) {pGet = &Output::Get2DArray<T,L2>; pSize = &len1; PointerValue = value;  }
+	template<class T> Output(T& value, eOverwrite) { *this = Output(value); }
+	template<class T> Output(eTypedArray, size_t& size, T* value) { pGet = &Output::GetTypedArray<T>; pSize = &size; PointerValue = value; }
+	Output(eBuffer, size_t& size, void* data) { pGet = &Output::GetBuffer; pSize = &size; PointerValue = data; }
 #if LCBC_USE_CSL
 	template<class T1, class T2> Output(pair<T1,T2>& value)  { pGet = &Output::GetPair<pair<T1,T2> >; PointerValue = &value; }
-	template<class T, class A> Output(vector<T,A>& value) { pGet = &Output::GetContainer<vector<T,A> >; PointerValue = &value; }
-	template<class T, class A> Output(list<T,A>& value) { pGet = &Output::GetContainer<list<T,A> >; PointerValue = &value; }
-	template<class T, class A> Output(deque<T,A>& value) { pGet = &Output::GetContainer<deque<T,A> >; PointerValue = &value; }
-	template<class K, class T, class C, class A> Output(map<K,T,C,A>& value) { pGet = &Output::GetMap<map<K,T,C,A> >; PointerValue = &value; }
-	template<class K, class T, class C, class A> Output(multimap<K,T,C,A>& value) { pGet = &Output::GetMultiMap<multimap<K,T,C,A> >; PointerValue = &value; }
-	template<class T, class C, class A> Output(set<T,C,A>& value) { pGet = &Output::GetSet<set<T,C,A> >; PointerValue = &value; }
-	template<class T, class C, class A> Output(multiset<T,C,A>& value) { pGet = &Output::GetSet<multiset<T,C,A> >; PointerValue = &value; }
-	template<class T, class C> Output(queue<T,C>& value) { pGet = &Output::GetQueue<queue<T,C> >; PointerValue = &value; }
-	template<class T, class C> Output(stack<T,C>& value) { pGet = &Output::GetQueue<stack<T,C> >; PointerValue = &value; }
-	template<class T, class C, class P> Output(priority_queue<T,C,P>& value) { pGet = &Output::GetQueue<priority_queue<T,C,P> >; PointerValue = &value; }
+	template<class T, class A> Output(vector<T,A>& value) { pGet = &Output::GetContainer<vector<T,A>,false>; PointerValue = &value; }
+	template<class T, class A> Output(list<T,A>& value) { pGet = &Output::GetContainer<list<T,A>,false>; PointerValue = &value; }
+	template<class T, class A> Output(deque<T,A>& value) { pGet = &Output::GetContainer<deque<T,A>,false>; PointerValue = &value; }
+	template<class K, class T, class C, class A> Output(map<K,T,C,A>& value) { pGet = &Output::GetMap<map<K,T,C,A>,false>; PointerValue = &value; }
+	template<class K, class T, class C, class A> Output(multimap<K,T,C,A>& value) { pGet = &Output::GetMultiMap<multimap<K,T,C,A>,false>; PointerValue = &value; }
+	template<class T, class C, class A> Output(set<T,C,A>& value) { pGet = &Output::GetSet<set<T,C,A>,false,false>; PointerValue = &value; }
+	template<class T, class C, class A> Output(multiset<T,C,A>& value) { pGet = &Output::GetSet<multiset<T,C,A>,true,false>; PointerValue = &value; }
+	template<class T, class C> Output(queue<T,C>& value) { pGet = &Output::GetQueue<queue<T,C>,false>; PointerValue = &value; }
+	template<class T, class C> Output(stack<T,C>& value) { pGet = &Output::GetQueue<stack<T,C>,false>; PointerValue = &value; }
+	template<class T, class C, class P> Output(priority_queue<T,C,P>& value) { pGet = &Output::GetQueue<priority_queue<T,C,P>,false>; PointerValue = &value; }
+	template<class T, class A> Output(vector<T,A>& value, eOverwrite) { pGet = &Output::GetContainer<vector<T,A>,true>; PointerValue = &value; }
+	template<class T, class A> Output(list<T,A>& value, eOverwrite) { pGet = &Output::GetContainer<list<T,A>,true>; PointerValue = &value; }
+	template<class T, class A> Output(deque<T,A>& value, eOverwrite) { pGet = &Output::GetContainer<deque<T,A>,true>; PointerValue = &value; }
+	template<class K, class T, class C, class A> Output(map<K,T,C,A>& value, eOverwrite) { pGet = &Output::GetMap<map<K,T,C,A>,true>; PointerValue = &value; }
+	template<class K, class T, class C, class A> Output(multimap<K,T,C,A>& value, eOverwrite) { pGet = &Output::GetMultiMap<multimap<K,T,C,A>,true>; PointerValue = &value; }
+	template<class T, class C, class A> Output(set<T,C,A>& value, eOverwrite) { pGet = &Output::GetSet<set<T,C,A>,false,true>; PointerValue = &value; }
+	template<class T, class C, class A> Output(multiset<T,C,A>& value, eOverwrite) { pGet = &Output::GetSet<multiset<T,C,A>,true,true>; PointerValue = &value; }
+	template<class T, class C> Output(queue<T,C>& value, eOverwrite) { pGet = &Output::GetQueue<queue<T,C>,true>; PointerValue = &value; }
+	template<class T, class C> Output(stack<T,C>& value, eOverwrite) { pGet = &Output::GetQueue<stack<T,C>,true>; PointerValue = &value; }
+	template<class T, class C, class P> Output(priority_queue<T,C,P>& value, eOverwrite) { pGet = &Output::GetQueue<priority_queue<T,C,P>,true>; PointerValue = &value; }
 	template<class T> Output(valarray<T>& value) { pGet = &Output::GetValArray<valarray<T>,T>; PointerValue = &value; }
 	template<size_t N> Output(bitset<N>& value) { pGet = &Output::GetBitSet<bitset<N> >; PointerValue = &value; }
+	template<size_t N> Output(ePacked, bitset<N>& value) { pGet = &Output::GetPacked<bitset<N> >; PointerValue = &value; }
+	template<class A> Output(ePacked, vector<bool,A>& value) { pGet = &Output::GetPacked<vector<bool,A> >; PointerValue = &value; }
+#if LCBC_USE_CPP11
+	template<class K, class T, class H, class E, class A> Output(unordered_map<K,T,H,E,A>& value) { pGet = &Output::GetMap<unordered_map<K,T,H,E,A>,false>; PointerValue = &value; }
+	template<class K, class T, class H, class E, class A> Output(unordered_multimap<K,T,H,E,A>& value) { pGet = &Output::GetMultiMap<unordered_multimap<K,T,H,E,A>,false>; PointerValue = &value; }
+	template<class T, class H, class E, class A> Output(unordered_set<T,H,E,A>& value) { pGet = &Output::GetSet<unordered_set<T,H,E,A>,false,false>; PointerValue = &value; }
+	template<class T, class H, class E, class A> Output(unordered_multiset<T,H,E,A>& value) { pGet = &Output::GetSet<unordered_multiset<T,H,E,A>,true,false>; PointerValue = &value; }
+	template<class K, class T, class H, class E, class A> Output(unordered_map<K,T,H,E,A>& value, eOverwrite) { pGet = &Output::GetMap<unordered_map<K,T,H,E,A>,true>; PointerValue = &value; }
+	template<class K, class T, class H, class E, class A> Output(unordered_multimap<K,T,H,E,A>& value, eOverwrite) { pGet = &Output::GetMultiMap<unordered_multimap<K,T,H,E,A>,true>; PointerValue = &value; }
+	template<class T, class H, class E, class A> Output(unordered_set<T,H,E,A>& value, eOverwrite) { pGet = &Output::GetSet<unordered_set<T,H,E,A>,false,true>; PointerValue = &value; }
+	template<class T, class H, class E, class A> Output(unordered_multiset<T,H,E,A>& value, eOverwrite) { pGet = &Output::GetSet<unordered_multiset<T,H,E,A>,true,true>; PointerValue = &value; }
+	template<class T, size_t N> Output(array<T,N>& value) { pGet = &Output::GetFixedArray<array<T,N>,T>; PointerValue = &value; }
+	template<class... T> Output(tuple<T...>& value) { pGet = &Output::GetTuple<tuple<T...> >; PointerValue = &value; }
+#endif
+#if LCBC_HAS_OPTIONAL
+	template<class T> Output(optional<T>& value) { pGet = &Output::GetOptional<T>; PointerValue = &value; }
+#endif
+#if LCBC_HAS_SPAN
+	template<class T, size_t E> Output(span<T,E>& value) { pGet = &Output::GetFixedArray<span<T,E>,T>; PointerValue = &value; }
+	template<class T> Output(eBuffer, span<T>& value) { pGet = &Output::GetBufferSpan<T>; PointerValue = &value; }
+#endif
+#if LCBC_HAS_FLAT
+	template<class K, class T, class C, class KC, class TC> Output(flat_map<K,T,C,KC,TC>& value) { pGet = &Output::GetMap<flat_map<K,T,C,KC,TC>,false>; PointerValue = &value; }
+	template<class K, class T, class C, class KC, class TC> Output(flat_multimap<K,T,C,KC,TC>& value) { pGet = &Output::GetMultiMap<flat_multimap<K,T,C,KC,TC>,false>; PointerValue = &value; }
+	template<class T, class C, class KC> Output(flat_set<T,C,KC>& value) { pGet = &Output::GetSet<flat_set<T,C,KC>,false,false>; PointerValue = &value; }
+	template<class T, class C, class KC> Output(flat_multiset<T,C,KC>& value) { pGet = &Output::GetSet<flat_multiset<T,C,KC>,true,false>; PointerValue = &value; }
+	template<class K, class T, class C, class KC, class TC> Output(flat_map<K,T,C,KC,TC>& value, eOverwrite) { pGet = &Output::GetMap<flat_map<K,T,C,KC,TC>,true>; PointerValue = &value; }
+	template<class K, class T, class C, class KC, class TC> Output(flat_multimap<K,T,C,KC,TC>& value, eOverwrite) { pGet = &Output::GetMultiMap<flat_multimap<K,T,C,KC,TC>,true>; PointerValue = &value; }
+	template<class T, class C, class KC> Output(flat_set<T,C,KC>& value, eOverwrite) { pGet = &Output::GetSet<flat_set<T,C,KC>,false,true>; PointerValue = &value; }
+	template<class T, class C, class KC> Output(flat_multiset<T,C,KC>& value, eOverwrite) { pGet = &Output::GetSet<flat_multiset<T,C,KC>,true,true>; PointerValue = &value; }
+#endif
+	template<class T, class A> Output(eTypedArray, vector<T,A>& value) { pGet = &Output::GetTypedContainer<vector<T,A>,T>; PointerValue = &value; }
+	template<class T> Output(eTypedArray, valarray<T>& value) { pGet = &Output::GetTypedContainer<valarray<T>,T>; PointerValue = &value; }
+	template<class T, class A> Output(eBuffer, vector<T,A>& value) { pGet = &Output::GetBufferContainer<vector<T,A> >; PointerValue = &value; }
 #endif
 #if LCBC_USE_MFC
 	template<class T, class A> Output(CArray<T,A>& value) { pGet = &Output::GetCArray<CArray<T,A>,T>; PointerValue = &value; }
@@ -392,6 +780,8 @@ public:
 #endif
 
 	void Get(lua_State* L, int idx) const  { (this->*pGet)(L, idx); }
+	// True for a ResultsView, which takes all the remaining values from idx to the top
+	bool MultipleResults() const { return pGet == &Output::GetResults; }
 private:
 	size_t GetSize(size_t s1) const { size_t s2=*pSize; *pSize=s1; return s1 < s2 ? s1 : s2; }
 	void GetNil(lua_State* /*L*/, int /*idx*/) const {}
@@ -402,18 +792,52 @@ private:
 		lua_pushvalue(L, idx);
 		lua_rawset(L, LUA_REGISTRYINDEX);
 	}
+	void GetTableView(lua_State* L, int idx) const;
+	void GetResults(lua_State* L, int idx) const;
+	void GetFunctionView(lua_State* L, int idx) const;
+#if LCBC_USE_CPP11
+	void GetChannel(lua_State* L, int idx) const;
+#endif
+	void GetSnapshot(lua_State* L, int idx) const;
 	template<class T> void GetValue(lua_State* L, int idx) const { *(T*)PointerValue = (T)luaL_checknumber(L, idx); }
 	template<class T> void GetSizedValue(lua_State* L, int idx) const;
 	template<class T> void GetArray(lua_State* L, int idx) const;
 	template<class T, size_t L2> void Get2DArray(lua_State* L, int idx) const;
+	template<class T> void GetTypedArray(lua_State* L, int idx) const;
+	template<class C, class T> void GetTypedContainer(lua_State* L, int idx) const;
+	void GetBuffer(lua_State* L, int idx) const;
+	template<class C> void GetBufferContainer(lua_State* L, int idx) const;
+#if LCBC_HAS_SPAN
+	template<class T> void GetBufferSpan(lua_State* L, int idx) const;
+#endif
 	template<class T> void GetPair(lua_State* L, int idx) const;
-	template<class T> void GetContainer(lua_State* L, int idx) const;
-	template<class T> void GetMultiMap(lua_State* L, int idx) const;
-	template<class T> void GetMap(lua_State* L, int idx) const;
-	template<class T> void GetSet(lua_State* L, int idx) const;
-	template<class T> void GetQueue(lua_State* L, int idx) const;
+	template<class T, bool fOverwrite> void GetContainer(lua_State* L, int idx) const;
+	template<class T, bool fOverwrite> void GetMultiMap(lua_State* L, int idx) const;
+	template<class T, bool fOverwrite> void GetMap(lua_State* L, int idx) const;
+	template<class T, bool fMultiple, bool fOverwrite> void GetSet(lua_State* L, int idx) const;
+	template<class T, bool fOverwrite> void GetQueue(lua_State* L, int idx) const;
+	template<class C, class T> void GetFixedArray(lua_State* L, int idx) const;
+	template<class T> void GetTuple(lua_State* L, int idx) const;
+	template<class T> void GetOptional(lua_State* L, int idx) const;
+	template<class T, bool fOverwrite> static void GetSequence(lua_State* L, int idx, T* v);
+	template<class V> static void GetElement(lua_State* L, int idx, V& value, bool fOverwrite)
+	{
+		if(fOverwrite)
+			Output(value, overwrite).Get(L, idx);
+		else
+			Output(value).Get(L, idx);
+	}
+#if LCBC_USE_CSL
+	static void GetElement(lua_State* L, int idx, vector<bool>::reference value, bool /*fOverwrite*/)
+	{
+		bool b;
+		Output(b).Get(L, idx);
+		value = b;
+	}
+#endif
 	template<class T, class V> void GetValArray(lua_State* L, int idx) const;
 	template<class T> void GetBitSet(lua_State* L, int idx) const;
+	template<class T> void GetPacked(lua_State* L, int idx) const;
 	template<class C, class T> void GetCArray(lua_State* L, int idx) const;
 	template<class C, class T> void GetCList(lua_State* L, int idx) const;
 	template<class T, class K, class V> void GetCMap(lua_State* L, int idx) const;
@@ -455,10 +879,266 @@ template<> inline void Input::PushSizedValue<void>(lua_State* L) const
 	memcpy(lua_newuserdata(L, Size), PointerValue, Size);
 }
 
+/* TablePool recycles the tables pushed for the container inputs of the Transient scripts, once enabled
+   by LuaT::SetTableRecycling. The tables created for the inputs of such a call, while LuaT pushes them,
+   are recorded in the registry set LuaClassBasedTablesUsed; the tables of callback results and other
+   values are neither taken nor recorded. After the call, those which did not escape are cleared and kept
+   in the registry list LuaClassBasedTablePool, from which the following inputs take their tables. A table
+   escapes if it is reachable from the results (through tables, metatables and function upvalues other
+   than the globals) or if the script has given it a metatable. Other references cannot be detected, which
+   is why only the scripts marked Transient are concerned: they must not keep their input tables in global
+   variables, in the registry or in userdata. Failed calls recycle nothing, nor the calls whose results
+   reach a thread or a userdata. The pool object is kept in the registry as LuaClassBasedRecycling and
+   cached by LuaT, and the recording is handed to NewTable through a thread-local variable, so that a
+   disabled pool costs no registry access. */
+class TablePool
+{
+public:
+	TablePool() : Max(0), Used(0) {}
+	static TablePool* Get(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedRecycling");
+		TablePool* pool = (TablePool*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(!pool)
+		{
+			pool = new(lua_newuserdata(L, sizeof(TablePool))) TablePool();
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedRecycling");
+		}
+		return pool;
+	}
+	bool enabled() const { return Max != 0; }
+	// Pushes a table taken from the pool recording the inputs pushed on L, or a new one
+	static void NewTable(lua_State* L, int narr, int nrec)
+	{
+#ifdef LCBC_THREAD_LOCAL
+		const Recorder& recorder = Current();
+		if(recorder.L == L)
+			return recorder.Pool->Take(L, narr, nrec);
+#endif
+		lua_createtable(L, narr, nrec);
+	}
+	// Keeps up to max tables, or disables the pool if max is 0
+	void Enable(lua_State* L, size_t max)
+	{
+		Max = max;
+		Used = 0;
+		if(!max)
+		{
+			lua_pushnil(L);
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablePool");
+			lua_pushnil(L);
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablesUsed");
+			return;
+		}
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablePool");
+		if(!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablePool");
+		}
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablesUsed");
+		for(size_t len=lua_objlen(L, -1);len > max;len--)
+		{
+			lua_pushnil(L);
+			lua_rawseti(L, -2, (int)len);
+		}
+		lua_pop(L, 1);
+	}
+	/* Records the tables pushed on L for the inputs of a call during its lifetime, unless pool is NULL
+	   or disabled. Stop ends the recording after a protected call, in case an error skipped the destructor. */
+	class Recording
+	{
+	public:
+		Recording(lua_State* L, TablePool* pool)
+		{
+#ifdef LCBC_THREAD_LOCAL
+			if(pool && pool->Max)
+			{
+				Current().L = L;
+				Current().Pool = pool;
+			}
+#else
+			(void)L; (void)pool;
+#endif
+		}
+		~Recording() { Stop(); }
+	private:
+		Recording(const Recording&);
+		Recording& operator=(const Recording&);
+	};
+	static void Stop()
+	{
+#ifdef LCBC_THREAD_LOCAL
+		Current().L = NULL;
+#endif
+	}
+	// Forgets the tables recorded by the calls which did not recycle them
+	void Begin(lua_State* L)
+	{
+		if(!Used)
+			return;
+		Used = 0;
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablesUsed");
+	}
+	// Recycles the input tables of a call which returned the values from first to last
+	void Recycle(lua_State* L, int first, int last)
+	{
+		if(!Used)
+			return;
+		Used = 0;
+		int top = lua_gettop(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablesUsed");
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablePool");
+		// The globals are marked as seen, so the walk does not enter them through _ENV or other references
+		lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+		lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+		lua_pushboolean(L, 1);
+		lua_rawset(L, top+3);
+		for(int i=first;i<=last;i++)
+		{
+			if(!Escape(L, i, top+1, top+3, 0))
+			{
+				lua_newtable(L);
+				lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablesUsed");
+				return lua_settop(L, top);
+			}
+		}
+		size_t len = lua_objlen(L, top+2);
+		lua_pushnil(L);
+		while(lua_next(L, top+1))
+		{
+			lua_pop(L, 1);
+			if(len < Max && !lua_getmetatable(L, -1))
+			{
+				Clear(L, lua_gettop(L));
+				lua_pushvalue(L, -1);
+				lua_rawseti(L, top+2, (int)++len);
+			}
+			else if(len < Max)
+				lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, top+1);
+		}
+		lua_settop(L, top);
+	}
+private:
+	struct Recorder
+	{
+		lua_State* L;
+		TablePool* Pool;
+	};
+#ifdef LCBC_THREAD_LOCAL
+	static Recorder& Current()
+	{
+		static LCBC_THREAD_LOCAL Recorder recorder = { NULL, NULL };
+		return recorder;
+	}
+#endif
+	// Pushes a table of the pool, or a new one if it is empty, and records it
+	void Take(lua_State* L, int narr, int nrec)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablePool");
+		int len = (int)lua_objlen(L, -1);
+		if(len)
+		{
+			lua_rawgeti(L, -1, len);
+			lua_pushnil(L);
+			lua_rawseti(L, -3, len);
+		}
+		else
+			lua_createtable(L, narr, nrec);
+		lua_replace(L, -2);
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTablesUsed");
+		lua_pushvalue(L, -2);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+		Used++;
+	}
+	/* Removes from the set used the tables reachable from the value at idx; returns false if it is too deep,
+	   or if it reaches a thread or a userdata, whose references cannot be followed */
+	static bool Escape(lua_State* L, int idx, int used, int seen, int depth)
+	{
+		int type = lua_type(L, idx);
+		if(type == LUA_TTHREAD || type == LUA_TUSERDATA)
+			return false;
+		if(type != LUA_TTABLE && type != LUA_TFUNCTION)
+			return true;
+		if(depth > 200 || !lua_checkstack(L, 4))
+			return false;
+		lua_pushvalue(L, idx);
+		lua_rawget(L, seen);
+		bool visited = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 1);
+		if(visited)
+			return true;
+		lua_pushvalue(L, idx);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, seen);
+		bool res = true;
+		if(type == LUA_TFUNCTION)
+		{
+			for(int n=1;res;n++)
+			{
+				const char* name = lua_getupvalue(L, idx, n);
+				if(!name)
+					break;
+				// The _ENV upvalue is the globals or the table of an Environment, not a result
+				if(strcmp(name, "_ENV"))
+					res = Escape(L, lua_gettop(L), used, seen, depth+1);
+				lua_pop(L, 1);
+			}
+			return res;
+		}
+		lua_pushvalue(L, idx);
+		lua_pushnil(L);
+		lua_rawset(L, used);
+		if(lua_getmetatable(L, idx))
+		{
+			res = Escape(L, lua_gettop(L), used, seen, depth+1);
+			lua_pop(L, 1);
+		}
+		lua_pushnil(L);
+		while(res && lua_next(L, idx))
+		{
+			int top = lua_gettop(L);
+			res = Escape(L, top-1, used, seen, depth+1) && Escape(L, top, used, seen, depth+1);
+			lua_pop(L, 1);
+		}
+		if(!res)
+			lua_pop(L, 1);
+		return res;
+	}
+	static void Clear(lua_State* L, int idx)
+	{
+		lua_pushnil(L);
+		while(lua_next(L, idx))
+		{
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, idx);
+		}
+	}
+	size_t Max;
+	// Number of tables recorded since the last recycling
+	size_t Used;
+};
+
 template<class T> inline void Input::PushArray(lua_State* L) const
 {
 	const T* arr = (const T*)PointerValue;
-	lua_createtable(L, (int)Size, 0);
+	TablePool::NewTable(L, (int)Size, 0);
 	for(size_t i=0;i<Size;i++)
 	{
 		Input input(arr[i]);
@@ -470,7 +1150,7 @@ template<class T> inline void Input::PushArray(lua_State* L) const
 template<class T, size_t L2> inline void Input::Push2DArray(lua_State* L) const
 {
 	const T (*arr)[L2] = (const T(*)[L2])PointerValue;
-	lua_createtable(L, (int)Size, 0);
+	TablePool::NewTable(L, (int)Size, 0);
 	for(size_t i=0;i<Size;i++)
 	{
 		Input input(L2, arr[i]);
@@ -543,19 +1223,54 @@ template<> inline void Output::GetArray<char>(lua_State* L, int idx) const
 	memcpy(PointerValue, luaL_checkstring(L, idx), len);
 }
 
+// Reads the first len elements of the table at idx into arr.
+// Numbers take a tight loop with raw access and direct conversion; other types go through Output.
+template<class T, bool number = (int)NumberTraits<T>::type != (int)NotNumber> struct ArrayReader
+{
+	static void Get(lua_State* L, int idx, T* arr, size_t len)
+	{
+		int top = lua_gettop(L);
+		for(size_t i=0;i<len;i++)
+		{
+			lua_rawgeti(L, idx, (int)i+1);
+			Output output(arr[i]);
+			output.Get(L, top+1);
+			lua_settop(L, top);
+		}
+	}
+};
+
+template<class T> struct ArrayReader<T, true>
+{
+	static void Get(lua_State* L, int idx, T* arr, size_t len)
+	{
+		int top = lua_gettop(L);
+		for(size_t i=0;i<len;i++)
+		{
+			lua_rawgeti(L, idx, (int)i+1);
+#if LUA_VERSION_NUM >= 503
+			if((int)NumberTraits<T>::type < (int)Float && lua_isinteger(L, top+1))
+				arr[i] = (T)lua_tointeger(L, top+1);
+			else
+#endif
+			if(lua_type(L, top+1) == LUA_TNUMBER)
+				arr[i] = (T)lua_tonumber(L, top+1);
+			else
+				arr[i] = (T)luaL_checknumber(L, top+1);
+			lua_settop(L, top);
+		}
+	}
+};
+
 template<class T> inline void Output::GetArray(lua_State* L, int idx) const
 {
 	T* arr = (T*)PointerValue;
 	luaL_checktype(L, idx, LUA_TTABLE);
+	size_t capacity = *pSize;
 	size_t len = GetSize(lua_objlen(L, idx));
-	int top = lua_gettop(L);
-	for(size_t i=0;i<len;i++)
-	{
-		lua_rawgeti(L, idx, (int)i+1);
-		Output output(arr[i]);
-		output.Get(L,top+1);
-		lua_settop(L, top);
-	}
+	ArrayReader<T>::Get(L, idx, arr, len);
+	for(size_t i=len;i<capacity;i++)
+		arr[i] = T();
 }
 
 template<class T, size_t L2> inline void Output::Get2DArray(lua_State* L, int idx) const
@@ -574,884 +1289,1901 @@ template<class T, size_t L2> inline void Output::Get2DArray(lua_State* L, int id
 	}
 }
 
-template<> inline void Input::PushValue<wchar_t>(lua_State* L) const
+inline size_t TypedArray::ElementSize(int type)
 {
-	WideString::Push(L, (const wchar_t*)PointerValue);
+	switch(type)
+	{
+	case Int8: case UInt8: return 1;
+	case Int16: case UInt16: return 2;
+	case Int32: case UInt32: case Float: return 4;
+	default: return 8;
+	}
 }
 
-template<> inline void Input::PushSizedValue<wchar_t>(lua_State* L) const
+inline const char* TypedArray::TypeName(int type)
 {
-	WideString::Push(L, (const wchar_t*)PointerValue, Size);
+	static const char* const names[] = { "none", "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64", "float", "double" };
+	return names[type];
 }
 
-template<> inline void Output::GetArray<wchar_t>(lua_State* L, int idx) const
+template<class Op> inline void TypedArray::Apply(const Header* h, Op& op)
 {
-	size_t size;
-	const wchar_t* str = WideString::Get(L, idx, size);
-	memcpy(PointerValue, str, GetSize(size+1)*sizeof(wchar_t));
+	const void* data = Data(h);
+	switch(h->type)
+	{
+	case Int8: op((const signed char*)data, h->length); break;
+	case UInt8: op((const unsigned char*)data, h->length); break;
+	case Int16: op((const short*)data, h->length); break;
+	case UInt16: op((const unsigned short*)data, h->length); break;
+	case Int32: op((const int*)data, h->length); break;
+	case UInt32: op((const unsigned int*)data, h->length); break;
+	case Int64: op((const long long*)data, h->length); break;
+	case UInt64: op((const unsigned long long*)data, h->length); break;
+	case Float: op((const float*)data, h->length); break;
+	case Double: op((const double*)data, h->length); break;
+	}
 }
 
-template<> inline void Output::GetValue<const wchar_t*>(lua_State* L, int idx) const
+inline void TypedArray::PushMetatable(lua_State* L)
 {
-	*(const wchar_t**)PointerValue = WideString::Get(L, idx);
+	if(!luaL_newmetatable(L, "LuaClassBasedTypedArray"))
+		return;
+	static const luaL_Reg methods[] = {
+		{ "sum", Sum }, { "min", Min }, { "max", Max }, { "totable", ToTable }, 
+		{ "copy", Copy }, { "shape", Shape }, { "type", Type }, { "at", At }, { NULL, NULL } };
+	lua_createtable(L, 0, sizeof(methods)/sizeof(methods[0])-1);
+	for(const luaL_Reg* m=methods;m->name;m++)
+	{
+		lua_pushcfunction(L, m->func);
+		lua_setfield(L, -2, m->name);
+	}
+	lua_pushcclosure(L, Index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, NewIndex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, Len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, ToString);
+	lua_setfield(L, -2, "__tostring");
 }
 
-template<> inline void Output::GetSizedValue<wchar_t>(lua_State* L, int idx) const
+inline void* TypedArray::Push(lua_State* L, int type, size_t length, size_t rows, size_t columns)
 {
-	*(const wchar_t**)PointerValue = WideString::Get(L, idx, *pSize);
+	Header* h = (Header*)lua_newuserdata(L, HeaderSize() + length*ElementSize(type));
+	h->type = type;
+	h->length = length;
+	h->rows = rows;
+	h->columns = columns;
+	PushMetatable(L);
+	lua_setmetatable(L, -2);
+	return Data(h);
 }
 
-#if LCBC_USE_CSL
-// This class is a hack to access the container member in adapters!
-template<class T> class myqueue : public T
+inline TypedArray::Header* TypedArray::To(lua_State* L, int idx)
 {
-public:
-	myqueue(const T& src) : T(src) {}
-	typename T::container_type& get_container() { return this->c; }
-};
+	void* ud = lua_touserdata(L, idx);
+	if(!ud || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, "LuaClassBasedTypedArray");
+	int equal = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return equal ? (Header*)ud : NULL;
+}
 
-template<class T> inline void Input::PushPair(lua_State* L) const
+inline TypedArray::Header* TypedArray::Check(lua_State* L, int idx)
 {
-	const T* p = (const T*)PointerValue;
-	lua_createtable(L, 2, 0);
-	Input first(p->first);
-	first.Push(L);
-	lua_rawseti(L, -2, 1);
-	Input second(p->second);
-	second.Push(L);
-	lua_rawseti(L, -2, 2);
+	return (Header*)luaL_checkudata(L, idx, "LuaClassBasedTypedArray");
 }
 
-template<class T> inline void Input::PushMap(lua_State* L) const
+inline void TypedArray::PushAt(lua_State* L, const Header* h, size_t i)
 {
-	const T* m = (const T*)PointerValue;
-	typename T::const_iterator it;
-	lua_createtable(L, 0, (int)m->size());
-	for (it=m->begin() ; it != m->end(); it++)
+	const void* data = Data(h);
+	switch(h->type)
 	{
-		Input key(it->first);
-		key.Push(L);
-		Input value(it->second);
-		value.Push(L);
-		lua_settable(L, -3);
+	case Int8: lua_pushinteger(L, ((const signed char*)data)[i]); break;
+	case UInt8: lua_pushinteger(L, ((const unsigned char*)data)[i]); break;
+	case Int16: lua_pushinteger(L, ((const short*)data)[i]); break;
+	case UInt16: lua_pushinteger(L, ((const unsigned short*)data)[i]); break;
+	case Int32: lua_pushinteger(L, ((const int*)data)[i]); break;
+	case UInt32: lua_pushnumber(L, (lua_Number)((const unsigned int*)data)[i]); break;
+	case Int64: lua_pushnumber(L, (lua_Number)((const long long*)data)[i]); break;
+	case UInt64: lua_pushnumber(L, (lua_Number)((const unsigned long long*)data)[i]); break;
+	case Float: lua_pushnumber(L, ((const float*)data)[i]); break;
+	case Double: lua_pushnumber(L, ((const double*)data)[i]); break;
 	}
 }
 
-template<class T> inline void Input::PushContainer(lua_State* L, const T* v) const
+inline void TypedArray::SetAt(Header* h, size_t i, lua_Number value)
 {
-	lua_createtable(L, (int)v->size(), 0);
-	typename T::const_iterator it;
-	int i=0;
-	for (it=v->begin(); it != v->end(); it++,i++)
+	void* data = Data(h);
+	switch(h->type)
 	{
-		lua_pushinteger(L, i+1);
-		Input input(*it);
-		input.Push(L);
-		lua_settable(L, -3);
+	case Int8: ((signed char*)data)[i] = (signed char)value; break;
+	case UInt8: ((unsigned char*)data)[i] = (unsigned char)value; break;
+	case Int16: ((short*)data)[i] = (short)value; break;
+	case UInt16: ((unsigned short*)data)[i] = (unsigned short)value; break;
+	case Int32: ((int*)data)[i] = (int)value; break;
+	case UInt32: ((unsigned int*)data)[i] = (unsigned int)value; break;
+	case Int64: ((long long*)data)[i] = (long long)value; break;
+	case UInt64: ((unsigned long long*)data)[i] = (unsigned long long)value; break;
+	case Float: ((float*)data)[i] = (float)value; break;
+	case Double: ((double*)data)[i] = (double)value; break;
 	}
 }
 
-template<class T> inline void Input::PushSet(lua_State* L) const
+template<class T> struct TypedArrayConvert
 {
-	const T* s = (const T*)PointerValue;
-	typename T::const_iterator it;
-	lua_createtable(L, 0, (int)s->size());
-	for (it=s->begin() ; it != s->end(); it++)
-	{
-		Input key(*it);
-		key.Push(L);
-		lua_pushinteger(L, s->count(*it));
-		lua_settable(L, -3);
+	T* dst;
+	size_t count;
+	template<class S> void operator()(const S* src, size_t /*len*/) 
+	{ 
+		for(size_t i=0;i<count;i++) 
+			dst[i] = (T)src[i]; 
 	}
-}
+};
 
-template<> inline void Input::PushValue<string>(lua_State* L) const
+template<class T> inline void TypedArray::CopyOut(const Header* h, T* dst, size_t len)
 {
-	string* str = (string*)PointerValue;
-	lua_pushlstring(L, str->data(), str->size());
+	if(len > h->length)
+		len = h->length;
+	if(h->type == (int)NumberTraits<T>::type)
+		memcpy(dst, Data(h), len*sizeof(T));
+	else
+	{
+		TypedArrayConvert<T> op = { dst, len };
+		Apply(h, op);
+	}
 }
 
-inline Input::Input(const string& value) 
-{ 
-	pPush = &Input::PushValue<string>; 
-	PointerValue = &value; 
-}
+struct TypedArrayReduce
+{
+	lua_Number sum, min, max;
+	template<class S> void operator()(const S* src, size_t len)
+	{
+		sum = 0;
+		if(len == 0)
+			return;
+		S lo = src[0], hi = src[0];
+		for(size_t i=0;i<len;i++)
+		{
+			S value = src[i];
+			sum += (lua_Number)value;
+			if(value < lo)
+				lo = value;
+			if(value > hi)
+				hi = value;
+		}
+		min = (lua_Number)lo;
+		max = (lua_Number)hi;
+	}
+};
 
-template<class T> inline void Input::PushQueue(lua_State* L) const
+inline size_t TypedArray::CheckIndex(lua_State* L, const Header* h, int arg)
 {
-	const T* q = (const T*)PointerValue;
-	myqueue<T> copy(*q);
-	typename T::container_type& c = copy.get_container();
-	PushContainer(L, &c);
+	lua_Number n = luaL_checknumber(L, arg);
+	if(n < 1 || n > (lua_Number)h->length)
+		luaL_error(L, "index %f out of range [1, %d]", n, (int)h->length);
+	return (size_t)n - 1;
 }
 
-template<class T> inline void Input::PushValArray(lua_State* L) const
+inline int TypedArray::Index(lua_State* L)
 {
-	const T* v = (const T*)PointerValue;
-	size_t size = v->size();
-	lua_createtable(L, (int)size, 0);
-	for(size_t i=0;i<size;i++)
+	const Header* h = Check(L, 1);
+	if(lua_type(L, 2) == LUA_TNUMBER)
 	{
-		Input input((*v)[i]);
-		input.Push(L);
-		lua_rawseti(L, -2, (int)i+1);
+		lua_Number n = lua_tonumber(L, 2);
+		if(n >= 1 && n <= (lua_Number)h->length && n == (lua_Number)(size_t)n)
+			PushAt(L, h, (size_t)n - 1);
+		else
+			lua_pushnil(L);
+		return 1;
 	}
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	return 1;
 }
 
-template<class T> inline void Output::GetPair(lua_State* L, int idx) const
+inline int TypedArray::NewIndex(lua_State* L)
 {
-	T* p = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	lua_rawgeti(L, idx, 1);
-	lua_rawgeti(L, idx, 2);
-	Output o1(p->first);
-	o1.Get(L, top+1);
-	Output o2(p->second);
-	o2.Get(L, top+2);
-	lua_settop(L, top);
+	Header* h = Check(L, 1);
+	SetAt(h, CheckIndex(L, h, 2), luaL_checknumber(L, 3));
+	return 0;
 }
 
-template<> inline void Output::GetValue<string>(lua_State* L, int idx) const
+inline int TypedArray::Len(lua_State* L)
 {
-	size_t size; 
-	const char* str = luaL_checklstring(L, idx, &size); 
-	((string*)PointerValue)->assign(str, size);
+	lua_pushinteger(L, (lua_Integer)Check(L, 1)->length);
+	return 1;
 }
 
-template<class T> inline void Output::GetContainer(lua_State* L, int idx) const
+inline int TypedArray::ToString(lua_State* L)
 {
-	T* v = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	size_t len = lua_objlen(L, idx);
-	int top = lua_gettop(L);
-	for(size_t i=0;i<len;i++)
-	{
-		lua_rawgeti(L, idx, (int)i+1);
-		typename T::value_type value;
-		Output output(value);
-		output.Get(L, top+1);
-		v->push_back(value);
-		lua_settop(L, top);
-	}
+	const Header* h = Check(L, 1);
+	lua_pushfstring(L, "typedarray<%s>[%d]: %p", TypeName(h->type), (int)h->length, h);
+	return 1;
 }
 
-template<class T> inline void Output::GetMultiMap(lua_State* L, int idx) const
+inline int TypedArray::Sum(lua_State* L)
 {
-	T* v = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	size_t len = lua_objlen(L, idx);
-	int top = lua_gettop(L);
-	for(size_t i=0;i<len;i++)
-	{
-		lua_rawgeti(L, idx, (int)i+1);
-		pair<typename T::key_type, typename T::mapped_type> value;
-		Output output(value);
-		output.Get(L, top+1);
-		v->insert(value);
-		lua_settop(L, top);
-	}
+	TypedArrayReduce op;
+	Apply(Check(L, 1), op);
+	lua_pushnumber(L, op.sum);
+	return 1;
 }
-template<class T> inline void Output::GetSet(lua_State* L, int idx) const
+
+inline int TypedArray::Min(lua_State* L)
 {
-	T* s = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	lua_pushnil(L);
-	while (lua_next(L, idx) != 0)
-	{
-		lua_pushvalue(L, top+1);
-		typename T::value_type key;
-		Output outputKey(key);
-		outputKey.Get(L, top+3);
-		int val = luaL_checkint(L, top+2);
-		lua_settop(L, top+1);
-		for(int i=0;i<val;i++)
-			s->insert(key);
-	}
-	lua_settop(L, top);
+	const Header* h = Check(L, 1);
+	if(h->length == 0)
+		return 0;
+	TypedArrayReduce op;
+	Apply(h, op);
+	lua_pushnumber(L, op.min);
+	return 1;
 }
 
-template<class T> inline void Output::GetMap(lua_State* L, int idx) const
+inline int TypedArray::Max(lua_State* L)
 {
-	T* m = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	lua_pushnil(L);
-	while (lua_next(L, idx) != 0)
-	{
-		lua_pushvalue(L, top+1);
-		typename T::key_type key;
-		Output outputKey(key);
-		outputKey.Get(L, top+3);
-		typename T::mapped_type value;
-		Output output(value);
-		output.Get(L, top+2);
-		lua_settop(L, top+1);
-		(*m)[key] = value;
-	}
-	lua_settop(L, top);
+	const Header* h = Check(L, 1);
+	if(h->length == 0)
+		return 0;
+	TypedArrayReduce op;
+	Apply(h, op);
+	lua_pushnumber(L, op.max);
+	return 1;
 }
 
-template<class T> inline void Output::GetQueue(lua_State* L, int idx) const
+inline int TypedArray::ToTable(lua_State* L)
 {
-	T* q = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	size_t len = lua_objlen(L, idx);
-	int top = lua_gettop(L);
-	for(size_t i=0;i<len;i++)
+	const Header* h = Check(L, 1);
+	lua_Integer first = luaL_optinteger(L, 2, 1);
+	lua_Integer last = luaL_optinteger(L, 3, (lua_Integer)h->length);
+	if(first < 1)
+		first = 1;
+	if(last > (lua_Integer)h->length)
+		last = (lua_Integer)h->length;
+	lua_createtable(L, last >= first ? (int)(last-first+1) : 0, 0);
+	for(lua_Integer i=first;i<=last;i++)
 	{
-		lua_rawgeti(L, idx, (int)i+1);
-		typename T::value_type value;
-		Output output(value);
-		output.Get(L, top+1);
-		q->push(value);
-		lua_settop(L, top);
+		PushAt(L, h, (size_t)i-1);
+		lua_rawseti(L, -2, (int)(i-first+1));
 	}
+	return 1;
 }
 
-template<class T, class V> inline void Output::GetValArray(lua_State* L, int idx) const
+inline int TypedArray::Copy(lua_State* L)
 {
-	T* v = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	size_t len = lua_objlen(L, idx);
-	v->resize(len);
-	int top = lua_gettop(L);
-	for(size_t i=0;i<len;i++)
-	{
-		lua_rawgeti(L, idx, (int)i+1);
-		V value;
-		Output output(value);
-		output.Get(L, top+1);
-		(*v)[i] = value;
-		lua_settop(L, top);
-	}
+	const Header* h = Check(L, 1);
+	memcpy(Push(L, h->type, h->length, h->rows, h->columns), Data(h), h->length*ElementSize(h->type));
+	return 1;
 }
 
-template<class T> inline void Output::GetBitSet(lua_State* L, int idx) const
+inline int TypedArray::Shape(lua_State* L)
 {
-	T* v = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	size_t len = lua_objlen(L, idx);
-	int top = lua_gettop(L);
-	for(size_t i=0;i<len;i++)
+	const Header* h = Check(L, 1);
+	if(h->columns == 0)
 	{
-		lua_rawgeti(L, idx, (int)i+1);
-		bool value;
-		Output output(value);
-		output.Get(L, top+1);
-		(*v)[i] = value;
-		lua_settop(L, top);
+		lua_pushinteger(L, (lua_Integer)h->length);
+		return 1;
 	}
+	lua_pushinteger(L, (lua_Integer)h->rows);
+	lua_pushinteger(L, (lua_Integer)h->columns);
+	return 2;
 }
 
-#if LCBC_USE_WIDESTRING
-template<> inline void Input::PushValue<wstring>(lua_State* L) const
+inline int TypedArray::Type(lua_State* L)
 {
-	wstring* str = (wstring*)PointerValue;
-	WideString::Push(L, str->data(), str->size());
+	lua_pushstring(L, TypeName(Check(L, 1)->type));
+	return 1;
 }
 
-inline Input::Input(const wstring& value) 
-{ 
-	pPush = &Input::PushValue<wstring>; 
-	PointerValue = &value; 
+inline int TypedArray::At(lua_State* L)
+{
+	const Header* h = Check(L, 1);
+	size_t columns = h->columns ? h->columns : 1;
+	lua_Integer row = luaL_checkinteger(L, 2);
+	lua_Integer column = luaL_optinteger(L, 3, 1);
+	if(row < 1 || column < 1 || (size_t)column > columns || (size_t)((row-1)*columns + column) > h->length)
+		luaL_error(L, "index (%d, %d) out of range", (int)row, (int)column);
+	PushAt(L, h, (size_t)((row-1)*columns + column - 1));
+	return 1;
 }
 
-template<> inline void Output::GetValue<wstring>(lua_State* L, int idx) const
+/* BitSet is the packed image of a bitset<N> or a vector<bool> passed with the packed tag: a userdata
+   holding the bits in 32-bit words, instead of a table with one boolean per bit. In Lua, b[i] is
+   the bit i (from 1) as a boolean and #b the number of bits. The methods are test(i), set(i [, value]),
+   count() (the number of bits set), band(other), bor(other) and bxor(other) (new sets as long as the
+   longest operand), ones() (an iterator on the positions of the bits set: "for i in b:ones() do")
+   and totable(), the table of booleans passed without the tag, for the scripts expecting it.
+   The matching Output reads a packed set, or a table as without the tag. */
+class BitSet
 {
-	size_t size; 
-	const wchar_t* str = WideString::Get(L, idx, size); 
-	((wstring*)PointerValue)->assign(str, size);
-}
+public:
+	typedef unsigned int Word;
+	enum { WordBits = 32 };
+	struct Header
+	{
+		size_t length;
+	};
+	static Header* Push(lua_State* L, size_t length);
+	static Header* To(lua_State* L, int idx);
+	static Word* Data(Header* h) { return (Word*)(h + 1); }
+	static const Word* Data(const Header* h) { return (const Word*)(h + 1); }
+	static size_t Words(size_t length) { return (length + WordBits - 1) / WordBits; }
+	static bool Test(const Header* h, size_t i) { return (Data(h)[i / WordBits] >> (i % WordBits) & 1) != 0; }
+	static void Set(Header* h, size_t i, bool value)
+	{
+		Word bit = (Word)1 << (i % WordBits);
+		if(value)
+			Data(h)[i / WordBits] |= bit;
+		else
+			Data(h)[i / WordBits] &= ~bit;
+	}
+	// Position of the first bit set from i, or the length if there is none
+	static size_t Next(const Header* h, size_t i);
+#if LCBC_USE_CSL
+	template<class T> static void Pack(lua_State* L, const T& v);
+	template<class T> static void Unpack(const Header* h, T& v);
 #endif
+private:
+	static Header* Check(lua_State* L, int idx) { return (Header*)luaL_checkudata(L, idx, "LuaClassBasedBitSet"); }
+	static void PushMetatable(lua_State* L);
+	static size_t CheckIndex(lua_State* L, const Header* h, int arg);
+	static int Count(const Word* words, size_t count);
+#if LCBC_USE_CSL
+	template<size_t N> static size_t Fit(bitset<N>& v, size_t /*length*/) { v.reset(); return N; }
+	template<class A> static size_t Fit(vector<bool,A>& v, size_t length) { v.assign(length, false); return length; }
 #endif
+	static int Combine(lua_State* L, int op);
+	static int Index(lua_State* L);
+	static int NewIndex(lua_State* L);
+	static int Len(lua_State* L);
+	static int ToString(lua_State* L);
+	static int TestBit(lua_State* L);
+	static int SetBit(lua_State* L);
+	static int CountBits(lua_State* L);
+	static int And(lua_State* L) { return Combine(L, 0); }
+	static int Or(lua_State* L) { return Combine(L, 1); }
+	static int Xor(lua_State* L) { return Combine(L, 2); }
+	static int Ones(lua_State* L);
+	static int NextOne(lua_State* L);
+	static int ToTable(lua_State* L);
+};
 
-#if LCBC_USE_MFC
+inline BitSet::Header* BitSet::Push(lua_State* L, size_t length)
+{
+	Header* h = (Header*)lua_newuserdata(L, sizeof(Header) + Words(length)*sizeof(Word));
+	h->length = length;
+	memset(Data(h), 0, Words(length)*sizeof(Word));
+	PushMetatable(L);
+	lua_setmetatable(L, -2);
+	return h;
+}
 
-template<class T> inline void Input::PushCArray(lua_State* L) const
+inline BitSet::Header* BitSet::To(lua_State* L, int idx)
 {
-	const T* v = (const T*)PointerValue;
-	lua_createtable(L, (int)v->GetSize(), 0);
-	for(int i=0;i<v->GetSize();i++)
-	{
-		Input input(v->GetAt(i));
-		input.Push(L);
-		lua_rawseti(L, -2, i+1);
-	}
+	void* ud = lua_touserdata(L, idx);
+	if(!ud || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, "LuaClassBasedBitSet");
+	int equal = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return equal ? (Header*)ud : NULL;
 }
 
-template<class T> inline void Input::PushCList(lua_State* L) const
+inline size_t BitSet::Next(const Header* h, size_t i)
 {
-	const T* v = (const T*)PointerValue;
-	lua_createtable(L, (int)v->GetCount(), 0);
-	POSITION pos = v->GetHeadPosition();
-	for(int i=0;pos;i++)
+	const Word* words = Data(h);
+	size_t w = i / WordBits;
+	if(i >= h->length)
+		return h->length;
+	Word word = words[w] >> (i % WordBits);
+	if(word)
 	{
-		Input input(v->GetNext(pos));
-		input.Push(L);
-		lua_rawseti(L, -2, i+1);
+		while(!(word & 1))
+		{
+			word >>= 1;
+			i++;
+		}
+		return i;
+	}
+	size_t count = Words(h->length);
+	for(w++;w<count;w++)
+	{
+		if(!words[w])
+			continue;
+		i = w * WordBits;
+		for(word=words[w];!(word & 1);word>>=1)
+			i++;
+		return i;
 	}
+	return h->length;
 }
 
-template<class T, class K, class V> inline void Input::PushCMap(lua_State* L) const
+// The padding bits of the last word are always 0
+inline int BitSet::Count(const Word* words, size_t count)
 {
-	const T* v = (const T*)PointerValue;
-	lua_createtable(L, 0, (int)v->GetCount());
-	POSITION pos = v->GetStartPosition();
-	while(pos)
+	int n = 0;
+	for(size_t w=0;w<count;w++)
 	{
-		K key;
-		V value;
-		v->GetNextAssoc(pos, key, value);
-		Input inkey(key);
-		inkey.Push(L);
-		Input invalue(value);
-		invalue.Push(L);
-		lua_rawset(L, -3);
+		Word v = words[w];
+		v = v - ((v >> 1) & 0x55555555u);
+		v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+		n += (int)((((v + (v >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
 	}
+	return n;
 }
 
-template<class C, class T> inline void Output::GetCArray(lua_State* L, int idx) const
+inline void BitSet::PushMetatable(lua_State* L)
 {
-	C* v = (C*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int len = (int)lua_objlen(L, idx);
-	int top = lua_gettop(L);
-	v->SetSize(len);
-	for(int i=0;i<len;i++)
+	if(!luaL_newmetatable(L, "LuaClassBasedBitSet"))
+		return;
+	static const luaL_Reg methods[] = {
+		{ "test", TestBit }, { "set", SetBit }, { "count", CountBits }, { "band", And }, { "bor", Or }, 
+		{ "bxor", Xor }, { "ones", Ones }, { "totable", ToTable }, { NULL, NULL } };
+	lua_createtable(L, 0, sizeof(methods)/sizeof(methods[0])-1);
+	for(const luaL_Reg* m=methods;m->name;m++)
 	{
-		lua_rawgeti(L, idx, i+1);
-		T value;
-		Output output(value);
-		output.Get(L, top+1);
-		v->SetAt(i, value);
-		lua_settop(L, top);
+		lua_pushcfunction(L, m->func);
+		lua_setfield(L, -2, m->name);
 	}
+	lua_pushcclosure(L, Index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, NewIndex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, Len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, ToString);
+	lua_setfield(L, -2, "__tostring");
 }
 
-template<class C, class T> inline void Output::GetCList(lua_State* L, int idx) const
+inline size_t BitSet::CheckIndex(lua_State* L, const Header* h, int arg)
 {
-	C* v = (C*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int len = (int)lua_objlen(L, idx);
-	int top = lua_gettop(L);
-	for(int i=0;i<len;i++)
-	{
-		lua_rawgeti(L, idx, i+1);
-		T value;
-		Output output(value);
-		output.Get(L, top+1);
-		v->AddTail(value);
-		lua_settop(L, top);
-	}
+	lua_Number n = luaL_checknumber(L, arg);
+	if(n < 1 || n > (lua_Number)h->length || n != (lua_Number)(size_t)n)
+		luaL_error(L, "index %f out of range [1, %d]", n, (int)h->length);
+	return (size_t)n - 1;
 }
 
-template<class T, class K, class V> inline void Output::GetCMap(lua_State* L, int idx) const
+inline int BitSet::Index(lua_State* L)
 {
-	T* v = (T*)PointerValue;
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	lua_pushnil(L);
-	while (lua_next(L, idx) != 0)
+	const Header* h = Check(L, 1);
+	if(lua_type(L, 2) == LUA_TNUMBER)
 	{
-		lua_pushvalue(L, top+1);
-		K key;
-		Output outputKey(key);
-		outputKey.Get(L, top+3);
-		V value;
-		Output output(value);
-		output.Get(L, top+2);
-		lua_settop(L, top+1);
-		v->SetAt(key, value);
+		lua_Number n = lua_tonumber(L, 2);
+		if(n >= 1 && n <= (lua_Number)h->length && n == (lua_Number)(size_t)n)
+			lua_pushboolean(L, Test(h, (size_t)n - 1));
+		else
+			lua_pushnil(L);
+		return 1;
 	}
-	lua_settop(L, top);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	return 1;
 }
 
-template<> inline void Input::PushValue<CStringA>(lua_State* L) const
+inline int BitSet::NewIndex(lua_State* L)
 {
-	const CStringA* str = (const CStringA*)PointerValue;
-	lua_pushlstring(L, *str, str->GetLength());
+	Header* h = Check(L, 1);
+	Set(h, CheckIndex(L, h, 2), lua_toboolean(L, 3) != 0);
+	return 0;
 }
 
-inline Input::Input(const CStringA& value) 
-{ 
-	pPush = &Input::PushValue<CStringA>; 
-	PointerValue = &value; 
+inline int BitSet::Len(lua_State* L)
+{
+	lua_pushinteger(L, (lua_Integer)Check(L, 1)->length);
+	return 1;
 }
 
-template<> inline void Input::PushValue<CPoint>(lua_State* L) const
+inline int BitSet::ToString(lua_State* L)
 {
-	const CPoint* p = (const CPoint*)PointerValue;
-	lua_createtable(L, 0, 2);
-	lua_pushinteger(L, p->x);
-	lua_setfield(L, -2, "x");
-	lua_pushinteger(L, p->y);
-	lua_setfield(L, -2, "y");
+	const Header* h = Check(L, 1);
+	lua_pushfstring(L, "bitset[%d]: %p", (int)h->length, h);
+	return 1;
 }
 
-inline Input::Input(const CPoint& value) 
-{ 
-	pPush = &Input::PushValue<CPoint>; 
-	PointerValue = &value; 
+inline int BitSet::TestBit(lua_State* L)
+{
+	const Header* h = Check(L, 1);
+	lua_pushboolean(L, Test(h, CheckIndex(L, h, 2)));
+	return 1;
 }
 
-template<> inline void Input::PushValue<CRect>(lua_State* L) const
+inline int BitSet::SetBit(lua_State* L)
 {
-	const CRect* r = (const CRect*)PointerValue;
-	lua_createtable(L, 0, 2);
-	lua_pushinteger(L, r->top);
-	lua_setfield(L, -2, "top");
-	lua_pushinteger(L, r->bottom);
-	lua_setfield(L, -2, "bottom");
-	lua_pushinteger(L, r->left);
-	lua_setfield(L, -2, "left");
-	lua_pushinteger(L, r->right);
-	lua_setfield(L, -2, "right");
+	Header* h = Check(L, 1);
+	Set(h, CheckIndex(L, h, 2), lua_isnone(L, 3) || lua_toboolean(L, 3));
+	return 0;
 }
 
-inline Input::Input(const CRect& value) 
-{ 
-	pPush = &Input::PushValue<CRect>; 
-	PointerValue = &value; 
+inline int BitSet::CountBits(lua_State* L)
+{
+	const Header* h = Check(L, 1);
+	lua_pushinteger(L, Count(Data(h), Words(h->length)));
+	return 1;
 }
 
-template<> inline void Input::PushValue<CSize>(lua_State* L) const
+inline int BitSet::Combine(lua_State* L, int op)
 {
-	const CSize* s = (const CSize*)PointerValue;
-	lua_createtable(L, 0, 2);
-	lua_pushinteger(L, s->cx);
-	lua_setfield(L, -2, "cx");
-	lua_pushinteger(L, s->cy);
-	lua_setfield(L, -2, "cy");
+	const Header* a = Check(L, 1);
+	const Header* b = Check(L, 2);
+	if(a->length < b->length)
+	{
+		const Header* t = a;
+		a = b;
+		b = t;
+	}
+	Header* h = Push(L, a->length);
+	Word* dst = Data(h);
+	const Word* wa = Data(a);
+	const Word* wb = Data(b);
+	size_t na = Words(a->length), nb = Words(b->length);
+	for(size_t w=0;w<na;w++)
+	{
+		Word x = wa[w], y = w < nb ? wb[w] : 0;
+		dst[w] = op == 0 ? x & y : op == 1 ? x | y : x ^ y;
+	}
+	return 1;
 }
 
-inline Input::Input(const CSize& value) 
-{ 
-	pPush = &Input::PushValue<CSize>; 
-	PointerValue = &value; 
+inline int BitSet::Ones(lua_State* L)
+{
+	Check(L, 1);
+	lua_pushcfunction(L, NextOne);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
 }
 
-template<> inline void Input::PushValue<CTime>(lua_State* L) const
+inline int BitSet::NextOne(lua_State* L)
 {
-	const CTime* t = (const CTime*)PointerValue;
-	lua_pushnumber(L, (lua_Number)t->GetTime());
+	const Header* h = Check(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	size_t next = Next(h, i < 0 ? 0 : (size_t)i);
+	if(next >= h->length)
+		return 0;
+	lua_pushinteger(L, (lua_Integer)next + 1);
+	return 1;
 }
 
-inline Input::Input(const CTime& value) 
-{ 
-	pPush = &Input::PushValue<CTime>; 
-	PointerValue = &value; 
+inline int BitSet::ToTable(lua_State* L)
+{
+	const Header* h = Check(L, 1);
+	lua_createtable(L, (int)h->length, 0);
+	for(size_t i=0;i<h->length;i++)
+	{
+		lua_pushboolean(L, Test(h, i));
+		lua_rawseti(L, -2, (int)i+1);
+	}
+	return 1;
 }
 
-template<> inline void Input::PushValue<CTimeSpan>(lua_State* L) const
+#if LCBC_USE_CSL
+template<class T> inline void BitSet::Pack(lua_State* L, const T& v)
 {
-	const CTimeSpan* t = (const CTimeSpan*)PointerValue;
-	lua_pushnumber(L, (lua_Number)t->GetTimeSpan());
+	size_t length = v.size();
+	Word* words = Data(Push(L, length));
+	for(size_t i=0;i<length;i++)
+		if(v[i])
+			words[i / WordBits] |= (Word)1 << (i % WordBits);
 }
 
-inline Input::Input(const CTimeSpan& value) 
-{ 
-	pPush = &Input::PushValue<CTimeSpan>; 
-	PointerValue = &value; 
+template<class T> inline void BitSet::Unpack(const Header* h, T& v)
+{
+	size_t length = Fit(v, h->length);
+	if(length > h->length)
+		length = h->length;
+	for(size_t i=Next(h, 0);i<length;i=Next(h, i+1))
+		v[i] = true;
 }
 
-template<> inline void Input::PushValue<CObject>(lua_State* L) const
+template<class T> inline void Input::PushPacked(lua_State* L) const
 {
-	try 
-	{
-		CMemFile file;
-		CArchive ar(&file, CArchive::store);
-		const CObject* obj = (const CObject*)PointerValue;
-		ar << obj;
-		ar.Flush();
-		size_t len = (size_t)file.GetLength();
-		BYTE* buffer = file.Detach();
-		void* pdst = lua_newuserdata(L, len);
-		memcpy(pdst, buffer, len);
-		delete [] buffer;
-	}
-	catch(CException* )
-	{
-		luaL_error(L, "Cannot serialize MFC object");
-	}
+	BitSet::Pack(L, *(const T*)PointerValue);
 }
 
-template<> inline void Output::GetValue<CStringA>(lua_State* L, int idx) const
+template<class T> inline void Output::GetPacked(lua_State* L, int idx) const
 {
-	size_t size; 
-	const char* str = luaL_checklstring(L, idx, &size); 
-	*(CStringA*)PointerValue = CStringA(str, (int)size);
+	T* v = (T*)PointerValue;
+	const BitSet::Header* h = BitSet::To(L, idx);
+	if(!h)
+		return Output(*v, overwrite).Get(L, idx);
+	BitSet::Unpack(h, *v);
 }
+#endif
 
-template<> inline void Output::GetValue<CObject*>(lua_State* L, int idx) const
+template<class T> inline void Input::PushTypedArray(lua_State* L) const
 {
-	luaL_checktype(L, idx, LUA_TUSERDATA);
-	void* buffer = lua_touserdata(L, idx);
-	size_t len = lua_objlen(L, idx);
-	try 
-	{
-		CMemFile file((BYTE*)buffer, (UINT)len);
-		CArchive ar(&file, CArchive::load);
-		CObject* obj;
-		ar >> obj;
-		ar.Flush();
-		*(CObject**)PointerValue = obj;
-	}
-	catch(CException&)
-	{
-		luaL_error(L, "Cannot deserialize MFC object");
-	}
+	(void)sizeof(StaticCheck<(int)NumberTraits<T>::type != (int)NotNumber>);
+	memcpy(TypedArray::Push(L, NumberTraits<T>::type, Size), PointerValue, Size*sizeof(T));
 }
 
-template<> inline void Output::GetValue<CPoint>(lua_State* L, int idx) const
+template<class T, size_t L2> inline void Input::PushTyped2DArray(lua_State* L) const
 {
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	CPoint* p = (CPoint*)PointerValue;
-	lua_getfield(L, idx, "x");
-	p->x = luaL_checkint(L, -1);
-	lua_getfield(L, idx, "y");
-	p->y = luaL_checkint(L, -1);
-	lua_settop(L, top);
+	(void)sizeof(StaticCheck<(int)NumberTraits<T>::type != (int)NotNumber>);
+	memcpy(TypedArray::Push(L, NumberTraits<T>::type, Size*L2, Size, L2), PointerValue, Size*L2*sizeof(T));
 }
 
-template<> inline void Output::GetValue<CRect>(lua_State* L, int idx) const
+template<class T> inline void Output::GetTypedArray(lua_State* L, int idx) const
 {
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	CRect* p = (CRect*)PointerValue;
-	lua_getfield(L, idx, "top");
-	p->top = luaL_checkint(L, -1);
-	lua_getfield(L, idx, "bottom");
-	p->bottom = luaL_checkint(L, -1);
-	lua_getfield(L, idx, "left");
-	p->left = luaL_checkint(L, -1);
-	lua_getfield(L, idx, "right");
-	p->right = luaL_checkint(L, -1);
-	lua_settop(L, top);
+	const TypedArray::Header* h = TypedArray::To(L, idx);
+	if(!h)
+		return GetArray<T>(L, idx);
+	TypedArray::CopyOut(h, (T*)PointerValue, GetSize(h->length));
 }
 
-template<> inline void Output::GetValue<CSize>(lua_State* L, int idx) const
+template<> inline void Input::PushValue<wchar_t>(lua_State* L) const
 {
-	luaL_checktype(L, idx, LUA_TTABLE);
-	int top = lua_gettop(L);
-	CSize* p = (CSize*)PointerValue;
-	lua_getfield(L, idx, "cx");
-	p->cx = luaL_checkint(L, -1);
-	lua_getfield(L, idx, "cy");
-	p->cy = luaL_checkint(L, -1);
-	lua_settop(L, top);
+	WideString::Push(L, (const wchar_t*)PointerValue);
 }
 
-template<> inline void Output::GetValue<CTime>(lua_State* L, int idx) const
+template<> inline void Input::PushSizedValue<wchar_t>(lua_State* L) const
 {
-	CTime* t = (CTime*)PointerValue;
-	*t = (time_t)luaL_checknumber(L, idx);
+	WideString::Push(L, (const wchar_t*)PointerValue, Size);
 }
 
-template<> inline void Output::GetValue<CTimeSpan>(lua_State* L, int idx) const
+template<> inline void Output::GetArray<wchar_t>(lua_State* L, int idx) const
 {
-	CTimeSpan* t = (CTimeSpan*)PointerValue;
-	*t = (time_t)luaL_checknumber(L, idx);
+	size_t size;
+	const wchar_t* str = WideString::Get(L, idx, size);
+	memcpy(PointerValue, str, GetSize(size+1)*sizeof(wchar_t));
 }
 
-#if LCBC_USE_WIDESTRING
-template<> inline void Input::PushValue<CStringW>(lua_State* L) const
+template<> inline void Output::GetValue<const wchar_t*>(lua_State* L, int idx) const
 {
-	CStringW* str = (CStringW*)PointerValue;
-	WideString::Push(L, *str, str->GetLength());
+	*(const wchar_t**)PointerValue = WideString::Get(L, idx);
 }
 
-inline Input::Input(const CStringW& value) 
-{ 
-	pPush = &Input::PushValue<CStringW>; 
-	PointerValue = &value; 
+template<> inline void Output::GetSizedValue<wchar_t>(lua_State* L, int idx) const
+{
+	*(const wchar_t**)PointerValue = WideString::Get(L, idx, *pSize);
 }
 
-template<> inline void Output::GetValue<CStringW>(lua_State* L, int idx) const
+#if LCBC_USE_CSL
+// Gives access to the protected members of container adapters, without copying them.
+template<class T> struct AdapterAccess : T
 {
-	size_t size; 
-	const wchar_t* str = WideString::Get(L, idx, size); 
-	*(CStringW*)PointerValue = CStringW(str, (int)size);
+	static typename T::container_type& Container(T& adapter) { return adapter.*(&AdapterAccess::c); }
+	static const typename T::container_type& Container(const T& adapter) { return adapter.*(&AdapterAccess::c); }
+};
+
+template<class T, class P> struct HeapAccess : T
+{
+	static P& Compare(T& adapter) { return adapter.*(&HeapAccess::comp); }
+};
+
+template<class T> inline void RestoreHeap(T& /*adapter*/) {}
+template<class T, class C, class P> inline void RestoreHeap(priority_queue<T,C,P>& q)
+{
+	C& c = AdapterAccess<priority_queue<T,C,P> >::Container(q);
+	make_heap(c.begin(), c.end(), HeapAccess<priority_queue<T,C,P>,P>::Compare(q));
 }
-#endif
-#endif
 
-#if LCBC_USE_TINYXML
-template<> inline void Input::PushValue<TiXmlNode>(lua_State* L) const
+// Table layout for keys of type K. Integer keys are scanned first: when most of the ones
+// in 1..2n would fill more than half of an array part, the table is presized with one
+// (the same rule Lua applies when it rehashes) and those keys are stored with lua_rawseti.
+template<class K, bool integer = ((int)NumberTraits<K>::type > (int)NotNumber && (int)NumberTraits<K>::type < (int)Float)> struct KeyLayout
 {
-	const TiXmlNode* node = (const TiXmlNode*)PointerValue;
-	int type = node->Type();
-	switch(type)
-	{
-	case TiXmlNode::TINYXML_DOCUMENT:
-		break;
-	case TiXmlNode::TINYXML_ELEMENT:
+	enum { scan = 0 };
+	KeyLayout(size_t size) : Count(size) {}
+	void Scan(const K& /*key*/) {}
+	void CreateTable(lua_State* L) const { TablePool::NewTable(L, 0, (int)Count); }
+	// Pushes the key unless it goes to the array part; Store is called once the value is pushed
+	bool PushKey(lua_State* L, const K& key) const { Input input(key); input.Push(L); return true; }
+	void Store(lua_State* L, const K& /*key*/, bool /*pushed*/) const { lua_rawset(L, -3); }
+	size_t Count;
+};
+
+template<class K> struct KeyLayout<K, true>
+{
+	enum { scan = 1 };
+	KeyLayout(size_t size) : Count(size), Dense(0), Last(0) {}
+	void Scan(K key)
 	{
-		Input v(node->ToElement());
-		v.Push(L);
-		break;
+		if(key >= 1 && (unsigned long long)key <= 2*(unsigned long long)Count)
+		{
+			Dense++;
+			if((size_t)key > Last)
+				Last = (size_t)key;
+		}
 	}
-	case TiXmlNode::TINYXML_COMMENT:
-		lua_pushfstring(L, "<!--%s-->", node->Value());
-		break;
-	case TiXmlNode::TINYXML_UNKNOWN:
-		lua_pushfstring(L, "<%s>", node->Value());
-		break;
-	case TiXmlNode::TINYXML_TEXT:
-		lua_pushfstring(L, "%s%s", *node->Value() == '<' ? " " : "", node->Value());
-		break;
-	case TiXmlNode::TINYXML_DECLARATION:
+	void CreateTable(lua_State* L) const
 	{
-		const TiXmlDeclaration* decl = node->ToDeclaration();
-		int top = lua_gettop(L);
-		lua_pushstring(L, "<?xml ");
-		if(*decl->Version())
-			lua_pushfstring(L,  "version=\"%s\" ", decl->Version());
-		if(*decl->Encoding())
-			lua_pushfstring(L,  "encoding=\"%s\" ", decl->Encoding());
-		if(*decl->Standalone())
-			lua_pushfstring(L,  "standalone=\"%s\" ", decl->Standalone());
-		lua_pushstring(L, "?>");
-		lua_concat(L, lua_gettop(L)-top);
-		break;
-	}
+		if(2*Dense > Last)
+			TablePool::NewTable(L, (int)Last, (int)(Count - Dense));
+		else
+			TablePool::NewTable(L, 0, (int)Count);
 	}
-}
-template<> inline void Input::PushValue<TiXmlElement>(lua_State* L) const
-{
-	const TiXmlElement* elem = (const TiXmlElement*)PointerValue;
-	lua_createtable(L, 0, 1);
-	lua_pushstring(L, elem->Value());
-	lua_rawseti(L, -2, 0);
-	for(const TiXmlAttribute* attrib = elem->FirstAttribute();attrib;attrib=attrib->Next())
+	static bool Fits(K key) { return (K)(int)key == key && (key > 0) == ((int)key > 0); }
+	bool PushKey(lua_State* L, K key) const
 	{
-		lua_pushstring(L, attrib->Value());
-		if(lua_isnumber(L, -1))
-		{
-			lua_pushnumber(L, lua_tonumber(L, -1));
-			lua_replace(L, -2);
-		}
-		lua_setfield(L, -2, attrib->Name());
+		if(Fits(key))
+			return false;
+		Input input(key);
+		input.Push(L);
+		return true;
 	}
-	int i=0;
-	for(const TiXmlNode* child = elem->FirstChild();child;child = child->NextSibling(),i++)
+	void Store(lua_State* L, K key, bool pushed) const
 	{
-		Input v(child);
-		v.Push(L);
-		lua_rawseti(L, -2, i+1);
+		if(pushed)
+			lua_rawset(L, -3);
+		else
+			lua_rawseti(L, -2, (int)key);
 	}
+	size_t Count, Dense, Last;
+};
+
+// Whether adjacent elements of a set hold equivalent keys
+template<class T, class C, class A> inline bool SameKey(const set<T,C,A>&, const T&, const T&) { return false; }
+template<class T, class C, class A> inline bool SameKey(const multiset<T,C,A>& s, const T& a, const T& b) { return !s.key_comp()(a, b); }
+
+// Inserts the keys read from a table into a set
+template<class S> inline void InsertSortedKeys(S& s, vector<typename S::value_type>& keys)
+{
+	// Sorting first lets every key be inserted with an end() hint
+	sort(keys.begin(), keys.end(), s.key_comp());
+	for(size_t i=0;i<keys.size();i++)
+		s.insert(s.end(), LCBC_MOVE(keys[i]));
 }
-inline void Input::PushTiXmlDocument(lua_State* L) const
+template<class T, class C, class A> inline void InsertKeys(set<T,C,A>& s, vector<T>& keys) { InsertSortedKeys(s, keys); }
+template<class T, class C, class A> inline void InsertKeys(multiset<T,C,A>& s, vector<T>& keys) { InsertSortedKeys(s, keys); }
+
+// Returns the reset mapped value of key, inserting it if needed
+template<class M> inline typename M::mapped_type& SortedSlot(M& m, typename M::key_type& key)
 {
-	const TiXmlDocument* elem = (const TiXmlDocument*)PointerValue;
-	lua_createtable(L, 0, 0);
-	int i=0;
-	for(const TiXmlNode* child = elem->FirstChild();child;child = child->NextSibling(),i++)
+	typename M::iterator it = m.lower_bound(key);
+	if(it == m.end() || m.key_comp()(key, it->first))
+#if LCBC_USE_CPP11
+		it = m.emplace_hint(it, piecewise_construct, forward_as_tuple(LCBC_MOVE(key)), forward_as_tuple());
+#else
+		it = m.insert(it, typename M::value_type(key, typename M::mapped_type()));
+#endif
+	else
+		it->second = typename M::mapped_type();
+	return it->second;
+}
+template<class K, class T, class C, class A> inline T& MapSlot(map<K,T,C,A>& m, K& key) { return SortedSlot(m, key); }
+
+// Reserves room for the entries of the table at idx; only hashed containers need it
+template<class M> inline void ReserveEntries(M& /*m*/, lua_State* /*L*/, int /*idx*/) {}
+
+#if LCBC_USE_CPP11
+template<class T, class H, class E, class A> inline bool SameKey(const unordered_set<T,H,E,A>&, const T&, const T&) { return false; }
+template<class T, class H, class E, class A> inline bool SameKey(const unordered_multiset<T,H,E,A>& s, const T& a, const T& b) { return s.key_eq()(a, b); }
+
+template<class S> inline void InsertHashedKeys(S& s, vector<typename S::value_type>& keys)
+{
+	s.reserve(s.size() + keys.size());
+	for(size_t i=0;i<keys.size();i++)
+		s.insert(LCBC_MOVE(keys[i]));
+}
+template<class T, class H, class E, class A> inline void InsertKeys(unordered_set<T,H,E,A>& s, vector<T>& keys) { InsertHashedKeys(s, keys); }
+template<class T, class H, class E, class A> inline void InsertKeys(unordered_multiset<T,H,E,A>& s, vector<T>& keys) { InsertHashedKeys(s, keys); }
+
+template<class K, class T, class H, class E, class A> inline T& MapSlot(unordered_map<K,T,H,E,A>& m, K& key)
+{
+	pair<typename unordered_map<K,T,H,E,A>::iterator, bool> res = m.emplace(piecewise_construct, forward_as_tuple(LCBC_MOVE(key)), forward_as_tuple());
+	if(!res.second)
+		res.first->second = T();
+	return res.first->second;
+}
+
+template<class K, class T, class H, class E, class A> inline void ReserveEntries(unordered_map<K,T,H,E,A>& m, lua_State* L, int idx)
+{
+	size_t count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0)
 	{
-		Input v(child);
-		v.Push(L);
-		lua_rawseti(L, -2, i+1);
+		count++;
+		lua_pop(L, 1);
 	}
+	m.reserve(m.size() + count);
 }
-template<> inline void Output::GetValue<TiXmlNode*>(lua_State* L, int idx) const
+template<class K, class T, class H, class E, class A> inline void ReserveEntries(unordered_multimap<K,T,H,E,A>& m, lua_State* L, int idx)
 {
-	TiXmlNode** pnode = (TiXmlNode**)PointerValue;
-	if(lua_istable(L, idx))
+	m.reserve(m.size() + lua_objlen(L, idx));
+}
+
+// Reads or writes the elements of a tuple as an array
+template<class T, size_t I = 0, size_t N = tuple_size<T>::value> struct TupleIO
+{
+	static void Push(lua_State* L, const T& t)
 	{
-		TiXmlElement* elem;
-		Output v(elem);
-		v.Get(L, idx);
-		*pnode = elem;
+		Input input(get<I>(t));
+		input.Push(L);
+		lua_rawseti(L, -2, (int)I+1);
+		TupleIO<T, I+1, N>::Push(L, t);
 	}
-	else
+	static void Get(lua_State* L, int idx, T& t)
 	{
-		const char* str = luaL_checkstring(L, idx);
-		if(*str == '<')
-		{
-			TiXmlDocument doc;
-			doc.Parse(str);
-			*pnode = doc.FirstChild()->Clone();
-		}
-		else
-		{
-			*pnode = new TiXmlText(str);
-		}
+		int top = lua_gettop(L);
+		lua_rawgeti(L, idx, (int)I+1);
+		Output output(get<I>(t));
+		output.Get(L, top+1);
+		lua_settop(L, top);
+		TupleIO<T, I+1, N>::Get(L, idx, t);
 	}
+};
+template<class T, size_t N> struct TupleIO<T, N, N>
+{
+	static void Push(lua_State* /*L*/, const T& /*t*/) {}
+	static void Get(lua_State* /*L*/, int /*idx*/, T& /*t*/) {}
+};
+#endif
+
+#if LCBC_HAS_FLAT
+template<class T, class C, class KC> inline bool SameKey(const flat_set<T,C,KC>&, const T&, const T&) { return false; }
+template<class T, class C, class KC> inline bool SameKey(const flat_multiset<T,C,KC>& s, const T& a, const T& b) { return !s.key_comp()(a, b); }
+// flat sets sort and merge a whole range at once
+template<class T, class C, class KC> inline void InsertKeys(flat_set<T,C,KC>& s, vector<T>& keys) { s.insert(make_move_iterator(keys.begin()), make_move_iterator(keys.end())); }
+template<class T, class C, class KC> inline void InsertKeys(flat_multiset<T,C,KC>& s, vector<T>& keys) { s.insert(make_move_iterator(keys.begin()), make_move_iterator(keys.end())); }
+template<class K, class T, class C, class KC, class TC> inline T& MapSlot(flat_map<K,T,C,KC,TC>& m, K& key) { return SortedSlot(m, key); }
+#endif
+
+template<class T> inline void Input::PushPair(lua_State* L) const
+{
+	const T* p = (const T*)PointerValue;
+	TablePool::NewTable(L, 2, 0);
+	Input first(p->first);
+	first.Push(L);
+	lua_rawseti(L, -2, 1);
+	Input second(p->second);
+	second.Push(L);
+	lua_rawseti(L, -2, 2);
 }
-template<> inline void Output::GetValue<TiXmlElement*>(lua_State* L, int idx) const
+
+template<class T> inline void Input::PushMap(lua_State* L) const
 {
-	TiXmlElement** pelem = (TiXmlElement**)PointerValue;
-	int top = lua_gettop(L);
-	lua_rawgeti(L, idx, 0);
-	TiXmlElement* elem = new TiXmlElement(luaL_checkstring(L, top+1));
-	lua_settop(L, top);
-	*pelem = elem;
-	lua_pushnil(L);
-	while (lua_next(L, idx) != 0)
+	const T* m = (const T*)PointerValue;
+	typename T::const_iterator it;
+	KeyLayout<typename T::key_type> layout(m->size());
+	if(layout.scan)
+		for (it=m->begin() ; it != m->end(); ++it)
+			layout.Scan(it->first);
+	layout.CreateTable(L);
+	for (it=m->begin() ; it != m->end(); ++it)
 	{
-		if(lua_type(L, top+1) == LUA_TSTRING)
-		{
-			elem->SetAttribute(lua_tostring(L, top+1), lua_tostring(L, top+2));
-		}
-		lua_settop(L, top+1);
+		bool pushed = layout.PushKey(L, it->first);
+		Input value(it->second);
+		value.Push(L);
+		layout.Store(L, it->first, pushed);
 	}
-	lua_settop(L, top);
-	int len=(int)lua_objlen(L, idx);
-	for(int i=1;i<=len;i++)
+}
+
+template<class T> inline void Input::PushContainer(lua_State* L, const T* v) const
+{
+	TablePool::NewTable(L, (int)v->size(), 0);
+	typename T::const_iterator it;
+	int i=0;
+	for (it=v->begin(); it != v->end(); ++it,i++)
 	{
-		lua_rawgeti(L, idx, i);
-		TiXmlNode* node;
-		Output v(node);
-		v.Get(L, top+1);
-		elem->LinkEndChild(node);
-		lua_settop(L, top);
+		Input input(*it);
+		input.Push(L);
+		lua_rawseti(L, -2, i+1);
 	}
 }
 
-template<> inline void Output::GetValue<TiXmlDocument>(lua_State* L, int idx) const
+template<class T> inline void Input::PushSet(lua_State* L) const
 {
-	TiXmlDocument* doc = (TiXmlDocument*)PointerValue;
-	int top = lua_gettop(L);
-	int len=(int)lua_objlen(L, idx);
-	for(int i=1;i<=len;i++)
+	const T* s = (const T*)PointerValue;
+	typename T::const_iterator it, next;
+	KeyLayout<typename T::key_type> layout(s->size());
+	if(layout.scan)
+		for (it=s->begin() ; it != s->end(); ++it)
+			layout.Scan(*it);
+	layout.CreateTable(L);
+	for (it=s->begin() ; it != s->end(); it=next)
 	{
-		lua_rawgeti(L, idx, i);
-		TiXmlNode* node;
-		Output v(node);
-		v.Get(L, top+1);
-		doc->LinkEndChild(node);
-		lua_settop(L, top);
+		// Equivalent keys are adjacent: count them in the same pass
+		lua_Integer count = 1;
+		for(next=it,++next;next != s->end() && SameKey(*s, *it, *next);++next)
+			count++;
+		bool pushed = layout.PushKey(L, *it);
+		lua_pushinteger(L, count);
+		layout.Store(L, *it, pushed);
 	}
 }
 
-#endif
+template<> inline void Input::PushValue<string>(lua_State* L) const
+{
+	string* str = (string*)PointerValue;
+	lua_pushlstring(L, str->data(), str->size());
+}
 
-#if LCBC_USE_QT
-inline QString QtString::Get(lua_State* L, int idx, size_t& size)
+inline Input::Input(const string& value) 
+{ 
+	pPush = &Input::PushValue<string>; 
+	PointerValue = &value; 
+}
+
+template<class T> inline void Input::PushQueue(lua_State* L) const
 {
-	const char* str = luaL_checklstring(L, idx, &size);
-	return QString::fromAscii(str, (int)size);
+	PushContainer(L, &AdapterAccess<T>::Container(*(const T*)PointerValue));
 }
 
-inline void QtString::Push(lua_State* L, const QString& qstr) 
+template<class T> inline void Input::PushValArray(lua_State* L) const
 {
-	QByteArray str = qstr.toAscii();
-	lua_pushlstring(L, str, str.size());
+	const T* v = (const T*)PointerValue;
+	size_t size = v->size();
+	TablePool::NewTable(L, (int)size, 0);
+	for(size_t i=0;i<size;i++)
+	{
+		Input input((*v)[i]);
+		input.Push(L);
+		lua_rawseti(L, -2, (int)i+1);
+	}
 }
 
-template<> inline void Input::PushValue<QString>(lua_State* L) const
+template<class C, class T> inline void Input::PushTypedContainer(lua_State* L) const
 {
-	const QString* str = (const QString*)PointerValue;
-	QtString::Push(L, *str);
+	(void)sizeof(StaticCheck<(int)NumberTraits<T>::type != (int)NotNumber>);
+	const C* v = (const C*)PointerValue;
+	size_t size = v->size();
+	void* data = TypedArray::Push(L, NumberTraits<T>::type, size);
+	if(size)
+		memcpy(data, &(*v)[0], size*sizeof(T));
 }
-inline Input::Input(const QString& value) { pPush = &Input::PushValue<QString>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QLatin1String>(lua_State* L) const
+template<class C, class T> inline void Output::GetTypedContainer(lua_State* L, int idx) const
 {
-	const QLatin1String* str = (const QLatin1String*)PointerValue;
-	lua_pushstring(L, str->latin1());
+	C* v = (C*)PointerValue;
+	const TypedArray::Header* h = TypedArray::To(L, idx);
+	if(!h)
+	{
+		v->resize(0);
+		Output output(*v);
+		return output.Get(L, idx);
+	}
+	v->resize(h->length);
+	if(h->length)
+		TypedArray::CopyOut(h, &(*v)[0], h->length);
 }
-inline Input::Input(const QLatin1String& value) { pPush = &Input::PushValue<QLatin1String>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QDate>(lua_State* L) const
+template<class T> inline void Output::GetPair(lua_State* L, int idx) const
 {
-	const QDate* str = (const QDate*)PointerValue;
-	lua_pushinteger(L, str->toJulianDay());
+	T* p = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int top = lua_gettop(L);
+	lua_rawgeti(L, idx, 1);
+	lua_rawgeti(L, idx, 2);
+	Output o1(p->first);
+	o1.Get(L, top+1);
+	Output o2(p->second);
+	o2.Get(L, top+2);
+	lua_settop(L, top);
 }
-inline Input::Input(const QDate& value) { pPush = &Input::PushValue<QDate>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QDateTime>(lua_State* L) const
+template<> inline void Output::GetValue<string>(lua_State* L, int idx) const
 {
-	const QDateTime* d = (const QDateTime*)PointerValue;
-	lua_pushnumber(L, d->toMSecsSinceEpoch() / 1000.);
+	size_t size; 
+	const char* str = luaL_checklstring(L, idx, &size); 
+	((string*)PointerValue)->assign(str, size);
 }
-inline Input::Input(const QDateTime& value) { pPush = &Input::PushValue<QDateTime>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QTime>(lua_State* L) const
+template<class T, bool fOverwrite> inline void Output::GetSequence(lua_State* L, int idx, T* v)
 {
-	const QTime* t = (const QTime*)PointerValue;
-	lua_pushnumber(L, t->elapsed() / 1000.);
+	luaL_checktype(L, idx, LUA_TTABLE);
+	size_t len = lua_objlen(L, idx);
+	size_t start = fOverwrite ? 0 : v->size();
+	v->resize(start + len);
+	typename T::iterator it = v->begin();
+	advance(it, start);
+	int top = lua_gettop(L);
+	for(size_t i=0;i<len;i++,++it)
+	{
+		lua_rawgeti(L, idx, (int)i+1);
+		GetElement(L, top+1, *it, fOverwrite);
+		lua_settop(L, top);
+	}
 }
-inline Input::Input(const QTime& value) { pPush = &Input::PushValue<QTime>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QByteArray>(lua_State* L) const
+template<class T, bool fOverwrite> inline void Output::GetContainer(lua_State* L, int idx) const
 {
-	const QByteArray* str = (const QByteArray*)PointerValue;
-	lua_pushlstring(L, str->constData(), str->length());
+	GetSequence<T, fOverwrite>(L, idx, (T*)PointerValue);
 }
-inline Input::Input(const QByteArray& value) { pPush = &Input::PushValue<QByteArray>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QChar>(lua_State* L) const
+template<class T, bool fOverwrite> inline void Output::GetMultiMap(lua_State* L, int idx) const
 {
-	const QChar* v = (const QChar*)PointerValue;
-	QString s(*v);
-	QtString::Push(L, s);
+	T* v = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	if(fOverwrite)
+		v->clear();
+	ReserveEntries(*v, L, idx);
+	size_t len = lua_objlen(L, idx);
+	int top = lua_gettop(L);
+	for(size_t i=0;i<len;i++)
+	{
+		lua_rawgeti(L, idx, (int)i+1);
+		pair<typename T::key_type, typename T::mapped_type> value;
+		Output output(value);
+		output.Get(L, top+1);
+		v->insert(v->end(), LCBC_MOVE(value));
+		lua_settop(L, top);
+	}
 }
-inline Input::Input(const QChar& value) { pPush = &Input::PushValue<QChar>; PointerValue = &value; }
 
-template<> inline void Input::PushValue<QLatin1Char>(lua_State* L) const
+// The value of a key is its count in a multiset; a set takes each key with a positive value once
+template<class T, bool fMultiple, bool fOverwrite> inline void Output::GetSet(lua_State* L, int idx) const
 {
-	const QLatin1Char* v = (const QLatin1Char*)PointerValue;
-	char c = v->toLatin1();
-	lua_pushlstring(L, &c, 1);
+	T* s = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	if(fOverwrite)
+		s->clear();
+	vector<typename T::value_type> keys;
+	int top = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0)
+	{
+		lua_pushvalue(L, top+1);
+		int val = luaL_checkint(L, top+2);
+		if(val > 0)
+		{
+			keys.resize(keys.size()+1);
+			Output outputKey(keys.back());
+			outputKey.Get(L, top+3);
+			for(int i=1;fMultiple && i<val;i++)
+				keys.push_back(keys.back());
+		}
+		lua_settop(L, top+1);
+	}
+	lua_settop(L, top);
+	InsertKeys(*s, keys);
 }
-inline Input::Input(const QLatin1Char& value) { pPush = &Input::PushValue<QLatin1Char>; PointerValue = &value; }
 
-template<> inline void Output::GetValue<QDate>(lua_State* L, int idx) const
+template<class T, bool fOverwrite> inline void Output::GetMap(lua_State* L, int idx) const
 {
-	QDate* v = (QDate*)PointerValue;
-	*v = QDate::fromJulianDay(luaL_checkint(L, idx));
+	T* m = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	if(fOverwrite)
+		m->clear();
+	ReserveEntries(*m, L, idx);
+	int top = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0)
+	{
+		lua_pushvalue(L, top+1);
+		typename T::key_type key;
+		Output outputKey(key);
+		outputKey.Get(L, top+3);
+		GetElement(L, top+2, MapSlot(*m, key), false);
+		lua_settop(L, top+1);
+	}
+	lua_settop(L, top);
 }
 
-template<> inline void Output::GetValue<QTime>(lua_State* L, int idx) const
+template<class T, bool fOverwrite> inline void Output::GetQueue(lua_State* L, int idx) const
 {
-	QTime* v = (QTime*)PointerValue;
-	v->addMSecs(luaL_checknumber(L, idx)*1000.);
+	T* q = (T*)PointerValue;
+	GetSequence<typename T::container_type, fOverwrite>(L, idx, &AdapterAccess<T>::Container(*q));
+	RestoreHeap(*q);
 }
 
-template<> inline void Output::GetValue<QDateTime>(lua_State* L, int idx) const
+template<class C, class T> inline void Output::GetFixedArray(lua_State* L, int idx) const
 {
-	QDateTime* v = (QDateTime*)PointerValue;
-	v->setMSecsSinceEpoch(luaL_checknumber(L, idx)*1000.);
+	C* v = (C*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	size_t size = v->size();
+	size_t len = lua_objlen(L, idx);
+	if(len > size)
+		len = size;
+	if(len)
+		ArrayReader<T>::Get(L, idx, v->data(), len);
+	for(size_t i=len;i<size;i++)
+		(*v)[i] = T();
 }
 
-template<> inline void Output::GetValue<QString>(lua_State* L, int idx) const
+#if LCBC_USE_CPP11
+template<class T> inline void Input::PushTuple(lua_State* L) const
 {
-	QString* v = (QString*)PointerValue;
-	*v = QtString::Get(L, idx);
+	TablePool::NewTable(L, (int)tuple_size<T>::value, 0);
+	TupleIO<T>::Push(L, *(const T*)PointerValue);
 }
 
-template<> inline void Output::GetValue<QByteArray>(lua_State* L, int idx) const
+template<class T> inline void Output::GetTuple(lua_State* L, int idx) const
 {
-	QByteArray* v = (QByteArray*)PointerValue;
-	size_t size;
-	const char* s = luaL_checklstring(L, idx, &size);
-	v->setRawData(s, (uint)size);
+	luaL_checktype(L, idx, LUA_TTABLE);
+	TupleIO<T>::Get(L, idx, *(T*)PointerValue);
+}
+#endif
+
+#if LCBC_HAS_OPTIONAL
+template<class T> inline void Input::PushOptional(lua_State* L) const
+{
+	const optional<T>* v = (const optional<T>*)PointerValue;
+	if(!v->has_value())
+		return lua_pushnil(L);
+	Input input(**v);
+	input.Push(L);
 }
 
+template<class T> inline void Output::GetOptional(lua_State* L, int idx) const
+{
+	optional<T>* v = (optional<T>*)PointerValue;
+	if(lua_isnoneornil(L, idx))
+		return v->reset();
+	Output output(v->emplace());
+	output.Get(L, idx);
+}
 #endif
 
-template<class T>
-class Array
+template<class T, class V> inline void Output::GetValArray(lua_State* L, int idx) const
 {
-public:
-	typedef const T& ref;
-	Array() : Size(0) {}
-	Array(const Array& src) { Init(src.Arguments, src.Size); }
-	Array(const T* src[], size_t size) { Init(src, size); }
-	Array(ref arg1) { const T* args[] = { &arg1 }; Init(args, 1); }
-	Array(ref arg1, ref arg2) { const T* args[] = { &arg1, &arg2 }; Init(args, 2); }
-	Array(ref arg1, ref arg2, ref arg3, ref arg4=nil)
-	{ 
-		const T* args[] = { &arg1, &arg2, &arg3, &arg4 }; 
-		Init(args, 4); 
-	}
-	Array(ref arg1, ref arg2, ref arg3, ref arg4,
-		ref arg5, ref arg6=nil, ref arg7=nil, ref arg8=nil)
-		{ const T* args[] = { &arg1, &arg2, &arg3, &arg4, &arg5, &arg6, &arg7, &arg8 }; Init(args, 8); }
-	Array(ref arg1, ref arg2, ref arg3, ref arg4,
+	T* v = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	size_t len = lua_objlen(L, idx);
+	v->resize(len);
+	if(len)
+		ArrayReader<V>::Get(L, idx, &(*v)[0], len);
+}
+
+template<class T> inline void Output::GetBitSet(lua_State* L, int idx) const
+{
+	T* v = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	size_t len = lua_objlen(L, idx);
+	int top = lua_gettop(L);
+	for(size_t i=0;i<len;i++)
+	{
+		lua_rawgeti(L, idx, (int)i+1);
+		bool value;
+		Output output(value);
+		output.Get(L, top+1);
+		(*v)[i] = value;
+		lua_settop(L, top);
+	}
+}
+
+#if LCBC_USE_WIDESTRING
+template<> inline void Input::PushValue<wstring>(lua_State* L) const
+{
+	wstring* str = (wstring*)PointerValue;
+	WideString::Push(L, str->data(), str->size());
+}
+
+inline Input::Input(const wstring& value) 
+{ 
+	pPush = &Input::PushValue<wstring>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Output::GetValue<wstring>(lua_State* L, int idx) const
+{
+	size_t size; 
+	const wchar_t* str = WideString::Get(L, idx, size); 
+	((wstring*)PointerValue)->assign(str, size);
+}
+#endif
+#endif
+
+#if LCBC_USE_MFC
+
+template<class T> inline void Input::PushCArray(lua_State* L) const
+{
+	const T* v = (const T*)PointerValue;
+	TablePool::NewTable(L, (int)v->GetSize(), 0);
+	for(int i=0;i<v->GetSize();i++)
+	{
+		Input input(v->GetAt(i));
+		input.Push(L);
+		lua_rawseti(L, -2, i+1);
+	}
+}
+
+template<class T> inline void Input::PushCList(lua_State* L) const
+{
+	const T* v = (const T*)PointerValue;
+	TablePool::NewTable(L, (int)v->GetCount(), 0);
+	POSITION pos = v->GetHeadPosition();
+	for(int i=0;pos;i++)
+	{
+		Input input(v->GetNext(pos));
+		input.Push(L);
+		lua_rawseti(L, -2, i+1);
+	}
+}
+
+template<class T, class K, class V> inline void Input::PushCMap(lua_State* L) const
+{
+	const T* v = (const T*)PointerValue;
+	TablePool::NewTable(L, 0, (int)v->GetCount());
+	POSITION pos = v->GetStartPosition();
+	while(pos)
+	{
+		K key;
+		V value;
+		v->GetNextAssoc(pos, key, value);
+		Input inkey(key);
+		inkey.Push(L);
+		Input invalue(value);
+		invalue.Push(L);
+		lua_rawset(L, -3);
+	}
+}
+
+template<class C, class T> inline void Output::GetCArray(lua_State* L, int idx) const
+{
+	C* v = (C*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int len = (int)lua_objlen(L, idx);
+	int top = lua_gettop(L);
+	v->SetSize(len);
+	for(int i=0;i<len;i++)
+	{
+		lua_rawgeti(L, idx, i+1);
+		T value;
+		Output output(value);
+		output.Get(L, top+1);
+		v->SetAt(i, value);
+		lua_settop(L, top);
+	}
+}
+
+template<class C, class T> inline void Output::GetCList(lua_State* L, int idx) const
+{
+	C* v = (C*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int len = (int)lua_objlen(L, idx);
+	int top = lua_gettop(L);
+	for(int i=0;i<len;i++)
+	{
+		lua_rawgeti(L, idx, i+1);
+		T value;
+		Output output(value);
+		output.Get(L, top+1);
+		v->AddTail(value);
+		lua_settop(L, top);
+	}
+}
+
+template<class T, class K, class V> inline void Output::GetCMap(lua_State* L, int idx) const
+{
+	T* v = (T*)PointerValue;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int top = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0)
+	{
+		lua_pushvalue(L, top+1);
+		K key;
+		Output outputKey(key);
+		outputKey.Get(L, top+3);
+		V value;
+		Output output(value);
+		output.Get(L, top+2);
+		lua_settop(L, top+1);
+		v->SetAt(key, value);
+	}
+	lua_settop(L, top);
+}
+
+template<> inline void Input::PushValue<CStringA>(lua_State* L) const
+{
+	const CStringA* str = (const CStringA*)PointerValue;
+	lua_pushlstring(L, *str, str->GetLength());
+}
+
+inline Input::Input(const CStringA& value) 
+{ 
+	pPush = &Input::PushValue<CStringA>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Input::PushValue<CPoint>(lua_State* L) const
+{
+	const CPoint* p = (const CPoint*)PointerValue;
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, p->x);
+	lua_setfield(L, -2, "x");
+	lua_pushinteger(L, p->y);
+	lua_setfield(L, -2, "y");
+}
+
+inline Input::Input(const CPoint& value) 
+{ 
+	pPush = &Input::PushValue<CPoint>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Input::PushValue<CRect>(lua_State* L) const
+{
+	const CRect* r = (const CRect*)PointerValue;
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, r->top);
+	lua_setfield(L, -2, "top");
+	lua_pushinteger(L, r->bottom);
+	lua_setfield(L, -2, "bottom");
+	lua_pushinteger(L, r->left);
+	lua_setfield(L, -2, "left");
+	lua_pushinteger(L, r->right);
+	lua_setfield(L, -2, "right");
+}
+
+inline Input::Input(const CRect& value) 
+{ 
+	pPush = &Input::PushValue<CRect>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Input::PushValue<CSize>(lua_State* L) const
+{
+	const CSize* s = (const CSize*)PointerValue;
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, s->cx);
+	lua_setfield(L, -2, "cx");
+	lua_pushinteger(L, s->cy);
+	lua_setfield(L, -2, "cy");
+}
+
+inline Input::Input(const CSize& value) 
+{ 
+	pPush = &Input::PushValue<CSize>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Input::PushValue<CTime>(lua_State* L) const
+{
+	const CTime* t = (const CTime*)PointerValue;
+	lua_pushnumber(L, (lua_Number)t->GetTime());
+}
+
+inline Input::Input(const CTime& value) 
+{ 
+	pPush = &Input::PushValue<CTime>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Input::PushValue<CTimeSpan>(lua_State* L) const
+{
+	const CTimeSpan* t = (const CTimeSpan*)PointerValue;
+	lua_pushnumber(L, (lua_Number)t->GetTimeSpan());
+}
+
+inline Input::Input(const CTimeSpan& value) 
+{ 
+	pPush = &Input::PushValue<CTimeSpan>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Input::PushValue<CObject>(lua_State* L) const
+{
+	try 
+	{
+		CMemFile file;
+		CArchive ar(&file, CArchive::store);
+		const CObject* obj = (const CObject*)PointerValue;
+		ar << obj;
+		ar.Flush();
+		size_t len = (size_t)file.GetLength();
+		BYTE* buffer = file.Detach();
+		void* pdst = lua_newuserdata(L, len);
+		memcpy(pdst, buffer, len);
+		delete [] buffer;
+	}
+	catch(CException* )
+	{
+		luaL_error(L, "Cannot serialize MFC object");
+	}
+}
+
+template<> inline void Output::GetValue<CStringA>(lua_State* L, int idx) const
+{
+	size_t size; 
+	const char* str = luaL_checklstring(L, idx, &size); 
+	*(CStringA*)PointerValue = CStringA(str, (int)size);
+}
+
+template<> inline void Output::GetValue<CObject*>(lua_State* L, int idx) const
+{
+	luaL_checktype(L, idx, LUA_TUSERDATA);
+	void* buffer = lua_touserdata(L, idx);
+	size_t len = lua_objlen(L, idx);
+	try 
+	{
+		CMemFile file((BYTE*)buffer, (UINT)len);
+		CArchive ar(&file, CArchive::load);
+		CObject* obj;
+		ar >> obj;
+		ar.Flush();
+		*(CObject**)PointerValue = obj;
+	}
+	catch(CException&)
+	{
+		luaL_error(L, "Cannot deserialize MFC object");
+	}
+}
+
+template<> inline void Output::GetValue<CPoint>(lua_State* L, int idx) const
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int top = lua_gettop(L);
+	CPoint* p = (CPoint*)PointerValue;
+	lua_getfield(L, idx, "x");
+	p->x = luaL_checkint(L, -1);
+	lua_getfield(L, idx, "y");
+	p->y = luaL_checkint(L, -1);
+	lua_settop(L, top);
+}
+
+template<> inline void Output::GetValue<CRect>(lua_State* L, int idx) const
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int top = lua_gettop(L);
+	CRect* p = (CRect*)PointerValue;
+	lua_getfield(L, idx, "top");
+	p->top = luaL_checkint(L, -1);
+	lua_getfield(L, idx, "bottom");
+	p->bottom = luaL_checkint(L, -1);
+	lua_getfield(L, idx, "left");
+	p->left = luaL_checkint(L, -1);
+	lua_getfield(L, idx, "right");
+	p->right = luaL_checkint(L, -1);
+	lua_settop(L, top);
+}
+
+template<> inline void Output::GetValue<CSize>(lua_State* L, int idx) const
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int top = lua_gettop(L);
+	CSize* p = (CSize*)PointerValue;
+	lua_getfield(L, idx, "cx");
+	p->cx = luaL_checkint(L, -1);
+	lua_getfield(L, idx, "cy");
+	p->cy = luaL_checkint(L, -1);
+	lua_settop(L, top);
+}
+
+template<> inline void Output::GetValue<CTime>(lua_State* L, int idx) const
+{
+	CTime* t = (CTime*)PointerValue;
+	*t = (time_t)luaL_checknumber(L, idx);
+}
+
+template<> inline void Output::GetValue<CTimeSpan>(lua_State* L, int idx) const
+{
+	CTimeSpan* t = (CTimeSpan*)PointerValue;
+	*t = (time_t)luaL_checknumber(L, idx);
+}
+
+#if LCBC_USE_WIDESTRING
+template<> inline void Input::PushValue<CStringW>(lua_State* L) const
+{
+	CStringW* str = (CStringW*)PointerValue;
+	WideString::Push(L, *str, str->GetLength());
+}
+
+inline Input::Input(const CStringW& value) 
+{ 
+	pPush = &Input::PushValue<CStringW>; 
+	PointerValue = &value; 
+}
+
+template<> inline void Output::GetValue<CStringW>(lua_State* L, int idx) const
+{
+	size_t size; 
+	const wchar_t* str = WideString::Get(L, idx, size); 
+	*(CStringW*)PointerValue = CStringW(str, (int)size);
+}
+#endif
+#endif
+
+#if LCBC_USE_TINYXML
+/* Conversion of TinyXML nodes: an element becomes a table with its tag name at index 0, its
+   attributes as fields (numbers when they convert to numbers) and its children from index 1,
+   created with its final size. Within a conversion, the tag and attribute names are interned:
+   Names keeps the Lua strings of the last names met in a table, by hash, so that a repeated
+   name is pushed from there instead of being hashed again by Lua. */
+class Xml
+{
+public:
+	class Names
+	{
+	public:
+		// The table of the names is pushed until the end of the conversion
+		Names(lua_State* L_) : L(L_)
+		{
+			memset(Entries, 0, sizeof(Entries));
+			lua_createtable(L, Slots, 0);
+			Table = lua_gettop(L);
+		}
+		~Names() { lua_remove(L, Table); }
+		void Push(const char* name, size_t len);
+	private:
+		Names(const Names&);
+		Names& operator=(const Names&);
+		enum { Slots = 256 };
+		struct Entry
+		{
+			const char* Name;
+			size_t Length;
+		};
+		lua_State* L;
+		int Table;
+		Entry Entries[Slots];
+	};
+	static void PushNode(lua_State* L, const TiXmlNode* node, Names& names);
+	static void PushElement(lua_State* L, const TiXmlElement* elem, Names& names);
+	static void PushChildren(lua_State* L, const TiXmlNode* node, Names& names);
+	static void PushAttribute(lua_State* L, const char* value);
+	// Builds the node written in str, or returns NULL if it is not valid XML
+	static TiXmlNode* Parse(const char* str);
+};
+
+/* ByReference(element) or ByReference(document) passes a read-only view of an XML tree instead
+   of converting it into tables, so that a script reading a part of a huge document only converts
+   that part. v[0] is the tag name, v.name an attribute, v[i] the child i: a view for an element,
+   otherwise a string as in the tables. #v is the number of children, "for i, child in v() do"
+   iterates on them; a child is found from the one read before, so reading them in order is
+   linear. Like the container proxies, a view is only valid during its call. */
+class XmlView
+{
+public:
+	static void Push(lua_State* L, const TiXmlNode* node);
+	// The node viewed by the userdata at idx, or NULL if it is not a view
+	static const TiXmlNode* To(lua_State* L, int idx);
+private:
+	struct Box;
+	static Box* Check(lua_State* L);
+	static const TiXmlNode* Child(Box* b, int i);
+	static void PushMetatable(lua_State* L);
+	static int Index(lua_State* L);
+	static int NewIndex(lua_State* L);
+	static int Len(lua_State* L);
+	static int ToString(lua_State* L);
+	static int Next(lua_State* L);
+	static int Iterate(lua_State* L);
+};
+
+inline void Xml::Names::Push(const char* name, size_t len)
+{
+	if(!len)
+		return lua_pushlstring(L, name, 0);
+	size_t slot = (((len * 31 + (unsigned char)name[0]) * 31 + (unsigned char)name[len/2]) * 31 + (unsigned char)name[len-1]) % Slots;
+	Entry& e = Entries[slot];
+	if(e.Length == len && e.Name && !memcmp(e.Name, name, len))
+		return lua_rawgeti(L, Table, (int)slot+1);
+	lua_pushlstring(L, name, len);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, Table, (int)slot+1);
+	e.Name = lua_tostring(L, -1);
+	e.Length = len;
+}
+
+inline void Xml::PushNode(lua_State* L, const TiXmlNode* node, Names& names)
+{
+	switch(node->Type())
+	{
+	case TiXmlNode::TINYXML_DOCUMENT:
+		PushChildren(L, node, names);
+		break;
+	case TiXmlNode::TINYXML_ELEMENT:
+		PushElement(L, node->ToElement(), names);
+		break;
+	case TiXmlNode::TINYXML_COMMENT:
+		lua_pushfstring(L, "<!--%s-->", node->Value());
+		break;
+	case TiXmlNode::TINYXML_UNKNOWN:
+		lua_pushfstring(L, "<%s>", node->Value());
+		break;
+	case TiXmlNode::TINYXML_TEXT:
+		lua_pushfstring(L, "%s%s", *node->Value() == '<' ? " " : "", node->Value());
+		break;
+	case TiXmlNode::TINYXML_DECLARATION:
+	{
+		const TiXmlDeclaration* decl = node->ToDeclaration();
+		int top = lua_gettop(L);
+		lua_pushstring(L, "<?xml ");
+		if(*decl->Version())
+			lua_pushfstring(L,  "version=\"%s\" ", decl->Version());
+		if(*decl->Encoding())
+			lua_pushfstring(L,  "encoding=\"%s\" ", decl->Encoding());
+		if(*decl->Standalone())
+			lua_pushfstring(L,  "standalone=\"%s\" ", decl->Standalone());
+		lua_pushstring(L, "?>");
+		lua_concat(L, lua_gettop(L)-top);
+		break;
+	}
+	default:
+		lua_pushnil(L);
+	}
+}
+
+inline void Xml::PushElement(lua_State* L, const TiXmlElement* elem, Names& names)
+{
+	luaL_checkstack(L, 4, "XML tree too deep");
+	int attributes = 0, children = 0;
+	for(const TiXmlAttribute* attrib = elem->FirstAttribute();attrib;attrib=attrib->Next())
+		attributes++;
+	for(const TiXmlNode* child = elem->FirstChild();child;child = child->NextSibling())
+		children++;
+	lua_createtable(L, children, attributes+1);
+	names.Push(elem->ValueTStr().c_str(), elem->ValueTStr().length());
+	lua_rawseti(L, -2, 0);
+	for(const TiXmlAttribute* attrib = elem->FirstAttribute();attrib;attrib=attrib->Next())
+	{
+		names.Push(attrib->NameTStr().c_str(), attrib->NameTStr().length());
+		PushAttribute(L, attrib->Value());
+		lua_rawset(L, -3);
+	}
+	int i=0;
+	for(const TiXmlNode* child = elem->FirstChild();child;child = child->NextSibling())
+	{
+		PushNode(L, child, names);
+		lua_rawseti(L, -2, ++i);
+	}
+}
+
+inline void Xml::PushChildren(lua_State* L, const TiXmlNode* node, Names& names)
+{
+	int children = 0;
+	for(const TiXmlNode* child = node->FirstChild();child;child = child->NextSibling())
+		children++;
+	lua_createtable(L, children, 0);
+	int i=0;
+	for(const TiXmlNode* child = node->FirstChild();child;child = child->NextSibling())
+	{
+		PushNode(L, child, names);
+		lua_rawseti(L, -2, ++i);
+	}
+}
+
+// Only the values starting like a number are tried as numbers
+inline void Xml::PushAttribute(lua_State* L, const char* value)
+{
+	const char* p = value;
+	while(*p == ' ' || (*p >= '\t' && *p <= '\r'))
+		p++;
+	lua_pushstring(L, value);
+	if(!((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'i' || *p == 'I' || *p == 'n' || *p == 'N'))
+		return;
+	if(lua_isnumber(L, -1))
+	{
+		lua_pushnumber(L, lua_tonumber(L, -1));
+		lua_replace(L, -2);
+	}
+}
+
+inline TiXmlNode* Xml::Parse(const char* str)
+{
+	TiXmlNode* node;
+	unsigned char c = (unsigned char)str[1];
+	if(!strncmp(str, "<?xml", 5))
+		node = new TiXmlDeclaration();
+	else if(!strncmp(str, "<!--", 4))
+		node = new TiXmlComment();
+	else if(!strncmp(str, "<![CDATA[", 9))
+	{
+		TiXmlText* text = new TiXmlText("");
+		text->SetCDATA(true);
+		node = text;
+	}
+	else if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80)
+		node = new TiXmlElement("");
+	else
+		node = new TiXmlUnknown();
+	if(!node->Parse(str, NULL, TIXML_DEFAULT_ENCODING))
+	{
+		delete node;
+		return NULL;
+	}
+	return node;
+}
+
+template<> inline void Input::PushValue<TiXmlNode>(lua_State* L) const
+{
+	Xml::Names names(L);
+	Xml::PushNode(L, (const TiXmlNode*)PointerValue, names);
+}
+template<> inline void Input::PushValue<TiXmlElement>(lua_State* L) const
+{
+	Xml::Names names(L);
+	Xml::PushElement(L, (const TiXmlElement*)PointerValue, names);
+}
+inline void Input::PushTiXmlDocument(lua_State* L) const
+{
+	Xml::Names names(L);
+	Xml::PushChildren(L, (const TiXmlDocument*)PointerValue, names);
+}
+template<> inline void Output::GetValue<TiXmlNode*>(lua_State* L, int idx) const
+{
+	TiXmlNode** pnode = (TiXmlNode**)PointerValue;
+	if(lua_istable(L, idx))
+	{
+		TiXmlElement* elem;
+		Output v(elem);
+		v.Get(L, idx);
+		*pnode = elem;
+	}
+	else if(const TiXmlNode* viewed = XmlView::To(L, idx))
+	{
+		*pnode = viewed->Clone();
+	}
+	else
+	{
+		const char* str = luaL_checkstring(L, idx);
+		if(*str == '<')
+		{
+			*pnode = Xml::Parse(str);
+			if(!*pnode)
+				luaL_error(L, "invalid XML string");
+		}
+		else
+		{
+			*pnode = new TiXmlText(str);
+		}
+	}
+}
+template<> inline void Output::GetValue<TiXmlElement*>(lua_State* L, int idx) const
+{
+	TiXmlElement** pelem = (TiXmlElement**)PointerValue;
+	int top = lua_gettop(L);
+	lua_rawgeti(L, idx, 0);
+	TiXmlElement* elem = new TiXmlElement(luaL_checkstring(L, top+1));
+	lua_settop(L, top);
+	*pelem = elem;
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0)
+	{
+		if(lua_type(L, top+1) == LUA_TSTRING)
+		{
+			elem->SetAttribute(lua_tostring(L, top+1), lua_tostring(L, top+2));
+		}
+		lua_settop(L, top+1);
+	}
+	lua_settop(L, top);
+	int len=(int)lua_objlen(L, idx);
+	for(int i=1;i<=len;i++)
+	{
+		lua_rawgeti(L, idx, i);
+		TiXmlNode* node;
+		Output v(node);
+		v.Get(L, top+1);
+		elem->LinkEndChild(node);
+		lua_settop(L, top);
+	}
+}
+
+template<> inline void Output::GetValue<TiXmlDocument>(lua_State* L, int idx) const
+{
+	TiXmlDocument* doc = (TiXmlDocument*)PointerValue;
+	int top = lua_gettop(L);
+	int len=(int)lua_objlen(L, idx);
+	for(int i=1;i<=len;i++)
+	{
+		lua_rawgeti(L, idx, i);
+		TiXmlNode* node;
+		Output v(node);
+		v.Get(L, top+1);
+		doc->LinkEndChild(node);
+		lua_settop(L, top);
+	}
+}
+
+#endif
+
+#if LCBC_USE_QT
+inline QString QtString::Get(lua_State* L, int idx, size_t& size)
+{
+	const char* str = luaL_checklstring(L, idx, &size);
+	return QString::fromAscii(str, (int)size);
+}
+
+inline void QtString::Push(lua_State* L, const QString& qstr) 
+{
+	QByteArray str = qstr.toAscii();
+	lua_pushlstring(L, str, str.size());
+}
+
+template<> inline void Input::PushValue<QString>(lua_State* L) const
+{
+	const QString* str = (const QString*)PointerValue;
+	QtString::Push(L, *str);
+}
+inline Input::Input(const QString& value) { pPush = &Input::PushValue<QString>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QLatin1String>(lua_State* L) const
+{
+	const QLatin1String* str = (const QLatin1String*)PointerValue;
+	lua_pushstring(L, str->latin1());
+}
+inline Input::Input(const QLatin1String& value) { pPush = &Input::PushValue<QLatin1String>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QDate>(lua_State* L) const
+{
+	const QDate* str = (const QDate*)PointerValue;
+	lua_pushinteger(L, str->toJulianDay());
+}
+inline Input::Input(const QDate& value) { pPush = &Input::PushValue<QDate>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QDateTime>(lua_State* L) const
+{
+	const QDateTime* d = (const QDateTime*)PointerValue;
+	lua_pushnumber(L, d->toMSecsSinceEpoch() / 1000.);
+}
+inline Input::Input(const QDateTime& value) { pPush = &Input::PushValue<QDateTime>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QTime>(lua_State* L) const
+{
+	const QTime* t = (const QTime*)PointerValue;
+	lua_pushnumber(L, t->elapsed() / 1000.);
+}
+inline Input::Input(const QTime& value) { pPush = &Input::PushValue<QTime>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QByteArray>(lua_State* L) const
+{
+	const QByteArray* str = (const QByteArray*)PointerValue;
+	lua_pushlstring(L, str->constData(), str->length());
+}
+inline Input::Input(const QByteArray& value) { pPush = &Input::PushValue<QByteArray>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QChar>(lua_State* L) const
+{
+	const QChar* v = (const QChar*)PointerValue;
+	QString s(*v);
+	QtString::Push(L, s);
+}
+inline Input::Input(const QChar& value) { pPush = &Input::PushValue<QChar>; PointerValue = &value; }
+
+template<> inline void Input::PushValue<QLatin1Char>(lua_State* L) const
+{
+	const QLatin1Char* v = (const QLatin1Char*)PointerValue;
+	char c = v->toLatin1();
+	lua_pushlstring(L, &c, 1);
+}
+inline Input::Input(const QLatin1Char& value) { pPush = &Input::PushValue<QLatin1Char>; PointerValue = &value; }
+
+template<> inline void Output::GetValue<QDate>(lua_State* L, int idx) const
+{
+	QDate* v = (QDate*)PointerValue;
+	*v = QDate::fromJulianDay(luaL_checkint(L, idx));
+}
+
+template<> inline void Output::GetValue<QTime>(lua_State* L, int idx) const
+{
+	QTime* v = (QTime*)PointerValue;
+	v->addMSecs(luaL_checknumber(L, idx)*1000.);
+}
+
+template<> inline void Output::GetValue<QDateTime>(lua_State* L, int idx) const
+{
+	QDateTime* v = (QDateTime*)PointerValue;
+	v->setMSecsSinceEpoch(luaL_checknumber(L, idx)*1000.);
+}
+
+template<> inline void Output::GetValue<QString>(lua_State* L, int idx) const
+{
+	QString* v = (QString*)PointerValue;
+	*v = QtString::Get(L, idx);
+}
+
+template<> inline void Output::GetValue<QByteArray>(lua_State* L, int idx) const
+{
+	QByteArray* v = (QByteArray*)PointerValue;
+	size_t size;
+	const char* s = luaL_checklstring(L, idx, &size);
+	v->setRawData(s, (uint)size);
+}
+
+#endif
+
+template<class T>
+class Array
+{
+public:
+	typedef const T& ref;
+	Array() : Size(0) {}
+	Array(const Array& src) { Init(src.Arguments, src.Size); }
+	Array(const T* src[], size_t size) { Init(src, size); }
+	Array(ref arg1) { const T* args[] = { &arg1 }; Init(args, 1); }
+	Array(ref arg1, ref arg2) { const T* args[] = { &arg1, &arg2 }; Init(args, 2); }
+	Array(ref arg1, ref arg2, ref arg3, ref arg4=nil)
+	{ 
+		const T* args[] = { &arg1, &arg2, &arg3, &arg4 }; 
+		Init(args, 4); 
+	}
+	Array(ref arg1, ref arg2, ref arg3, ref arg4,
+		ref arg5, ref arg6=nil, ref arg7=nil, ref arg8=nil)
+		{ const T* args[] = { &arg1, &arg2, &arg3, &arg4, &arg5, &arg6, &arg7, &arg8 }; Init(args, 8); }
+	Array(ref arg1, ref arg2, ref arg3, ref arg4,
 		ref arg5, ref arg6, ref arg7, ref arg8,
 		ref arg9, ref arg10=nil, ref arg11=nil, ref arg12=nil,
 		ref arg13=nil, ref arg14=nil, ref arg15=nil, ref arg16=nil)
@@ -1472,162 +3204,5112 @@ public:
 		Init(args, 32); }
 	Array& operator=(const Array& src) { delete[]Arguments; Init(src.Arguments, src.Size); return *this; }
 	size_t size() const { return Size; }
-	ref get(size_t idx) const { return *Arguments[idx]; }
-	void add(const T& arg) { Arguments[Size++] = &arg; }
-	void empty() { Size = 0; }
+	ref get(size_t idx) const { return *Arguments[idx]; }
+	void add(const T& arg) { Arguments[Size++] = &arg; }
+	void empty() { Size = 0; }
+private:
+	void Init(const T* args[], size_t len)
+	{
+		Size = len;
+		for(size_t i=0;i<len;i++)
+			Arguments[i] = args[i];
+	}
+	size_t Size;
+	const T* Arguments[32];
+};
+
+template<class C>
+class ErrorT
+{
+public:
+	ErrorT(C message) : Message(message)  {}
+	operator C() const { return Message; }
+	C str() const { return Message; }
+private:
+	C Message;
+};
+
+typedef ErrorT<const char*> ErrorA;
+typedef ErrorT<const wchar_t*> ErrorW;
+#if defined(_UNICODE) || defined(UNICODE)
+typedef ErrorW Error;
+#else
+typedef ErrorA Error;
+#endif
+
+// Reason of the error raised when a call goes beyond its limits
+enum LimitReason { NoViolation, InstructionBudget, Deadline, Cancellation };
+
+// Error thrown by ECall when the call has been stopped by its limits or canceled
+template<class C, class E=ErrorT<C> >
+class LimitErrorT : public E
+{
+public:
+	LimitErrorT(C message, LimitReason reason) : E(message), Reason(reason) {}
+	LimitReason reason() const { return Reason; }
+private:
+	LimitReason Reason;
+};
+
+typedef LimitErrorT<const char*> LimitErrorA;
+typedef LimitErrorT<const wchar_t*> LimitErrorW;
+#if defined(_UNICODE) || defined(UNICODE)
+typedef LimitErrorW LimitError;
+#else
+typedef LimitErrorA LimitError;
+#endif
+
+typedef Array<Input> Inputs;
+typedef Array<Output> Outputs;
+
+// Number of owners (LuaT objects and table views) sharing a Lua state, minus one
+inline lua_Integer IncrRetainCount(lua_State* L, int incr)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedRetainCount");
+	lua_Integer count = lua_tointeger(L, -1);
+	count = count + incr;
+	lua_pop(L, 1);
+	lua_pushinteger(L, count);
+	lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedRetainCount");
+	return count;
+}
+
+// Value of another Lua state, pushed as an Input by copy
+struct StateValue
+{
+	lua_State* L;
+	int Index;
+};
+
+/* Transfer copies a value from a Lua state to another one, without converting it to C++ data.
+   Tables are copied deeply and presized; a table referenced several times, even by itself,
+   gives a single copy referenced as many times, and so does a long string. Metatables are not copied. Besides tables,
+   strings, numbers and booleans, light userdata and C functions without upvalues are allowed.
+   The source state is only read: errors are raised in the destination state. */
+class StateCopier
+{
+public:
+	// Strings longer than MaxShortString, which Lua 5.2+ does not intern, are copied once
+	enum { MaxDepth = 1000, MaxShortString = 40 };
+	// Pushes on to the copy of the value at idx in from; raises an error in to on failure,
+	// possibly leaving values on the stack of from
+	static void Push(lua_State* from, int idx, lua_State* to)
+	{
+		if(idx < 0 && idx > LUA_REGISTRYINDEX)
+			idx = lua_gettop(from) + idx + 1;
+		int top = lua_gettop(from);
+		if(SameUniverse(from, to))
+		{
+			lua_pushvalue(from, idx);
+			if(from != to)
+				lua_xmove(from, to, 1);
+			return;
+		}
+		lua_newtable(to);
+		StateCopier copier = { from, to, lua_gettop(to), 0 };
+		copier.Value(idx);
+		lua_remove(to, copier.Map);
+		lua_settop(from, top);
+	}
+	static int DoPush(lua_State* L)
+	{
+		const StateValue* value = (const StateValue*)lua_touserdata(L, 1);
+		Push(value->L, value->Index, L);
+#if LUA_VERSION_NUM < 502
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedTransfer");
+#endif
+		return 1;
+	}
+	// True if both states are threads of the same Lua universe, sharing their values
+	static bool SameUniverse(lua_State* L1, lua_State* L2)
+	{
+		return L1 == L2 || lua_topointer(L1, LUA_REGISTRYINDEX) == lua_topointer(L2, LUA_REGISTRYINDEX);
+	}
+	void Value(int idx)
+	{
+		switch(lua_type(From, idx))
+		{
+		case LUA_TNONE:
+		case LUA_TNIL: lua_pushnil(To); break;
+		case LUA_TBOOLEAN: lua_pushboolean(To, lua_toboolean(From, idx)); break;
+		case LUA_TLIGHTUSERDATA: lua_pushlightuserdata(To, lua_touserdata(From, idx)); break;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if(lua_isinteger(From, idx))
+			{
+				lua_pushinteger(To, lua_tointeger(From, idx));
+				break;
+			}
+#endif
+			lua_pushnumber(To, lua_tonumber(From, idx)); 
+			break;
+		case LUA_TSTRING:
+		{
+			size_t len;
+			const char* str = lua_tolstring(From, idx, &len);
+			if(len <= MaxShortString)
+			{
+				lua_pushlstring(To, str, len);
+				break;
+			}
+			lua_pushlightuserdata(To, (void*)str);
+			lua_rawget(To, Map);
+			if(!lua_isnil(To, -1))
+				break;
+			lua_pop(To, 1);
+			lua_pushlstring(To, str, len);
+			lua_pushlightuserdata(To, (void*)str);
+			lua_pushvalue(To, -2);
+			lua_rawset(To, Map);
+			break;
+		}
+		case LUA_TTABLE: Table(idx); break;
+		case LUA_TFUNCTION:
+			if(lua_iscfunction(From, idx) && lua_checkstack(From, 1) && !lua_getupvalue(From, idx, 1))
+			{
+				lua_pushcfunction(To, lua_tocfunction(From, idx));
+				break;
+			}
+			// fall through
+		default: 
+			luaL_error(To, "cannot transfer a %s value between Lua states", luaL_typename(From, idx));
+		}
+	}
+	void Table(int idx)
+	{
+		void* key = (void*)lua_topointer(From, idx);
+		lua_pushlightuserdata(To, key);
+		lua_rawget(To, Map);
+		if(!lua_isnil(To, -1))
+			return;
+		lua_pop(To, 1);
+		if(++Depth > MaxDepth || !lua_checkstack(From, 3))
+			luaL_error(To, "tables nested too deeply to be transferred");
+		luaL_checkstack(To, 4, "tables nested too deeply to be transferred");
+		size_t len = lua_objlen(From, idx), count = 0;
+		lua_pushnil(From);
+		while(lua_next(From, idx))
+		{
+			count++;
+			lua_pop(From, 1);
+		}
+		lua_createtable(To, (int)len, count > len ? (int)(count-len) : 0);
+		lua_pushlightuserdata(To, key);
+		lua_pushvalue(To, -2);
+		lua_rawset(To, Map);
+		int top = lua_gettop(From);
+		lua_pushnil(From);
+		while(lua_next(From, idx))
+		{
+			Value(top+1);
+			Value(top+2);
+			lua_rawset(To, -3);
+			lua_pop(From, 1);
+		}
+		Depth--;
+	}
+	lua_State* From;
+	lua_State* To;
+	int Map; // table of the copies, indexed by the addresses of the source tables and long strings
+	int Depth;
+};
+
+inline StateValue Transfer(lua_State* src, int idx)
+{
+	if(idx < 0 && idx > LUA_REGISTRYINDEX)
+		idx = lua_gettop(src) + idx + 1;
+	StateValue value = { src, idx };
+	return value;
+}
+
+// Pushes on dst a copy of the value at idx in src, or the error message: returns NULL or the message
+inline const char* Transfer(lua_State* src, int idx, lua_State* dst)
+{
+	StateValue value = Transfer(src, idx);
+	int top = lua_gettop(src);
+#if LUA_VERSION_NUM >= 502
+	lua_pushcfunction(dst, StateCopier::DoPush);
+	lua_pushlightuserdata(dst, &value);
+	int res = lua_pcall(dst, 1, 1, 0);
+#else
+	int res = lua_cpcall(dst, StateCopier::DoPush, &value);
+	if(!res)
+	{
+		lua_getfield(dst, LUA_REGISTRYINDEX, "LuaClassBasedTransfer");
+		lua_pushnil(dst);
+		lua_setfield(dst, LUA_REGISTRYINDEX, "LuaClassBasedTransfer");
+	}
+#endif
+	lua_settop(src, top);
+	if(!res)
+		return NULL;
+	const char* error = lua_tostring(dst, -1);
+	return error ? error : "error object is not a string";
+}
+
+inline void Input::PushStateValue(lua_State* L) const
+{
+	const StateValue* value = (const StateValue*)PointerValue;
+	if(Transfer(value->L, value->Index, L))
+		lua_error(L);
+}
+
+/* TableView is an Output that keeps a reference to a Lua table instead of converting it.
+   Fields are only converted when read, with get<T>(key) or Get(key, Output(...)), and
+   nested tables can be opened as other views. pairs() and ipairs() return ranges of iterators
+   behaving like their Lua counterparts; begin() and end() iterate over all the pairs.
+   Keys must not be added to the table during an iteration, as with the Lua function next.
+   Reads are protected: PGet returns the error message (or NULL), Get and get<T> throw an ErrorA.
+   A view retains the Lua state like a LuaT object does, so the state is only closed once
+   the last view is destroyed. Views must not be shared between threads. */
+class TableView
+{
+public:
+	class iterator;
+	class Range;
+	TableView() : L(NULL), Ref(LUA_NOREF) {}
+	TableView(const TableView& src) : L(NULL), Ref(LUA_NOREF) { *this = src; }
+	~TableView() { Release(); }
+	TableView& operator=(const TableView& src)
+	{
+		if(this != &src)
+		{
+			Release();
+			if(src.valid())
+			{
+				src.Push(src.L);
+				Attach(src.L, -1);
+				lua_pop(L, 1);
+			}
+		}
+		return *this;
+	}
+	bool valid() const { return Ref != LUA_NOREF; }
+	lua_State* state() const { return L; }
+	// Length of the sequence, like the # operator without metamethods
+	size_t size() const;
+	bool has(const Input& key) const;
+	const char* PGet(const Input& key, const Output& value) const;
+	void Get(const Input& key, const Output& value) const
+	{
+		const char* error = PGet(key, value);
+		if(error)
+			ThrowError(error);
+	}
+	template<class T> T get(const Input& key) const
+	{
+		T value = T();
+		Get(key, Output(value));
+		return value;
+	}
+	TableView view(const Input& key) const { return get<TableView>(key); }
+	Range pairs() const;
+	Range ipairs() const;
+	iterator begin() const;
+	iterator end() const;
+	void Push(lua_State* L) const;
+	void Attach(lua_State* L, int idx);
+	void Release();
+	static void ThrowError(const char* error)
+#if LCBC_USE_EXCEPTIONS
+	{ throw ErrorA(error); }
+#else
+	;
+#endif
+private:
+	// What a protected read fetches: the value at a key, or the key itself when ReadKey is set.
+	// The key comes from Key if not NULL, else from the registry reference KeyRef, else it is Index.
+	struct Access
+	{
+		const TableView* View;
+		const Input* Key;
+		int KeyRef;
+		lua_Integer Index;
+		bool ReadKey;
+		const Output* Value;
+	};
+	const char* Read(const Access& access) const;
+	static int DoRead(lua_State* L);
+	friend class iterator;
+
+	lua_State* L;
+	int Ref;
+};
+
+class TableView::iterator
+{
+public:
+	// End iterator of view
+	explicit iterator(const TableView* view = NULL) : View(view), Index(0), KeyRef(LUA_NOREF), Sequence(false) {}
+	// Iterator on the first entry of view, using either ipairs or pairs order
+	iterator(const TableView* view, bool sequence) : View(view), Index(0), KeyRef(LUA_NOREF), Sequence(sequence) 
+	{
+		if(view->valid())
+			++*this;
+	}
+	iterator(const iterator& src) : View(NULL), Index(0), KeyRef(LUA_NOREF), Sequence(false) { *this = src; }
+	~iterator() { Unref(); }
+	iterator& operator=(const iterator& src)
+	{
+		if(this != &src)
+		{
+			Unref();
+			View = src.View;
+			Index = src.Index;
+			Sequence = src.Sequence;
+			if(src.KeyRef != LUA_NOREF)
+			{
+				lua_rawgeti(View->L, LUA_REGISTRYINDEX, src.KeyRef);
+				KeyRef = luaL_ref(View->L, LUA_REGISTRYINDEX);
+			}
+		}
+		return *this;
+	}
+	iterator& operator++();
+	bool operator==(const iterator& other) const { return View == other.View && Index == other.Index; }
+	bool operator!=(const iterator& other) const { return !(*this == other); }
+	const iterator& operator*() const { return *this; }
+	const iterator* operator->() const { return this; }
+	// Position of the entry, starting at 1; for ipairs, it is also the key
+	size_t index() const { return (size_t)Index; }
+	const char* PGetKey(const Output& key) const { return Read(key, true); }
+	const char* PGetValue(const Output& value) const { return Read(value, false); }
+	void GetKey(const Output& key) const { Check(Read(key, true)); }
+	void GetValue(const Output& value) const { Check(Read(value, false)); }
+	template<class T> T key() const { T k = T(); GetKey(Output(k)); return k; }
+	template<class T> T value() const { T v = T(); GetValue(Output(v)); return v; }
+	TableView view() const { return value<TableView>(); }
+private:
+	const char* Read(const Output& output, bool readKey) const
+	{
+		Access access = { View, NULL, KeyRef, Index, readKey, &output };
+		return View->Read(access);
+	}
+	static void Check(const char* error) { if(error) ThrowError(error); }
+	void Unref()
+	{
+		if(KeyRef != LUA_NOREF)
+			luaL_unref(View->L, LUA_REGISTRYINDEX, KeyRef);
+		KeyRef = LUA_NOREF;
+	}
+	const TableView* View;
+	lua_Integer Index;
+	int KeyRef;
+	bool Sequence;
+};
+
+class TableView::Range
+{
+public:
+	Range(const TableView* view, bool sequence) : View(view), Sequence(sequence) {}
+	iterator begin() const { return iterator(View, Sequence); }
+	iterator end() const { return iterator(View); }
+private:
+	const TableView* View;
+	bool Sequence;
+};
+
+/* ResultsView is an Output collecting all the values returned by a script, however many there are.
+   It must be the last output of a call. The values are packed into a sequence, read
+   with get<T>(i) or Get(i, Output(...)) where i starts at 1; size() counts the nil values too. */
+class ResultsView : public TableView
+{
+public:
+	ResultsView() : Count(0) {}
+	size_t size() const { return Count; }
+private:
+	friend class Output;
+	size_t Count;
+};
+
+inline void TableView::Push(lua_State* L) const
+{
+	if(valid())
+		lua_rawgeti(L, LUA_REGISTRYINDEX, Ref);
+	else
+		lua_pushnil(L);
+}
+
+inline void TableView::Attach(lua_State* l, int idx)
+{
+	lua_pushvalue(l, idx);
+	Release();
+	L = l;
+	IncrRetainCount(L, 1);
+	Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+inline void TableView::Release()
+{
+	if(!valid())
+		return;
+	luaL_unref(L, LUA_REGISTRYINDEX, Ref);
+	Ref = LUA_NOREF;
+	if(IncrRetainCount(L, -1) < 0)
+		lua_close(L);
+	L = NULL;
+}
+
+inline size_t TableView::size() const
+{
+	if(!valid())
+		return 0;
+	Push(L);
+	size_t len = lua_objlen(L, -1);
+	lua_pop(L, 1);
+	return len;
+}
+
+inline bool TableView::has(const Input& key) const
+{
+	if(!valid())
+		return false;
+	Push(L);
+	key.Push(L);
+	lua_rawget(L, -2);
+	bool res = !lua_isnil(L, -1);
+	lua_pop(L, 2);
+	return res;
+}
+
+inline const char* TableView::PGet(const Input& key, const Output& value) const
+{
+	Access access = { this, &key, LUA_NOREF, 0, false, &value };
+	return Read(access);
+}
+
+inline const char* TableView::Read(const Access& access) const
+{
+	if(!valid())
+		return "attempt to read an empty table view";
+#if LUA_VERSION_NUM >= 502
+	lua_pushcfunction(L, DoRead);
+	lua_pushlightuserdata(L, (void*)&access);
+	int res = lua_pcall(L, 1, 0, 0);
+#else
+	int res = lua_cpcall(L, DoRead, (void*)&access);
+#endif
+	if(!res)
+		return NULL;
+	// Keep the message alive until the next error, without leaving it on the stack
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedViewError");
+	const char* error = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	return error ? error : "error object is not a string";
+}
+
+inline int TableView::DoRead(lua_State* L)
+{
+	const Access* access = (const Access*)lua_topointer(L, 1);
+	access->View->Push(L);
+	if(access->Key)
+		access->Key->Push(L);
+	else if(access->KeyRef != LUA_NOREF)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, access->KeyRef);
+	else
+		lua_pushinteger(L, access->Index);
+	if(!access->ReadKey)
+		lua_rawget(L, 2);
+	access->Value->Get(L, 3);
+	return 0;
+}
+
+inline TableView::Range TableView::pairs() const { return Range(this, false); }
+inline TableView::Range TableView::ipairs() const { return Range(this, true); }
+inline TableView::iterator TableView::begin() const { return iterator(this, false); }
+inline TableView::iterator TableView::end() const { return iterator(this); }
+
+inline TableView::iterator& TableView::iterator::operator++()
+{
+	lua_State* L = View->L;
+	View->Push(L);
+	if(Sequence)
+	{
+		lua_rawgeti(L, -1, (int)Index+1);
+		Index = lua_isnil(L, -1) ? 0 : Index+1;
+		lua_pop(L, 2);
+		return *this;
+	}
+	if(KeyRef != LUA_NOREF)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, KeyRef);
+	else
+		lua_pushnil(L);
+	Unref();
+	if(lua_next(L, -2))
+	{
+		lua_pop(L, 1);
+		KeyRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		Index++;
+	}
+	else
+		Index = 0;
+	lua_pop(L, 1);
+	return *this;
+}
+
+inline void Input::PushTableView(lua_State* L) const
+{
+	const TableView* view = (const TableView*)PointerValue;
+	lua_State* from = view->state();
+	if(!view->valid() || StateCopier::SameUniverse(from, L))
+		return view->Push(L);
+	view->Push(from);
+	const char* error = Transfer(from, -1, L);
+	lua_pop(from, 1);
+	if(error)
+		lua_error(L);
+}
+
+inline void Output::GetTableView(lua_State* L, int idx) const
+{
+	TableView* view = (TableView*)PointerValue;
+	if(lua_isnoneornil(L, idx))
+		return view->Release();
+	luaL_checktype(L, idx, LUA_TTABLE);
+	view->Attach(L, idx);
+}
+
+inline void Output::GetResults(lua_State* L, int idx) const
+{
+	ResultsView* view = (ResultsView*)PointerValue;
+	int top = lua_gettop(L);
+	int count = top >= idx ? top-idx+1 : 0;
+	lua_createtable(L, count, 0);
+	for(int i=0;i<count;i++)
+	{
+		lua_pushvalue(L, idx+i);
+		lua_rawseti(L, -2, i+1);
+	}
+	view->Attach(L, -1);
+	view->Count = (size_t)count;
+	lua_pop(L, 1);
+}
+
+// State shared by all proxy userdata, such as container proxies, buffers and XML views
+struct ProxyHeader
+{
+	bool Valid;
+	bool Writable;
+};
+
+/* Registry list of the proxies pushed during the current calls. Their number is kept in the per-state
+   object LuaClassBasedProxyCount, cached by LuaT and FunctionView, so that the calls which push no proxy
+   do not touch the list. */
+class Proxies
+{
+public:
+	Proxies() : Live(0) {}
+	static Proxies* Get(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedProxyCount");
+		Proxies* proxies = (Proxies*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(!proxies)
+		{
+			proxies = new(lua_newuserdata(L, sizeof(Proxies))) Proxies();
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedProxyCount");
+		}
+		return proxies;
+	}
+	// Number of proxies pushed so far, to be given to Release when the call returns
+	size_t Mark() const { return Live; }
+	// Invalidates the proxies pushed after mark
+	void Release(lua_State* L, size_t mark)
+	{
+		if(Live <= mark)
+			return;
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedProxies");
+		for(size_t i=Live;i>mark;i--)
+		{
+			lua_rawgeti(L, -1, (int)i);
+			((ProxyHeader*)lua_touserdata(L, -1))->Valid = false;
+			lua_pop(L, 1);
+			lua_pushnil(L);
+			lua_rawseti(L, -2, (int)i);
+		}
+		lua_pop(L, 1);
+		Live = mark;
+	}
+	// Adds the proxy on top of the stack
+	static void Add(lua_State* L)
+	{
+		Proxies* proxies = Get(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedProxies");
+		if(!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedProxies");
+		}
+		lua_pushvalue(L, -2);
+		lua_rawseti(L, -2, (int)++proxies->Live);
+		lua_pop(L, 1);
+	}
+private:
+	size_t Live;
+};
+
+/* FunctionView is an Output keeping a reference to a Lua function, such as a closure returned by
+   a script or a callback it registers, so that C++ can call it any number of times without running
+   a script. Call passes the inputs and reads the outputs as LuaT calls do; the call is protected:
+   PCall returns the error message (or NULL) and Call throws an ErrorA. A view can also be passed
+   back to Lua as an Input. Like TableView, it retains the Lua state and must not be shared between
+   threads. With C++11, LuaFunction<R(Args...)> adds a typed call operator on top of it. */
+class FunctionView
+{
+public:
+	FunctionView() : L(NULL), Views(NULL), Ref(LUA_NOREF) {}
+	FunctionView(const FunctionView& src) : L(NULL), Views(NULL), Ref(LUA_NOREF) { *this = src; }
+	~FunctionView() { Release(); }
+	FunctionView& operator=(const FunctionView& src)
+	{
+		if(this != &src)
+		{
+			Release();
+			if(src.valid())
+			{
+				src.Push(src.L);
+				Attach(src.L, -1);
+				lua_pop(L, 1);
+			}
+		}
+		return *this;
+	}
+	bool valid() const { return Ref != LUA_NOREF; }
+	lua_State* state() const { return L; }
+	const char* PCall(const Inputs& inputs = Inputs(), const Outputs& outputs = Outputs()) const;
+	void Call(const Inputs& inputs = Inputs(), const Outputs& outputs = Outputs()) const
+	{
+		const char* error = PCall(inputs, outputs);
+		if(error)
+			TableView::ThrowError(error);
+	}
+	void Push(lua_State* L) const
+	{
+		if(valid())
+			lua_rawgeti(L, LUA_REGISTRYINDEX, Ref);
+		else
+			lua_pushnil(L);
+	}
+	void Attach(lua_State* L, int idx);
+	void Release();
+private:
+	struct Access
+	{
+		const FunctionView* View;
+		const Inputs* In;
+		const Outputs* Out;
+	};
+	static int DoCall(lua_State* L);
+
+	lua_State* L;
+	Proxies* Views;
+	int Ref;
+};
+
+inline void FunctionView::Attach(lua_State* l, int idx)
+{
+	lua_pushvalue(l, idx);
+	Release();
+	L = l;
+	Views = Proxies::Get(L);
+	IncrRetainCount(L, 1);
+	Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+inline void FunctionView::Release()
+{
+	if(!valid())
+		return;
+	luaL_unref(L, LUA_REGISTRYINDEX, Ref);
+	Ref = LUA_NOREF;
+	if(IncrRetainCount(L, -1) < 0)
+		lua_close(L);
+	L = NULL;
+}
+
+inline const char* FunctionView::PCall(const Inputs& inputs, const Outputs& outputs) const
+{
+	if(!valid())
+		return "attempt to call an empty function view";
+	Access access = { this, &inputs, &outputs };
+	size_t mark = Views->Mark();
+#if LUA_VERSION_NUM >= 502
+	lua_pushcfunction(L, DoCall);
+	lua_pushlightuserdata(L, (void*)&access);
+	int res = lua_pcall(L, 1, 0, 0);
+#else
+	int res = lua_cpcall(L, DoCall, (void*)&access);
+#endif
+	Views->Release(L, mark);
+	if(!res)
+		return NULL;
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedViewError");
+	const char* error = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	return error ? error : "error object is not a string";
+}
+
+inline int FunctionView::DoCall(lua_State* L)
+{
+	const Access* access = (const Access*)lua_topointer(L, 1);
+	const Inputs& inputs = *access->In;
+	const Outputs& outputs = *access->Out;
+	lua_settop(L, 0);
+	access->View->Push(L);
+	lua_checkstack(L, (int)inputs.size());
+	for(size_t i=0;i<inputs.size(); i++)
+		inputs.get(i).Push(L);
+	// Same rule as LuaT calls: a ResultsView takes all the values from its position
+	size_t fixed = 0;
+	while(fixed < outputs.size() && !outputs.get(fixed).MultipleResults())
+		fixed++;
+	lua_call(L, (int)inputs.size(), fixed < outputs.size() ? LUA_MULTRET : (int)outputs.size());
+	if(lua_gettop(L) < (int)fixed)
+		lua_settop(L, (int)fixed);
+	for(size_t i=0;i<outputs.size(); i++)
+		outputs.get(i).Get(L, 1+(int)i);
+	return 0;
+}
+
+inline void Input::PushFunctionView(lua_State* L) const
+{
+	const FunctionView* view = (const FunctionView*)PointerValue;
+	if(view->valid() && !StateCopier::SameUniverse(view->state(), L))
+		luaL_error(L, "cannot pass a function view to another Lua state");
+	view->Push(L);
+}
+
+inline void Output::GetFunctionView(lua_State* L, int idx) const
+{
+	FunctionView* view = (FunctionView*)PointerValue;
+	if(lua_isnoneornil(L, idx))
+		return view->Release();
+	luaL_checktype(L, idx, LUA_TFUNCTION);
+	view->Attach(L, idx);
+}
+
+#if LCBC_USE_CPP11
+/* LuaFunction<R(Args...)> is a FunctionView called like a C++ function: the arguments are converted
+   by the Input constructor selected for their type, and the first result by the Output one for R
+   (void ignores the results; PCall reads several). Errors are thrown as ErrorA. */
+template<class R, class... A> class LuaFunction<R(A...)> : public FunctionView
+{
+public:
+	R operator()(A... args) const
+	{
+		R result = R();
+		Invoke(Outputs(Output(result)), args...);
+		return result;
+	}
+protected:
+	void Invoke(const Outputs& outputs, A&... args) const
+	{
+		static_assert(sizeof...(A) < 32, "too many arguments");
+		const Input values[] = { Input(args)..., Input(nil) };
+		const Input* inputs[sizeof...(A)+1];
+		for(size_t i=0;i<=sizeof...(A);i++)
+			inputs[i] = &values[i];
+		Call(Inputs(inputs, sizeof...(A)), outputs);
+	}
+};
+template<class... A> class LuaFunction<void(A...)> : public LuaFunction<int(A...)>
+{
+public:
+	void operator()(A... args) const { this->Invoke(Outputs(), args...); }
+};
+#endif
+
+/* ByReference(container) makes an Input pushing a proxy userdata instead of a copy of the container.
+   The proxy reads the C++ elements on demand, and writes them unless the container is const.
+   It supports indexing, # and, from Lua 5.2, pairs and ipairs; calling the proxy also returns
+   a pairs iterator, which is the way to iterate with Lua 5.1 ("for k,v in proxy() do").
+   Sequences (vector, deque, list, valarray, C arrays and MFC arrays) are indexed from 1;
+   a list is walked from its beginning at each access. Maps (map and unordered_map) are indexed
+   by key, and assigning nil erases the entry. A proxy is only valid during the LuaT call it was
+   passed to: afterwards, accessing it raises an error. The metatable is built once per container type. */
+template<class T> struct ArrayRef
+{
+	T* Data;
+	size_t Size;
+};
+
+template<class H> struct Reference
+{
+	H Handle;
+	bool Writable;
+};
+
+template<class C> inline Reference<C*> ByReference(C& container) { Reference<C*> ref = { &container, true }; return ref; }
+template<class C> inline Reference<C*> ByReference(const C& container) { Reference<C*> ref = { (C*)&container, false }; return ref; }
+template<class T> inline Reference<ArrayRef<T> > ByReference(size_t len, T* arr) { Reference<ArrayRef<T> > ref = { { arr, len }, true }; return ref; }
+template<class T> inline Reference<ArrayRef<T> > ByReference(size_t len, const T* arr) { Reference<ArrayRef<T> > ref = { { (T*)arr, len }, false }; return ref; }
+template<class T, size_t N> inline Reference<ArrayRef<T> > ByReference(T (&arr)[N]) { return ByReference(N, (T*)arr); }
+template<class T, size_t N> inline Reference<ArrayRef<T> > ByReference(const T (&arr)[N]) { return ByReference(N, (const T*)arr); }
+
+// Container designated by a proxy handle
+template<class H> struct ProxyHandle;
+template<class C> struct ProxyHandle<C*>
+{
+	typedef C Container;
+	static C& Deref(C* handle) { return *handle; }
+};
+template<class T> struct ProxyHandle<ArrayRef<T> >
+{
+	typedef ArrayRef<T> Container;
+	static ArrayRef<T>& Deref(ArrayRef<T>& handle) { return handle; }
+};
+
+// Element access of sequences: size() and operator[] by default
+template<class C> struct SequenceAccess
+{
+	static size_t Size(const C& c) { return c.size(); }
+	static void Push(lua_State* L, const C& c, size_t i) { Input(c[i]).Push(L); }
+	static void Get(lua_State* L, int idx, C& c, size_t i) { Output(c[i], overwrite).Get(L, idx); }
+};
+
+template<class T> struct SequenceAccess<ArrayRef<T> >
+{
+	static size_t Size(const ArrayRef<T>& a) { return a.Size; }
+	static void Push(lua_State* L, const ArrayRef<T>& a, size_t i) { Input((const T&)a.Data[i]).Push(L); }
+	static void Get(lua_State* L, int idx, ArrayRef<T>& a, size_t i) { Output(a.Data[i], overwrite).Get(L, idx); }
+};
+
+#if LCBC_USE_CSL
+template<class T, class A> struct SequenceAccess<list<T,A> >
+{
+	static size_t Size(const list<T,A>& c) { return c.size(); }
+	static void Push(lua_State* L, const list<T,A>& c, size_t i)
+	{
+		typename list<T,A>::const_iterator it = c.begin();
+		advance(it, i);
+		Input(*it).Push(L);
+	}
+	static void Get(lua_State* L, int idx, list<T,A>& c, size_t i)
+	{
+		typename list<T,A>::iterator it = c.begin();
+		advance(it, i);
+		Output(*it, overwrite).Get(L, idx);
+	}
+};
+
+template<class A> struct SequenceAccess<vector<bool,A> >
+{
+	static size_t Size(const vector<bool,A>& c) { return c.size(); }
+	static void Push(lua_State* L, const vector<bool,A>& c, size_t i) { lua_pushboolean(L, c[i]); }
+	static void Get(lua_State* L, int idx, vector<bool,A>& c, size_t i) { c[i] = lua_toboolean(L, idx) != 0; }
+};
+#endif
+
+#if LCBC_USE_MFC
+template<class C> struct MfcArrayAccess
+{
+	static size_t Size(const C& c) { return (size_t)c.GetSize(); }
+	static void Push(lua_State* L, const C& c, size_t i) { Input(c[(INT_PTR)i]).Push(L); }
+	static void Get(lua_State* L, int idx, C& c, size_t i) { Output(c.ElementAt((INT_PTR)i)).Get(L, idx); }
+};
+template<class T, class A> struct SequenceAccess<CArray<T,A> > : MfcArrayAccess<CArray<T,A> > {};
+template<class B, class T> struct SequenceAccess<CTypedPtrArray<B,T> > : MfcArrayAccess<CTypedPtrArray<B,T> > {};
+template<> struct SequenceAccess<CByteArray> : MfcArrayAccess<CByteArray> {};
+template<> struct SequenceAccess<CDWordArray> : MfcArrayAccess<CDWordArray> {};
+template<> struct SequenceAccess<CObArray> : MfcArrayAccess<CObArray> {};
+template<> struct SequenceAccess<CPtrArray> : MfcArrayAccess<CPtrArray> {};
+template<> struct SequenceAccess<CStringArray> : MfcArrayAccess<CStringArray> {};
+template<> struct SequenceAccess<CUIntArray> : MfcArrayAccess<CUIntArray> {};
+template<> struct SequenceAccess<CWordArray> : MfcArrayAccess<CWordArray> {};
+#endif
+
+// Proxy operations on a sequence; the key is at index 2 and the assigned value at 3
+template<class C> struct SequenceProxy
+{
+	typedef SequenceAccess<C> Access;
+	static size_t Size(const C& c) { return Access::Size(c); }
+	static bool ToIndex(lua_State* L, size_t size, size_t& i)
+	{
+		if(lua_type(L, 2) != LUA_TNUMBER)
+			return false;
+		lua_Number n = lua_tonumber(L, 2);
+		if(n < 1 || n > (lua_Number)size || n != (lua_Number)(size_t)n)
+			return false;
+		i = (size_t)n - 1;
+		return true;
+	}
+	static void Index(lua_State* L, C& c)
+	{
+		size_t i;
+		if(ToIndex(L, Access::Size(c), i))
+			Access::Push(L, c, i);
+		else
+			lua_pushnil(L);
+	}
+	static void NewIndex(lua_State* L, C& c)
+	{
+		size_t i;
+		if(!ToIndex(L, Access::Size(c), i))
+		{
+			if(lua_type(L, 2) != LUA_TNUMBER)
+				luaL_error(L, "invalid %s index to a sequence", luaL_typename(L, 2));
+			luaL_error(L, "index %f out of range [1, %d]", lua_tonumber(L, 2), (int)Access::Size(c));
+		}
+		Access::Get(L, 3, c, i);
+	}
+	static int Next(lua_State* L, C& c)
+	{
+		size_t i = lua_isnil(L, 2) ? 0 : (size_t)luaL_checkinteger(L, 2);
+		if(i >= Access::Size(c))
+			return 0;
+		lua_pushinteger(L, (lua_Integer)i+1);
+		Access::Push(L, c, i);
+		return 2;
+	}
+};
+
+// Lua type of the keys of a map proxy: numbers, strings (or numbers), or LUA_TNONE to convert any value
+template<class K> struct KeyTraits { enum { type = (int)NumberTraits<K>::type != (int)NotNumber ? LUA_TNUMBER : LUA_TNONE }; };
+#if LCBC_USE_CSL
+template<class C, class T, class A> struct KeyTraits<basic_string<C,T,A> > { enum { type = LUA_TSTRING }; };
+#endif
+
+// Proxy operations on a map; keys of another type than the map keys are missing keys
+template<class C> struct MapProxy
+{
+	static size_t Size(const C& c) { return c.size(); }
+	static bool ValidKey(lua_State* L, int idx)
+	{
+		switch((int)KeyTraits<typename C::key_type>::type)
+		{
+		case LUA_TNUMBER:
+			return lua_isnumber(L, idx) != 0;
+		case LUA_TSTRING:
+			return lua_isstring(L, idx) != 0;
+		default:
+			return true;
+		}
+	}
+	static void Index(lua_State* L, C& c)
+	{
+		if(!ValidKey(L, 2))
+			return lua_pushnil(L);
+		typename C::key_type key;
+		Output(key).Get(L, 2);
+		typename C::const_iterator it = c.find(key);
+		if(it == c.end())
+			lua_pushnil(L);
+		else
+			Input(it->second).Push(L);
+	}
+	static void NewIndex(lua_State* L, C& c)
+	{
+		if(!ValidKey(L, 2))
+			luaL_error(L, "invalid %s key to a map", luaL_typename(L, 2));
+		typename C::key_type key;
+		Output(key).Get(L, 2);
+		if(lua_isnil(L, 3))
+			c.erase(key);
+		else
+			Output(c[key], overwrite).Get(L, 3);
+	}
+	static int Next(lua_State* L, C& c)
+	{
+		typename C::const_iterator it = c.begin();
+		if(!lua_isnil(L, 2))
+		{
+			if(!ValidKey(L, 2))
+				luaL_error(L, "invalid key to 'next'");
+			typename C::key_type key;
+			Output(key).Get(L, 2);
+			it = c.find(key);
+			if(it == c.end())
+				luaL_error(L, "invalid key to 'next'");
+			++it;
+		}
+		if(it == c.end())
+			return 0;
+		Input(it->first).Push(L);
+		Input(it->second).Push(L);
+		return 2;
+	}
+};
+
+template<class C> struct ProxyAccess { typedef SequenceProxy<C> type; };
+#if LCBC_USE_CSL
+template<class K, class T, class P, class A> struct ProxyAccess<map<K,T,P,A> > { typedef MapProxy<map<K,T,P,A> > type; };
+#if LCBC_USE_CPP11
+template<class K, class T, class H, class E, class A> struct ProxyAccess<unordered_map<K,T,H,E,A> > { typedef MapProxy<unordered_map<K,T,H,E,A> > type; };
+#endif
+#endif
+
+// Userdata of a container proxy: the header followed by the handle of the container
+template<class H> struct ProxyBox
+{
+	ProxyHeader Header;
+	H Handle;
+};
+
+template<class H> class Proxy
+{
+public:
+	typedef typename ProxyHandle<H>::Container Container;
+	typedef typename ProxyAccess<Container>::type Access;
+	static void Push(lua_State* L, const Reference<H>& ref)
+	{
+		ProxyBox<H>* box = (ProxyBox<H>*)lua_newuserdata(L, sizeof(ProxyBox<H>));
+		box->Header.Valid = true;
+		box->Header.Writable = ref.Writable;
+		box->Handle = ref.Handle;
+		PushMetatable(L);
+		lua_setmetatable(L, -2);
+		Proxies::Add(L);
+	}
+private:
+	// The metamethods are closures having the metatable as upvalue, to check their first argument
+	static void PushMetatable(lua_State* L)
+	{
+		lua_pushlightuserdata(L, &Key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if(lua_istable(L, -1))
+			return;
+		lua_pop(L, 1);
+		static const luaL_Reg methods[] = {
+			{ "__index", Index }, { "__newindex", NewIndex }, { "__len", Len }, 
+			{ "__pairs", Pairs }, { "__ipairs", IPairs }, { "__call", Pairs }, { NULL, NULL } };
+		lua_createtable(L, 0, sizeof(methods)/sizeof(methods[0])-1);
+		for(const luaL_Reg* m=methods;m->name;m++)
+		{
+			lua_pushvalue(L, -1);
+			lua_pushcclosure(L, m->func, 1);
+			lua_setfield(L, -2, m->name);
+		}
+		lua_pushlightuserdata(L, &Key);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	static Container& Check(lua_State* L, bool write)
+	{
+		ProxyBox<H>* box = (ProxyBox<H>*)lua_touserdata(L, 1);
+		if(!box || !lua_getmetatable(L, 1) || !lua_rawequal(L, -1, lua_upvalueindex(1)))
+			luaL_argerror(L, 1, "container proxy expected");
+		lua_pop(L, 1);
+		if(!box->Header.Valid)
+			luaL_error(L, "attempt to use a container proxy after the end of its call");
+		if(write && !box->Header.Writable)
+			luaL_error(L, "attempt to modify a read-only container proxy");
+		return ProxyHandle<H>::Deref(box->Handle);
+	}
+	static int Index(lua_State* L) { Access::Index(L, Check(L, false)); return 1; }
+	static int NewIndex(lua_State* L) { Access::NewIndex(L, Check(L, true)); return 0; }
+	static int Len(lua_State* L) { lua_pushinteger(L, (lua_Integer)Access::Size(Check(L, false))); return 1; }
+	static int Next(lua_State* L) { lua_settop(L, 2); return Access::Next(L, Check(L, false)); }
+	static int INext(lua_State* L)
+	{
+		lua_Integer i = luaL_checkinteger(L, 2) + 1;
+		lua_settop(L, 1);
+		lua_pushinteger(L, i);
+		Access::Index(L, Check(L, false));
+		return lua_isnil(L, -1) ? 0 : 2;
+	}
+	static int Iterate(lua_State* L, lua_CFunction next)
+	{
+		Check(L, false);
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_pushcclosure(L, next, 1);
+		lua_pushvalue(L, 1);
+		return 2;
+	}
+	static int Pairs(lua_State* L) { Iterate(L, Next); lua_pushnil(L); return 3; }
+	static int IPairs(lua_State* L) { Iterate(L, INext); lua_pushinteger(L, 0); return 3; }
+	static char Key;
+};
+
+template<class H> char Proxy<H>::Key = 0;
+
+template<class H> inline void Input::PushReference(lua_State* L) const
+{
+	Proxy<H>::Push(L, *(const Reference<H>*)PointerValue);
+}
+
+/* Input(buffer, data, size) passes a block of memory to a script without copying it. The script
+   receives a userdata reading the caller memory, which is only valid during the call, like the
+   container proxies: afterwards, accessing it raises an error. The script can modify the memory
+   unless it is const. In Lua, b[i] is the byte at i (from 1), #b the size, and the methods are:
+   - int(i, n [, bigendian]) and uint(i, n [, bigendian]), the integer of n bytes (1 to 8) at i,
+     and setint(i, n, value [, bigendian]);
+   - sub(i [, j]), the view of the bytes i to j (negative positions count from the end, as for
+     strings), which shares the memory and the lifetime of the buffer;
+   - find(s [, init]), the positions of the first and last bytes of the first occurrence of s;
+   - tostring([i [, j]]), a Lua string copied from the bytes i to j.
+   Output(buffer, ...) copies a string or a buffer result into a vector of bytes, into a span,
+   which is narrowed to the bytes written, or into size bytes, size receiving the length of the result. */
+class Buffer
+{
+public:
+	struct Box
+	{
+		ProxyHeader Header;
+		unsigned char* Data;
+		size_t Size;
+	};
+	static void Push(lua_State* L, const void* data, size_t size, bool writable);
+	// Returns the bytes of the string or of the buffer at idx, raising an error for other values
+	static const unsigned char* Check(lua_State* L, int idx, size_t& size);
+private:
+	static Box* To(lua_State* L, int idx);
+	static Box* CheckBox(lua_State* L, bool write = false);
+	static void PushMetatable(lua_State* L);
+	static size_t CheckOffset(lua_State* L, const Box* b, int arg, size_t n);
+	static size_t CheckWidth(lua_State* L, int arg);
+	static void Range(lua_State* L, const Box* b, int arg, size_t& first, size_t& last);
+	static unsigned long long Read(const unsigned char* p, size_t n, bool bigendian);
+	static int Index(lua_State* L);
+	static int NewIndex(lua_State* L);
+	static int Len(lua_State* L);
+	static int ToString(lua_State* L);
+	static int Int(lua_State* L);
+	static int UInt(lua_State* L);
+	static int SetInt(lua_State* L);
+	static int Sub(lua_State* L);
+	static int Find(lua_State* L);
+	static int ToLuaString(lua_State* L);
+};
+
+inline void Buffer::Push(lua_State* L, const void* data, size_t size, bool writable)
+{
+	Box* b = (Box*)lua_newuserdata(L, sizeof(Box));
+	b->Header.Valid = true;
+	b->Header.Writable = writable;
+	b->Data = (unsigned char*)data;
+	b->Size = size;
+	PushMetatable(L);
+	lua_setmetatable(L, -2);
+	Proxies::Add(L);
+}
+
+inline Buffer::Box* Buffer::To(lua_State* L, int idx)
+{
+	void* ud = lua_touserdata(L, idx);
+	if(!ud || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, "LuaClassBasedBuffer");
+	int equal = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return equal ? (Box*)ud : NULL;
+}
+
+inline Buffer::Box* Buffer::CheckBox(lua_State* L, bool write)
+{
+	Box* b = (Box*)luaL_checkudata(L, 1, "LuaClassBasedBuffer");
+	if(!b->Header.Valid)
+		luaL_error(L, "attempt to use a buffer after the end of its call");
+	if(write && !b->Header.Writable)
+		luaL_error(L, "attempt to modify a read-only buffer");
+	return b;
+}
+
+inline const unsigned char* Buffer::Check(lua_State* L, int idx, size_t& size)
+{
+	Box* b = lua_type(L, idx) == LUA_TUSERDATA ? To(L, idx) : NULL;
+	if(!b)
+		return (const unsigned char*)luaL_checklstring(L, idx, &size);
+	if(!b->Header.Valid)
+		luaL_error(L, "attempt to use a buffer after the end of its call");
+	size = b->Size;
+	return b->Data;
+}
+
+inline void Buffer::PushMetatable(lua_State* L)
+{
+	if(!luaL_newmetatable(L, "LuaClassBasedBuffer"))
+		return;
+	static const luaL_Reg methods[] = {
+		{ "int", Int }, { "uint", UInt }, { "setint", SetInt }, { "sub", Sub }, 
+		{ "find", Find }, { "tostring", ToLuaString }, { NULL, NULL } };
+	lua_createtable(L, 0, sizeof(methods)/sizeof(methods[0])-1);
+	for(const luaL_Reg* m=methods;m->name;m++)
+	{
+		lua_pushcfunction(L, m->func);
+		lua_setfield(L, -2, m->name);
+	}
+	lua_pushcclosure(L, Index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, NewIndex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, Len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, ToString);
+	lua_setfield(L, -2, "__tostring");
+}
+
+// Offset of the n bytes starting at the position given by arg
+inline size_t Buffer::CheckOffset(lua_State* L, const Box* b, int arg, size_t n)
+{
+	lua_Number i = luaL_checknumber(L, arg);
+	if(i < 1 || n > b->Size || i > (lua_Number)(b->Size - n + 1) || i != (lua_Number)(size_t)i)
+		luaL_error(L, "position %f out of range [1, %d] for %d bytes", i, (int)b->Size, (int)n);
+	return (size_t)i - 1;
+}
+
+inline size_t Buffer::CheckWidth(lua_State* L, int arg)
+{
+	lua_Integer n = luaL_checkinteger(L, arg);
+	if(n < 1 || n > 8)
+		luaL_argerror(L, arg, "size must be from 1 to 8 bytes");
+	return (size_t)n;
+}
+
+// Positions i and j at arg and arg+1, made relative as for string.sub; empty if last < first
+inline void Buffer::Range(lua_State* L, const Box* b, int arg, size_t& first, size_t& last)
+{
+	lua_Number size = (lua_Number)b->Size;
+	lua_Number i = luaL_optnumber(L, arg, 1);
+	lua_Number j = luaL_optnumber(L, arg+1, -1);
+	if(i < 0)
+		i += size + 1;
+	if(j < 0)
+		j += size + 1;
+	if(i < 1)
+		i = 1;
+	if(i > size + 1)
+		i = size + 1;
+	if(j > size)
+		j = size;
+	first = (size_t)i;
+	last = j < i ? first - 1 : (size_t)j;
+}
+
+inline unsigned long long Buffer::Read(const unsigned char* p, size_t n, bool bigendian)
+{
+	unsigned long long value = 0;
+	for(size_t k=0;k<n;k++)
+		value |= (unsigned long long)p[bigendian ? n-1-k : k] << (8*k);
+	return value;
+}
+
+inline int Buffer::Index(lua_State* L)
+{
+	const Box* b = CheckBox(L);
+	if(lua_type(L, 2) == LUA_TNUMBER)
+	{
+		lua_Number n = lua_tonumber(L, 2);
+		if(n >= 1 && n <= (lua_Number)b->Size && n == (lua_Number)(size_t)n)
+			lua_pushinteger(L, b->Data[(size_t)n - 1]);
+		else
+			lua_pushnil(L);
+		return 1;
+	}
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	return 1;
+}
+
+inline int Buffer::NewIndex(lua_State* L)
+{
+	Box* b = CheckBox(L, true);
+	b->Data[CheckOffset(L, b, 2, 1)] = (unsigned char)luaL_checkinteger(L, 3);
+	return 0;
+}
+
+inline int Buffer::Len(lua_State* L)
+{
+	lua_pushinteger(L, (lua_Integer)CheckBox(L)->Size);
+	return 1;
+}
+
+inline int Buffer::ToString(lua_State* L)
+{
+	const Box* b = (const Box*)luaL_checkudata(L, 1, "LuaClassBasedBuffer");
+	lua_pushfstring(L, "buffer[%d]: %p", (int)b->Size, b);
+	return 1;
+}
+
+inline int Buffer::Int(lua_State* L)
+{
+	const Box* b = CheckBox(L);
+	size_t n = CheckWidth(L, 3);
+	unsigned long long value = Read(b->Data + CheckOffset(L, b, 2, n), n, lua_toboolean(L, 4) != 0);
+	if(n < 8 && (value >> (8*n-1)))
+		value |= ~0ULL << (8*n);
+#if LUA_VERSION_NUM >= 503
+	lua_pushinteger(L, (lua_Integer)(long long)value);
+#else
+	lua_pushnumber(L, (lua_Number)(long long)value);
+#endif
+	return 1;
+}
+
+inline int Buffer::UInt(lua_State* L)
+{
+	const Box* b = CheckBox(L);
+	size_t n = CheckWidth(L, 3);
+	unsigned long long value = Read(b->Data + CheckOffset(L, b, 2, n), n, lua_toboolean(L, 4) != 0);
+#if LUA_VERSION_NUM >= 503
+	if(n < 8)
+		lua_pushinteger(L, (lua_Integer)value);
+	else
+#endif
+	lua_pushnumber(L, (lua_Number)value);
+	return 1;
+}
+
+inline int Buffer::SetInt(lua_State* L)
+{
+	Box* b = CheckBox(L, true);
+	size_t n = CheckWidth(L, 3);
+	unsigned char* p = b->Data + CheckOffset(L, b, 2, n);
+#if LUA_VERSION_NUM >= 503
+	unsigned long long value = lua_isinteger(L, 4) ? (unsigned long long)lua_tointeger(L, 4) : (unsigned long long)(long long)luaL_checknumber(L, 4);
+#else
+	lua_Number number = luaL_checknumber(L, 4);
+	unsigned long long value = number < 0 ? (unsigned long long)(long long)number : (unsigned long long)number;
+#endif
+	bool bigendian = lua_toboolean(L, 5) != 0;
+	for(size_t k=0;k<n;k++)
+		p[bigendian ? n-1-k : k] = (unsigned char)(value >> (8*k));
+	return 0;
+}
+
+inline int Buffer::Sub(lua_State* L)
+{
+	const Box* b = CheckBox(L);
+	size_t first, last;
+	Range(L, b, 2, first, last);
+	Push(L, b->Data + first - 1, last + 1 - first, b->Header.Writable);
+	return 1;
+}
+
+inline int Buffer::Find(lua_State* L)
+{
+	const Box* b = CheckBox(L);
+	size_t len;
+	const char* s = luaL_checklstring(L, 2, &len);
+	lua_Number init = luaL_optnumber(L, 3, 1);
+	if(init < 0)
+		init += (lua_Number)b->Size + 1;
+	size_t start = init < 1 ? 0 : (size_t)init - 1;
+	if(start > b->Size || len > b->Size - start)
+		return 0;
+	if(len == 0)
+	{
+		lua_pushinteger(L, (lua_Integer)start + 1);
+		lua_pushinteger(L, (lua_Integer)start);
+		return 2;
+	}
+	const unsigned char* end = b->Data + b->Size - len + 1;
+	for(const unsigned char* p=b->Data+start;p<end;p++)
+	{
+		p = (const unsigned char*)memchr(p, (unsigned char)s[0], end - p);
+		if(!p)
+			break;
+		if(!memcmp(p, s, len))
+		{
+			lua_pushinteger(L, (lua_Integer)(p - b->Data) + 1);
+			lua_pushinteger(L, (lua_Integer)(p - b->Data + len));
+			return 2;
+		}
+	}
+	return 0;
+}
+
+inline int Buffer::ToLuaString(lua_State* L)
+{
+	const Box* b = CheckBox(L);
+	size_t first, last;
+	Range(L, b, 2, first, last);
+	lua_pushlstring(L, (const char*)b->Data + first - 1, last + 1 - first);
+	return 1;
+}
+
+template<bool W> inline void Input::PushBuffer(lua_State* L) const
+{
+	Buffer::Push(L, PointerValue, Size, W);
+}
+
+inline void Output::GetBuffer(lua_State* L, int idx) const
+{
+	size_t size;
+	const unsigned char* data = Buffer::Check(L, idx, size);
+	memcpy(PointerValue, data, GetSize(size));
+}
+
+#if LCBC_USE_CSL
+template<class C> inline void Output::GetBufferContainer(lua_State* L, int idx) const
+{
+	(void)sizeof(StaticCheck<sizeof(typename C::value_type) == 1>);
+	C* v = (C*)PointerValue;
+	size_t size;
+	const unsigned char* data = Buffer::Check(L, idx, size);
+	v->resize(size);
+	if(size)
+		memcpy(&(*v)[0], data, size);
+}
+#endif
+
+#if LCBC_HAS_SPAN
+template<class T> inline void Output::GetBufferSpan(lua_State* L, int idx) const
+{
+	(void)sizeof(StaticCheck<sizeof(T) == 1>);
+	span<T>* v = (span<T>*)PointerValue;
+	size_t size;
+	const unsigned char* data = Buffer::Check(L, idx, size);
+	if(size > v->size())
+		size = v->size();
+	memcpy(v->data(), data, size);
+	*v = v->first(size);
+}
+#endif
+
+#if LCBC_USE_TINYXML
+struct XmlView::Box
+{
+	ProxyHeader Header;
+	const TiXmlNode* Node;
+	// Last child read, at Position, and number of children (-1 until counted)
+	const TiXmlNode* Cursor;
+	int Position;
+	int Count;
+};
+
+inline void XmlView::Push(lua_State* L, const TiXmlNode* node)
+{
+	Box* b = (Box*)lua_newuserdata(L, sizeof(Box));
+	b->Header.Valid = true;
+	b->Header.Writable = false;
+	b->Node = node;
+	b->Cursor = NULL;
+	b->Position = 0;
+	b->Count = -1;
+	PushMetatable(L);
+	lua_setmetatable(L, -2);
+	Proxies::Add(L);
+}
+
+inline const TiXmlNode* XmlView::To(lua_State* L, int idx)
+{
+	Box* b = (Box*)lua_touserdata(L, idx);
+	if(!b || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, "LuaClassBasedXmlView");
+	int equal = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	if(!equal)
+		return NULL;
+	if(!b->Header.Valid)
+		luaL_error(L, "attempt to use an XML view after the end of its call");
+	return b->Node;
+}
+
+inline XmlView::Box* XmlView::Check(lua_State* L)
+{
+	Box* b = (Box*)luaL_checkudata(L, 1, "LuaClassBasedXmlView");
+	if(!b->Header.Valid)
+		luaL_error(L, "attempt to use an XML view after the end of its call");
+	return b;
+}
+
+inline const TiXmlNode* XmlView::Child(Box* b, int i)
+{
+	if(i < 1 || (b->Count >= 0 && i > b->Count))
+		return NULL;
+	if(!b->Cursor || i < b->Position)
+	{
+		b->Cursor = b->Node->FirstChild();
+		b->Position = 1;
+	}
+	while(b->Cursor && b->Position < i)
+	{
+		b->Cursor = b->Cursor->NextSibling();
+		b->Position++;
+	}
+	if(!b->Cursor)
+	{
+		b->Count = b->Position - 1;
+		b->Position = 0;
+	}
+	return b->Cursor;
+}
+
+inline void XmlView::PushMetatable(lua_State* L)
+{
+	if(!luaL_newmetatable(L, "LuaClassBasedXmlView"))
+		return;
+	static const luaL_Reg methods[] = {
+		{ "__index", Index }, { "__newindex", NewIndex }, { "__len", Len }, { "__tostring", ToString }, 
+		{ "__call", Iterate }, { "__ipairs", Iterate }, { NULL, NULL } };
+	for(const luaL_Reg* m=methods;m->name;m++)
+	{
+		lua_pushcfunction(L, m->func);
+		lua_setfield(L, -2, m->name);
+	}
+}
+
+inline int XmlView::Index(lua_State* L)
+{
+	Box* b = Check(L);
+	if(lua_type(L, 2) == LUA_TSTRING)
+	{
+		const TiXmlElement* elem = b->Node->ToElement();
+		const char* value = elem ? elem->Attribute(lua_tostring(L, 2)) : NULL;
+		if(value)
+			Xml::PushAttribute(L, value);
+		else
+			lua_pushnil(L);
+		return 1;
+	}
+	lua_Number n = lua_tonumber(L, 2);
+	if(n == 0 && lua_type(L, 2) == LUA_TNUMBER)
+	{
+		if(b->Node->ToElement())
+			lua_pushstring(L, b->Node->Value());
+		else
+			lua_pushnil(L);
+		return 1;
+	}
+	const TiXmlNode* child = n >= 1 && n <= INT_MAX && n == (lua_Number)(int)n ? Child(b, (int)n) : NULL;
+	if(!child)
+		lua_pushnil(L);
+	else if(child->ToElement())
+		Push(L, child);
+	else
+	{
+		Xml::Names names(L);
+		Xml::PushNode(L, child, names);
+	}
+	return 1;
+}
+
+inline int XmlView::NewIndex(lua_State* L)
+{
+	Check(L);
+	return luaL_error(L, "attempt to modify an XML view");
+}
+
+inline int XmlView::Len(lua_State* L)
+{
+	Box* b = Check(L);
+	if(b->Count < 0)
+	{
+		int count = 0;
+		for(const TiXmlNode* child = b->Node->FirstChild();child;child = child->NextSibling())
+			count++;
+		b->Count = count;
+	}
+	lua_pushinteger(L, b->Count);
+	return 1;
+}
+
+inline int XmlView::ToString(lua_State* L)
+{
+	const Box* b = (const Box*)luaL_checkudata(L, 1, "LuaClassBasedXmlView");
+	lua_pushfstring(L, "xmlview<%s>: %p", b->Node->Value(), b);
+	return 1;
+}
+
+inline int XmlView::Next(lua_State* L)
+{
+	lua_Integer i = luaL_checkinteger(L, 2) + 1;
+	lua_settop(L, 1);
+	lua_pushinteger(L, i);
+	Index(L);
+	return lua_isnil(L, -1) ? 0 : 2;
+}
+
+inline int XmlView::Iterate(lua_State* L)
+{
+	Check(L);
+	lua_pushcfunction(L, Next);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
+template<> inline void Input::PushReference<TiXmlElement*>(lua_State* L) const
+{
+	XmlView::Push(L, ((const Reference<TiXmlElement*>*)PointerValue)->Handle);
+}
+
+template<> inline void Input::PushReference<TiXmlDocument*>(lua_State* L) const
+{
+	XmlView::Push(L, ((const Reference<TiXmlDocument*>*)PointerValue)->Handle);
+}
+#endif
+
+/* Snapshot is the compact binary image of a Lua value: nil, booleans, numbers, strings and
+   tables of them, nested at will. A table referenced several times, even by itself, is stored
+   once and the references are restored as such; each distinct string is also stored once.
+   Metatables are not saved. The image starts with the "LCBS" signature and a version byte,
+   and does not depend on the byte order.
+   As an Output, a snapshot receives the image of a result; as an Input, it rebuilds the value,
+   creating each table with its final size (an empty snapshot gives nil). Load maps a file
+   in memory when LCBC_USE_MMAP is set, Save writes one. Write and Read raise Lua errors:
+   outside of a call, they must be run in protected mode. */
+class Snapshot
+{
+public:
+	enum { Version = 1, MaxDepth = 1000 };
+	Snapshot() : Data(NULL), Size(0), Capacity(0), Mapped(false) {}
+	Snapshot(const void* data, size_t size) : Data(NULL), Size(0), Capacity(0), Mapped(false) { Assign(data, size); }
+	Snapshot(const Snapshot& src) : Data(NULL), Size(0), Capacity(0), Mapped(false) { Assign(src.Data, src.Size); }
+	~Snapshot() { Clear(); }
+	Snapshot& operator=(const Snapshot& src)
+	{
+		if(this != &src)
+			Assign(src.Data, src.Size);
+		return *this;
+	}
+	const char* data() const { return Data; }
+	size_t size() const { return Size; }
+	bool empty() const { return Size == 0; }
+	void Assign(const void* data, size_t size);
+	void Clear();
+	bool Load(const char* filename);
+	bool Save(const char* filename) const;
+	void swap(Snapshot& other)
+	{
+		char* data = Data;
+		size_t size = Size, capacity = Capacity;
+		bool mapped = Mapped;
+		Data = other.Data;
+		Size = other.Size;
+		Capacity = other.Capacity;
+		Mapped = other.Mapped;
+		other.Data = data;
+		other.Size = size;
+		other.Capacity = capacity;
+		other.Mapped = mapped;
+	}
+	// Replaces the content of snapshot by the image of the value at idx
+	static void Write(lua_State* L, int idx, Snapshot& snapshot);
+	// Pushes the value rebuilt from an image
+	static void Read(lua_State* L, const void* data, size_t size);
+	// Type of each value in the image
+	enum Tag { NilTag, FalseTag, TrueTag, IntegerTag, NegativeTag, NumberTag, StringTag, StringRefTag, TableTag, TableRefTag };
+private:
+	class Writer;
+	class Reader;
+	bool Reserve(size_t size);
+	char* Data;
+	size_t Size;
+	size_t Capacity;
+	bool Mapped;
+};
+
+/* Writes values depth first. The tables and strings already written are numbered in two
+   temporary tables at the stack indexes Tables and Strings: their next occurrences become references. */
+class Snapshot::Writer
+{
+public:
+	Writer(lua_State* l, Snapshot& out, int tables, int strings) 
+		: L(l), Out(out), Tables(tables), Strings(strings), TableCount(0), StringCount(0), Depth(0) {}
+	void Value(int idx)
+	{
+		switch(lua_type(L, idx))
+		{
+		case LUA_TNONE:
+		case LUA_TNIL: Byte(NilTag); break;
+		case LUA_TBOOLEAN: Byte(lua_toboolean(L, idx) ? TrueTag : FalseTag); break;
+		case LUA_TNUMBER: Number(idx); break;
+		case LUA_TSTRING: String(idx); break;
+		case LUA_TTABLE: Table(idx); break;
+		default: luaL_error(L, "cannot store a %s value in a snapshot", luaL_typename(L, idx));
+		}
+	}
+	void Byte(int value)
+	{
+		unsigned char byte = (unsigned char)value;
+		Bytes(&byte, 1);
+	}
+	void Bytes(const void* data, size_t len)
+	{
+		if(!Out.Reserve(Out.Size + len))
+			luaL_error(L, "not enough memory for the snapshot");
+		memcpy(Out.Data + Out.Size, data, len);
+		Out.Size += len;
+	}
+	// 7 bits per byte, the high bit telling that more bytes follow
+	void Varint(unsigned long long value)
+	{
+		unsigned char buffer[10];
+		size_t len = 0;
+		do
+		{
+			buffer[len] = (unsigned char)(value & 0x7F);
+			value >>= 7;
+			if(value)
+				buffer[len] |= 0x80;
+			len++;
+		} while(value);
+		Bytes(buffer, len);
+	}
+private:
+	void Number(int idx)
+	{
+		lua_Number number = lua_tonumber(L, idx);
+#if LUA_VERSION_NUM >= 503
+		if(lua_isinteger(L, idx))
+			return Integer(lua_tointeger(L, idx));
+#else
+		if(number > -2147483648.0 && number < 2147483648.0 && number == (lua_Number)(lua_Integer)number)
+			return Integer((lua_Integer)number);
+#endif
+		double value = (double)number;
+		unsigned long long bits;
+		memcpy(&bits, &value, sizeof(bits));
+		unsigned char buffer[8];
+		for(int i=0;i<8;i++)
+			buffer[i] = (unsigned char)(bits >> (8*i));
+		Byte(NumberTag);
+		Bytes(buffer, 8);
+	}
+	void Integer(lua_Integer value)
+	{
+		Byte(value < 0 ? NegativeTag : IntegerTag);
+		Varint(value < 0 ? (unsigned long long)(-(value+1)) : (unsigned long long)value);
+	}
+	// Writes a reference if the table or string at idx has already been numbered in list, else numbers it
+	bool Shared(int idx, int list, int& count, int tag)
+	{
+		lua_pushvalue(L, idx);
+		lua_rawget(L, list);
+		lua_Integer number = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if(number)
+		{
+			Byte(tag);
+			Varint((unsigned long long)number);
+			return true;
+		}
+		lua_pushvalue(L, idx);
+		lua_pushinteger(L, ++count);
+		lua_rawset(L, list);
+		return false;
+	}
+	void String(int idx)
+	{
+		if(Shared(idx, Strings, StringCount, StringRefTag))
+			return;
+		size_t len;
+		const char* str = lua_tolstring(L, idx, &len);
+		Byte(StringTag);
+		Varint(len);
+		Bytes(str, len);
+	}
+	static bool ArrayKey(lua_State* L, int idx, size_t len)
+	{
+		if(lua_type(L, idx) != LUA_TNUMBER)
+			return false;
+		lua_Number key = lua_tonumber(L, idx);
+		return key >= 1 && key <= (lua_Number)len && key == (lua_Number)(size_t)key;
+	}
+	void Table(int idx)
+	{
+		if(Shared(idx, Tables, TableCount, TableRefTag))
+			return;
+		if(++Depth > MaxDepth)
+			luaL_error(L, "tables nested too deeply for a snapshot");
+		luaL_checkstack(L, 4, "tables nested too deeply for a snapshot");
+		size_t len = lua_objlen(L, idx), hashed = 0;
+		lua_pushnil(L);
+		while(lua_next(L, idx))
+		{
+			if(!ArrayKey(L, -2, len))
+				hashed++;
+			lua_pop(L, 1);
+		}
+		Byte(TableTag);
+		Varint(len);
+		Varint(hashed);
+		int top = lua_gettop(L);
+		for(size_t i=1;i<=len;i++)
+		{
+			lua_rawgeti(L, idx, (int)i);
+			Value(top+1);
+			lua_pop(L, 1);
+		}
+		lua_pushnil(L);
+		while(lua_next(L, idx))
+		{
+			if(!ArrayKey(L, top+1, len))
+			{
+				Value(top+1);
+				Value(top+2);
+			}
+			lua_pop(L, 1);
+		}
+		Depth--;
+	}
+	lua_State* L;
+	Snapshot& Out;
+	int Tables, Strings;
+	int TableCount, StringCount;
+	int Depth;
+};
+
+// Rebuilds values, checking every size against the remaining bytes
+class Snapshot::Reader
+{
+public:
+	Reader(lua_State* l, const unsigned char* data, size_t size, int tables, int strings)
+		: L(l), Pos(data), End(data+size), Tables(tables), Strings(strings), TableCount(0), StringCount(0), Depth(0) {}
+	void Value()
+	{
+		switch(Byte())
+		{
+		case NilTag: lua_pushnil(L); break;
+		case FalseTag: lua_pushboolean(L, 0); break;
+		case TrueTag: lua_pushboolean(L, 1); break;
+		case IntegerTag: PushInteger(Varint(), false); break;
+		case NegativeTag: PushInteger(Varint(), true); break;
+		case NumberTag: Number(); break;
+		case StringTag: String(); break;
+		case StringRefTag: Shared(Strings, StringCount); break;
+		case TableTag: Table(); break;
+		case TableRefTag: Shared(Tables, TableCount); break;
+		default: Corrupted();
+		}
+	}
+	bool Finished() const { return Pos == End; }
+	void Corrupted() { luaL_error(L, "corrupted snapshot"); }
+private:
+	size_t Remaining() const { return (size_t)(End - Pos); }
+	int Byte()
+	{
+		if(Pos == End)
+			Corrupted();
+		return *Pos++;
+	}
+	unsigned long long Varint()
+	{
+		unsigned long long value = 0;
+		for(int shift=0;;shift+=7)
+		{
+			if(shift >= 64)
+				Corrupted();
+			int byte = Byte();
+			value |= (unsigned long long)(byte & 0x7F) << shift;
+			if(!(byte & 0x80))
+				return value;
+		}
+	}
+	void PushInteger(unsigned long long value, bool negative)
+	{
+#if LUA_VERSION_NUM >= 503
+		lua_pushinteger(L, negative ? -(lua_Integer)value - 1 : (lua_Integer)value);
+#else
+		lua_pushnumber(L, negative ? -(lua_Number)value - 1 : (lua_Number)value);
+#endif
+	}
+	void Number()
+	{
+		if(Remaining() < 8)
+			Corrupted();
+		unsigned long long bits = 0;
+		for(int i=0;i<8;i++)
+			bits |= (unsigned long long)*Pos++ << (8*i);
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		lua_pushnumber(L, (lua_Number)value);
+	}
+	void String()
+	{
+		unsigned long long len = Varint();
+		if(len > Remaining())
+			Corrupted();
+		lua_pushlstring(L, (const char*)Pos, (size_t)len);
+		Pos += len;
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, Strings, ++StringCount);
+	}
+	void Shared(int list, int count)
+	{
+		unsigned long long number = Varint();
+		if(number < 1 || number > (unsigned long long)count)
+			Corrupted();
+		lua_rawgeti(L, list, (int)number);
+	}
+	void Table()
+	{
+		unsigned long long len = Varint(), hashed = Varint();
+		// Each value takes at least one byte
+		if(len > Remaining() || hashed > Remaining()/2)
+			Corrupted();
+		if(++Depth > MaxDepth)
+			luaL_error(L, "tables nested too deeply for a snapshot");
+		luaL_checkstack(L, 4, "tables nested too deeply for a snapshot");
+		lua_createtable(L, (int)len, (int)hashed);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, Tables, ++TableCount);
+		for(int i=1;i<=(int)len;i++)
+		{
+			Value();
+			if(lua_isnil(L, -1))
+				lua_pop(L, 1);
+			else
+				lua_rawseti(L, -2, i);
+		}
+		for(unsigned long long i=0;i<hashed;i++)
+		{
+			Value();
+			if(lua_isnil(L, -1))
+				Corrupted();
+			Value();
+			lua_rawset(L, -3);
+		}
+		Depth--;
+	}
+	lua_State* L;
+	const unsigned char* Pos;
+	const unsigned char* End;
+	int Tables, Strings;
+	int TableCount, StringCount;
+	int Depth;
+};
+
+inline bool Snapshot::Reserve(size_t size)
+{
+	if(size <= Capacity)
+		return true;
+	size_t capacity = Capacity ? Capacity : 256;
+	while(capacity < size)
+		capacity *= 2;
+	char* data = (char*)realloc(Data, capacity);
+	if(!data)
+		return false;
+	Data = data;
+	Capacity = capacity;
+	return true;
+}
+
+inline void Snapshot::Clear()
+{
+	if(Mapped)
+	{
+#if LCBC_USE_MMAP && defined(_WIN32)
+		UnmapViewOfFile(Data);
+#elif LCBC_USE_MMAP
+		munmap(Data, Size);
+#endif
+	}
+	else
+		free(Data);
+	Data = NULL;
+	Size = Capacity = 0;
+	Mapped = false;
+}
+
+inline void Snapshot::Assign(const void* data, size_t size)
+{
+	Clear();
+	if(size && Reserve(size))
+	{
+		memcpy(Data, data, size);
+		Size = size;
+	}
+}
+
+inline bool Snapshot::Load(const char* filename)
+{
+	Clear();
+#if LCBC_USE_MMAP && defined(_WIN32)
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if(GetFileSizeEx(file, &size) && size.QuadPart > 0 && (unsigned long long)size.QuadPart <= (size_t)-1)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(mapping)
+		{
+			Data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	if(!Data)
+		return false;
+	Size = (size_t)size.QuadPart;
+	Mapped = true;
+#elif LCBC_USE_MMAP
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat info;
+	void* data = MAP_FAILED;
+	if(fstat(fd, &info) == 0 && info.st_size > 0)
+		data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return false;
+	Data = (char*)data;
+	Size = (size_t)info.st_size;
+	Mapped = true;
+#else
+	FILE* file = fopen(filename, "rb");
+	if(!file)
+		return false;
+	long size = -1;
+	if(fseek(file, 0, SEEK_END) == 0)
+		size = ftell(file);
+	bool res = size > 0 && fseek(file, 0, SEEK_SET) == 0 && Reserve((size_t)size) 
+		&& fread(Data, 1, (size_t)size, file) == (size_t)size;
+	fclose(file);
+	if(!res)
+		return Clear(), false;
+	Size = (size_t)size;
+#endif
+	return true;
+}
+
+inline bool Snapshot::Save(const char* filename) const
+{
+	FILE* file = fopen(filename, "wb");
+	if(!file)
+		return false;
+	bool res = fwrite(Data, 1, Size, file) == Size;
+	return fclose(file) == 0 && res;
+}
+
+inline void Snapshot::Write(lua_State* L, int idx, Snapshot& snapshot)
+{
+	if(idx < 0 && idx > LUA_REGISTRYINDEX)
+		idx = lua_gettop(L) + idx + 1;
+	if(snapshot.Mapped)
+		snapshot.Clear();
+	snapshot.Size = 0;
+	lua_newtable(L);
+	lua_newtable(L);
+	int top = lua_gettop(L);
+	Writer writer(L, snapshot, top-1, top);
+	writer.Bytes("LCBS", 4);
+	writer.Byte(Version);
+	writer.Value(idx);
+	lua_pop(L, 2);
+}
+
+inline void Snapshot::Read(lua_State* L, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	if(size < 5 || memcmp(bytes, "LCBS", 4))
+		luaL_error(L, "not a snapshot");
+	if(bytes[4] != Version)
+		luaL_error(L, "unsupported snapshot version %d", (int)bytes[4]);
+	lua_newtable(L);
+	lua_newtable(L);
+	int top = lua_gettop(L);
+	Reader reader(L, bytes+5, size-5, top-1, top);
+	reader.Value();
+	if(!reader.Finished())
+		reader.Corrupted();
+	lua_replace(L, top-1);
+	lua_pop(L, 1);
+}
+
+inline void Input::PushSnapshot(lua_State* L) const
+{
+	const Snapshot* snapshot = (const Snapshot*)PointerValue;
+	if(snapshot->empty())
+		lua_pushnil(L);
+	else
+		Snapshot::Read(L, snapshot->data(), snapshot->size());
+}
+
+inline void Output::GetSnapshot(lua_State* L, int idx) const
+{
+	Snapshot::Write(L, idx, *(Snapshot*)PointerValue);
+}
+
+/* Dataset is an immutable snapshot loaded once in the process and shared by any number of Lua
+   states, possibly running in different threads. Its tables are not copied to the states: they
+   are seen as read-only userdata, whose lookups are done natively, directly in the array part
+   or by a binary search among the sorted keys. They support the # operator, pairs (or calling
+   the table itself with Lua 5.1) and ipairs. Reading a table several times gives the same
+   userdata, and strings are only copied to a state when read. The dataset must not be modified
+   nor destroyed while Lua states using it are alive. */
+class Dataset
+{
+public:
+	Dataset() : Values(NULL), Entries(NULL), Tables(NULL), ValueCount(0), EntryCount(0), TableCount(0) { Root.Type = LUA_TNIL; }
+	~Dataset() { Clear(); }
+	// Maps a snapshot file and indexes it; returns false if it cannot be read or is not a valid snapshot
+	bool Load(const char* filename) 
+	{ 
+		Clear(); 
+		return Image.Load(filename) && Build(); 
+	}
+	bool Assign(const Snapshot& snapshot) 
+	{ 
+		Clear(); 
+		Image = snapshot; 
+		return Build(); 
+	}
+	void Clear();
+	bool empty() const { return Root.Type == LUA_TNIL; }
+	// Pushes the root value of the dataset
+	void Push(lua_State* L) const { PushValue(L, Root); }
+private:
+	Dataset(const Dataset&);
+	Dataset& operator=(const Dataset&);
+	struct Value
+	{
+		int Type;
+		bool Integer;
+		size_t Length;
+		union
+		{
+			bool Boolean;
+			long long IntegerValue;
+			double Number;
+			const char* String;
+			size_t Table;
+		};
+	};
+	struct Entry
+	{
+		Value Key;
+		Value Val;
+	};
+	// The array part is Values[Array] to Values[Array+Length-1], the other keys are Entries[Hash] to Entries[Hash+Count-1]
+	struct Table
+	{
+		size_t Array, Length;
+		size_t Hash, Count;
+	};
+	struct Box
+	{
+		const Dataset* Set;
+		size_t Table;
+	};
+	class Builder;
+	bool Build();
+	static void Normalize(Value& key);
+	static int Compare(const Value& v1, const Value& v2);
+	static int CompareEntries(const void* e1, const void* e2) { return Compare(((const Entry*)e1)->Key, ((const Entry*)e2)->Key); }
+	template<class T> static bool Grow(T*& data, size_t& capacity, size_t size);
+	const Value* Find(const Table& table, const Value& key, size_t* pos = NULL) const;
+	void PushValue(lua_State* L, const Value& value) const;
+	void PushTable(lua_State* L, size_t table) const;
+	static void PushMetatable(lua_State* L);
+	static const Box* Check(lua_State* L, int idx);
+	static bool ToKey(lua_State* L, int idx, const Dataset* set, Value& key);
+	static int Index(lua_State* L);
+	static int NewIndex(lua_State* L);
+	static int Len(lua_State* L);
+	static int Next(lua_State* L);
+	static int INext(lua_State* L);
+	static int Pairs(lua_State* L);
+	static int IPairs(lua_State* L);
+	Snapshot Image;
+	Value Root;
+	Value* Values;
+	Entry* Entries;
+	Table* Tables;
+	size_t ValueCount, EntryCount, TableCount;
+	static void* Key() { static char key; return &key; }
+};
+
+// Indexes a snapshot image without any Lua state, checking it like Snapshot::Read does
+class Dataset::Builder
+{
+public:
+	Builder(Dataset& set, const char* data, size_t size) 
+		: Set(set), Pos((const unsigned char*)data), End((const unsigned char*)data+size), 
+		  Strings(NULL), StringCount(0), StringCapacity(0), ValueCapacity(0), EntryCapacity(0), TableCapacity(0), Depth(0) {}
+	~Builder() { free(Strings); }
+	bool Parse(Value& value)
+	{
+		if(Pos == End)
+			return false;
+		value.Length = 0;
+		value.Integer = false;
+		unsigned long long number;
+		int tag = *Pos++;
+		switch(tag)
+		{
+		case Snapshot::NilTag: value.Type = LUA_TNIL; return true;
+		case Snapshot::FalseTag: 
+		case Snapshot::TrueTag: 
+			value.Type = LUA_TBOOLEAN; 
+			value.Boolean = tag == Snapshot::TrueTag; 
+			return true;
+		case Snapshot::IntegerTag:
+		case Snapshot::NegativeTag:
+			if(!Varint(number))
+				return false;
+			value.Type = LUA_TNUMBER;
+			value.Integer = true;
+			value.IntegerValue = tag == Snapshot::IntegerTag ? (long long)number : -(long long)number - 1;
+			return true;
+		case Snapshot::NumberTag: return ParseNumber(value);
+		case Snapshot::StringTag:
+			if(!Varint(number) || number > (unsigned long long)(End - Pos) || !Grow(Strings, StringCapacity, StringCount+1))
+				return false;
+			value.Type = LUA_TSTRING;
+			value.String = (const char*)Pos;
+			value.Length = (size_t)number;
+			Pos += number;
+			Strings[StringCount++] = value;
+			return true;
+		case Snapshot::StringRefTag:
+			if(!Varint(number) || number < 1 || number > StringCount)
+				return false;
+			value = Strings[number-1];
+			return true;
+		case Snapshot::TableTag: return ParseTable(value);
+		case Snapshot::TableRefTag:
+			if(!Varint(number) || number < 1 || number > Set.TableCount)
+				return false;
+			value.Type = LUA_TTABLE;
+			value.Table = (size_t)number-1;
+			return true;
+		default: return false;
+		}
+	}
+	bool Finished() const { return Pos == End; }
+private:
+	bool Varint(unsigned long long& value)
+	{
+		value = 0;
+		for(int shift=0;shift<64 && Pos!=End;shift+=7)
+		{
+			int byte = *Pos++;
+			value |= (unsigned long long)(byte & 0x7F) << shift;
+			if(!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+	bool ParseNumber(Value& value)
+	{
+		if(End - Pos < 8)
+			return false;
+		unsigned long long bits = 0;
+		for(int i=0;i<8;i++)
+			bits |= (unsigned long long)*Pos++ << (8*i);
+		value.Type = LUA_TNUMBER;
+		memcpy(&value.Number, &bits, sizeof(double));
+		return true;
+	}
+	// The slots of the table are reserved first, then filled while reading the nested values
+	bool ParseTable(Value& value)
+	{
+		unsigned long long len, hashed;
+		if(!Varint(len) || !Varint(hashed) || len > (unsigned long long)(End - Pos) || hashed > (unsigned long long)(End - Pos)/2)
+			return false;
+		if(++Depth > Snapshot::MaxDepth)
+			return false;
+		size_t id = Set.TableCount;
+		if(!Grow(Set.Tables, TableCapacity, id+1) || !Grow(Set.Values, ValueCapacity, Set.ValueCount+(size_t)len) 
+			|| !Grow(Set.Entries, EntryCapacity, Set.EntryCount+(size_t)hashed))
+			return false;
+		Dataset::Table table = { Set.ValueCount, (size_t)len, Set.EntryCount, (size_t)hashed };
+		Set.Tables[Set.TableCount++] = table;
+		Set.ValueCount += table.Length;
+		Set.EntryCount += table.Count;
+		Value item, key;
+		for(size_t i=0;i<table.Length;i++)
+		{
+			if(!Parse(item))
+				return false;
+			Set.Values[table.Array+i] = item;
+		}
+		for(size_t i=0;i<table.Count;i++)
+		{
+			if(!Parse(key) || key.Type == LUA_TNIL || !Parse(item))
+				return false;
+			Normalize(key);
+			Set.Entries[table.Hash+i].Key = key;
+			Set.Entries[table.Hash+i].Val = item;
+		}
+		if(table.Count > 1)
+			qsort(Set.Entries+table.Hash, table.Count, sizeof(Entry), CompareEntries);
+		Depth--;
+		value.Type = LUA_TTABLE;
+		value.Table = id;
+		return true;
+	}
+	Dataset& Set;
+	const unsigned char* Pos;
+	const unsigned char* End;
+	Value* Strings;
+	size_t StringCount, StringCapacity;
+	size_t ValueCapacity, EntryCapacity, TableCapacity;
+	int Depth;
+};
+
+template<class T> inline bool Dataset::Grow(T*& data, size_t& capacity, size_t size)
+{
+	if(size <= capacity)
+		return true;
+	size_t count = capacity ? capacity : 16;
+	while(count < size)
+		count *= 2;
+	T* grown = (T*)realloc(data, count*sizeof(T));
+	if(!grown)
+		return false;
+	data = grown;
+	capacity = count;
+	return true;
+}
+
+inline void Dataset::Clear()
+{
+	free(Values);
+	free(Entries);
+	free(Tables);
+	Values = NULL;
+	Entries = NULL;
+	Tables = NULL;
+	ValueCount = EntryCount = TableCount = 0;
+	Root.Type = LUA_TNIL;
+}
+
+inline bool Dataset::Build()
+{
+	Clear();
+	const char* data = Image.data();
+	if(Image.size() < 5 || memcmp(data, "LCBS", 4) || data[4] != Snapshot::Version)
+		return false;
+	Builder builder(*this, data+5, Image.size()-5);
+	Value root;
+	if(!builder.Parse(root) || !builder.Finished())
+	{
+		Clear();
+		return false;
+	}
+	Root = root;
+	return true;
+}
+
+// Float keys having an integer value are stored as integers, like Lua does
+inline void Dataset::Normalize(Value& key)
+{
+	if(key.Type == LUA_TNUMBER && !key.Integer && key.Number >= -9007199254740992.0 && key.Number <= 9007199254740992.0
+		&& key.Number == (double)(long long)key.Number)
+	{
+		key.IntegerValue = (long long)key.Number;
+		key.Integer = true;
+	}
+}
+
+inline int Dataset::Compare(const Value& v1, const Value& v2)
+{
+	if(v1.Type != v2.Type)
+		return v1.Type < v2.Type ? -1 : 1;
+	switch(v1.Type)
+	{
+	case LUA_TBOOLEAN: return (int)v1.Boolean - (int)v2.Boolean;
+	case LUA_TNUMBER:
+		if(v1.Integer && v2.Integer)
+			return v1.IntegerValue < v2.IntegerValue ? -1 : v1.IntegerValue > v2.IntegerValue;
+		else
+		{
+			double d1 = v1.Integer ? (double)v1.IntegerValue : v1.Number;
+			double d2 = v2.Integer ? (double)v2.IntegerValue : v2.Number;
+			return d1 < d2 ? -1 : d1 > d2;
+		}
+	case LUA_TSTRING:
+	{
+		int res = memcmp(v1.String, v2.String, v1.Length < v2.Length ? v1.Length : v2.Length);
+		if(res)
+			return res;
+		return v1.Length < v2.Length ? -1 : v1.Length > v2.Length;
+	}
+	case LUA_TTABLE: return v1.Table < v2.Table ? -1 : v1.Table > v2.Table;
+	}
+	return 0;
+}
+
+inline const Dataset::Value* Dataset::Find(const Table& table, const Value& key, size_t* pos) const
+{
+	if(key.Type == LUA_TNUMBER && key.Integer && key.IntegerValue >= 1 && (unsigned long long)key.IntegerValue <= table.Length)
+	{
+		if(pos)
+			*pos = (size_t)key.IntegerValue-1;
+		return &Values[table.Array+(size_t)key.IntegerValue-1];
+	}
+	size_t low = 0, high = table.Count;
+	while(low < high)
+	{
+		size_t mid = (low + high) / 2;
+		const Entry& entry = Entries[table.Hash+mid];
+		int res = Compare(entry.Key, key);
+		if(res == 0)
+		{
+			if(pos)
+				*pos = table.Length+mid;
+			return &entry.Val;
+		}
+		if(res < 0)
+			low = mid+1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+inline void Dataset::PushValue(lua_State* L, const Value& value) const
+{
+	switch(value.Type)
+	{
+	case LUA_TBOOLEAN: lua_pushboolean(L, value.Boolean); break;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if(value.Integer)
+			lua_pushinteger(L, (lua_Integer)value.IntegerValue);
+		else
+#endif
+			lua_pushnumber(L, value.Integer ? (lua_Number)value.IntegerValue : (lua_Number)value.Number);
+		break;
+	case LUA_TSTRING: lua_pushlstring(L, value.String, value.Length); break;
+	case LUA_TTABLE: PushTable(L, value.Table); break;
+	default: lua_pushnil(L);
+	}
+}
+
+// The userdata are kept in a weak table of the registry, indexed by the address of their table
+inline void Dataset::PushTable(lua_State* L, size_t table) const
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedDatasets");
+	if(lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushstring(L, "v");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedDatasets");
+	}
+	lua_pushlightuserdata(L, &Tables[table]);
+	lua_rawget(L, -2);
+	if(lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		Box* box = (Box*)lua_newuserdata(L, sizeof(Box));
+		box->Set = this;
+		box->Table = table;
+		PushMetatable(L);
+		lua_setmetatable(L, -2);
+		lua_pushlightuserdata(L, &Tables[table]);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+// As for the container proxies, the metamethods have the metatable as upvalue
+inline void Dataset::PushMetatable(lua_State* L)
+{
+	lua_pushlightuserdata(L, Key());
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if(lua_istable(L, -1))
+		return;
+	lua_pop(L, 1);
+	static const luaL_Reg methods[] = {
+		{ "__index", Index }, { "__newindex", NewIndex }, { "__len", Len }, 
+		{ "__pairs", Pairs }, { "__ipairs", IPairs }, { "__call", Pairs }, { NULL, NULL } };
+	lua_createtable(L, 0, sizeof(methods)/sizeof(methods[0])-1);
+	for(const luaL_Reg* m=methods;m->name;m++)
+	{
+		lua_pushvalue(L, -1);
+		lua_pushcclosure(L, m->func, 1);
+		lua_setfield(L, -2, m->name);
+	}
+	lua_pushlightuserdata(L, Key());
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+inline const Dataset::Box* Dataset::Check(lua_State* L, int idx)
+{
+	const Box* box = (const Box*)lua_touserdata(L, idx);
+	if(!box || !lua_getmetatable(L, idx))
+		return NULL;
+	bool res = lua_rawequal(L, -1, lua_upvalueindex(1)) != 0;
+	lua_pop(L, 1);
+	return res ? box : NULL;
+}
+
+// Converts a Lua value to a key of set; returns false if no key can match it
+inline bool Dataset::ToKey(lua_State* L, int idx, const Dataset* set, Value& key)
+{
+	key.Integer = false;
+	key.Type = lua_type(L, idx);
+	switch(key.Type)
+	{
+	case LUA_TBOOLEAN: key.Boolean = lua_toboolean(L, idx) != 0; return true;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if(lua_isinteger(L, idx))
+		{
+			key.Integer = true;
+			key.IntegerValue = (long long)lua_tointeger(L, idx);
+			return true;
+		}
+#endif
+		key.Number = (double)lua_tonumber(L, idx);
+		Normalize(key);
+		return true;
+	case LUA_TSTRING: key.String = lua_tolstring(L, idx, &key.Length); return true;
+	case LUA_TUSERDATA:
+	{
+		const Box* box = Check(L, idx);
+		if(!box || box->Set != set)
+			return false;
+		key.Type = LUA_TTABLE;
+		key.Table = box->Table;
+		return true;
+	}
+	}
+	return false;
+}
+
+inline int Dataset::Index(lua_State* L)
+{
+	const Box* box = Check(L, 1);
+	luaL_argcheck(L, box != NULL, 1, "dataset table expected");
+	Value key;
+	const Value* value = ToKey(L, 2, box->Set, key) ? box->Set->Find(box->Set->Tables[box->Table], key) : NULL;
+	if(value)
+		box->Set->PushValue(L, *value);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+inline int Dataset::NewIndex(lua_State* L)
+{
+	return luaL_error(L, "attempt to modify a read-only dataset");
+}
+
+inline int Dataset::Len(lua_State* L)
+{
+	const Box* box = Check(L, 1);
+	luaL_argcheck(L, box != NULL, 1, "dataset table expected");
+	lua_pushinteger(L, (lua_Integer)box->Set->Tables[box->Table].Length);
+	return 1;
+}
+
+// Positions are the indexes in the array part, followed by the ones in the sorted keys
+inline int Dataset::Next(lua_State* L)
+{
+	const Box* box = Check(L, 1);
+	luaL_argcheck(L, box != NULL, 1, "dataset table expected");
+	const Dataset* set = box->Set;
+	const Table& table = set->Tables[box->Table];
+	size_t pos = 0;
+	if(!lua_isnoneornil(L, 2))
+	{
+		Value key;
+		if(!ToKey(L, 2, set, key) || !set->Find(table, key, &pos))
+			return luaL_error(L, "invalid key to 'next'");
+		pos++;
+	}
+	for(;pos<table.Length;pos++)
+	{
+		if(set->Values[table.Array+pos].Type != LUA_TNIL)
+		{
+			lua_pushinteger(L, (lua_Integer)pos+1);
+			set->PushValue(L, set->Values[table.Array+pos]);
+			return 2;
+		}
+	}
+	if(pos >= table.Length + table.Count)
+		return 0;
+	const Entry& entry = set->Entries[table.Hash+pos-table.Length];
+	set->PushValue(L, entry.Key);
+	set->PushValue(L, entry.Val);
+	return 2;
+}
+
+inline int Dataset::INext(lua_State* L)
+{
+	const Box* box = Check(L, 1);
+	luaL_argcheck(L, box != NULL, 1, "dataset table expected");
+	const Table& table = box->Set->Tables[box->Table];
+	lua_Integer i = luaL_checkinteger(L, 2);
+	if(i < 0 || (size_t)i >= table.Length || box->Set->Values[table.Array+(size_t)i].Type == LUA_TNIL)
+		return 0;
+	lua_pushinteger(L, i+1);
+	box->Set->PushValue(L, box->Set->Values[table.Array+(size_t)i]);
+	return 2;
+}
+
+inline int Dataset::Pairs(lua_State* L)
+{
+	luaL_argcheck(L, Check(L, 1) != NULL, 1, "dataset table expected");
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushcclosure(L, Next, 1);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+inline int Dataset::IPairs(lua_State* L)
+{
+	luaL_argcheck(L, Check(L, 1) != NULL, 1, "dataset table expected");
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushcclosure(L, INext, 1);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
+inline void Input::PushDataset(lua_State* L) const
+{
+	((const Dataset*)PointerValue)->Push(L);
+}
+
+/* Limits of the calls made on a Lua state, stored in a registry userdata. When an instruction
+   budget or a deadline is set, a count hook is installed for the duration of each call; otherwise
+   no hook is set at all. Cancel can be called from another thread: it sets an atomic flag and
+   installs a hook firing at the next instruction (lua_sethook is safe to call asynchronously).
+   A Cancel made between two calls applies to the next one; the flag is cleared when a call ends.
+   Once a limit is violated, the hook raises the error again at each instruction, so that
+   the script cannot catch it with pcall and continue. Calls nested in a running call share its
+   limits, and the hook finds them through a thread-local variable instead of the registry.
+   Hooks are per thread in Lua: the coroutines created during a limited call inherit its hook,
+   but Cancel only hooks the main thread, so a coroutine created before the hook was installed
+   is only stopped once it yields or returns. */
+class CallLimits
+{
+public:
+	CallLimits() : Canceled(false), Budget(0), Timeout(0), Remaining(0), Expiry(0), Slice(0), Violation(NoViolation), Depth(0) {}
+	static CallLimits* Get(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedLimits");
+		CallLimits* limits = (CallLimits*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(!limits)
+		{
+			limits = new(lua_newuserdata(L, sizeof(CallLimits))) CallLimits();
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedLimits");
+		}
+		return limits;
+	}
+	// Limits of the call running on L, found without a registry lookup when L runs the current call
+	static CallLimits* Find(lua_State* L)
+	{
+#ifdef LCBC_THREAD_LOCAL
+		const Active& active = Current();
+		if(active.L == L)
+			return active.Limits;
+#endif
+		return Get(L);
+	}
+	// Starts a call; returns true if a hook has been installed. A nested call keeps the running one's.
+	bool Begin(lua_State* L)
+	{
+		if(Depth++)
+			return false;
+#ifdef LCBC_THREAD_LOCAL
+		Saved = Current();
+		Current().L = L;
+		Current().Limits = this;
+#endif
+		Violation = NoViolation;
+		Remaining = Budget;
+		Expiry = Timeout > 0 ? Now() + Timeout : 0;
+		if(Canceled)
+		{
+			lua_sethook(L, Hook, LUA_MASKCOUNT, 1);
+			return true;
+		}
+		if(!Limited())
+			return false;
+		lua_sethook(L, Hook, LUA_MASKCOUNT, NextSlice());
+		return true;
+	}
+	void End(lua_State* L, bool hooked)
+	{
+		if(--Depth)
+			return;
+#ifdef LCBC_THREAD_LOCAL
+		Current() = Saved;
+#endif
+		Expiry = 0;
+		bool canceled = Canceled;
+		Canceled = false;
+		if(hooked || canceled)
+			lua_sethook(L, NULL, 0, 0);
+	}
+	void Cancel(lua_State* L)
+	{
+		Canceled = true;
+		lua_sethook(L, Hook, LUA_MASKCOUNT, 1);
+	}
+	// True if a call is running and is canceled or past its deadline, for the operations blocking in C
+	bool Interrupted() const { return Depth && (Canceled || (Expiry > 0 && Now() >= Expiry)); }
+	// Applies the limits to the calls made on L during its lifetime, even if one throws
+	class Scope
+	{
+	public:
+		Scope(lua_State* L, CallLimits* limits) : L(L), Limits(limits) { Hooked = Limits->Begin(L); }
+		~Scope() { Limits->End(L, Hooked); }
+	private:
+		Scope(const Scope&);
+		Scope& operator=(const Scope&);
+		lua_State* L;
+		CallLimits* Limits;
+		bool Hooked;
+	};
+	// Raises the error of an interrupted call, and keeps raising it at each instruction like the hook
+	void Raise(lua_State* L)
+	{
+		if(Violation == NoViolation)
+			Violation = Canceled ? Cancellation : Deadline;
+		lua_sethook(L, Hook, LUA_MASKCOUNT, 1);
+		Error(L, Violation);
+	}
+	static double Now()
+	{
+#if LCBC_USE_CPP11
+		return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+#else
+		return (double)clock() / CLOCKS_PER_SEC;
+#endif
+	}
+#if LCBC_USE_CPP11
+	atomic<bool> Canceled;
+#else
+	volatile bool Canceled;
+#endif
+	unsigned long Budget;
+	double Timeout;
+	unsigned long Remaining;
+	double Expiry;
+	int Slice;
+	LimitReason Violation;
+private:
+	struct Active
+	{
+		lua_State* L;
+		CallLimits* Limits;
+	};
+#ifdef LCBC_THREAD_LOCAL
+	static Active& Current()
+	{
+		static LCBC_THREAD_LOCAL Active active = { NULL, NULL };
+		return active;
+	}
+	Active Saved;
+#endif
+	unsigned Depth;
+	bool Limited() const { return Budget || Timeout > 0; }
+	// Instructions until the next check: the deadline is checked every 1000 instructions
+	int NextSlice()
+	{
+		unsigned long slice = Timeout > 0 ? 1000 : (unsigned long)INT_MAX;
+		if(Budget && Remaining < slice)
+			slice = Remaining;
+		Slice = (int)slice;
+		return Slice;
+	}
+	static void Hook(lua_State* L, lua_Debug* /*ar*/)
+	{
+		CallLimits* limits = Find(L);
+		if(!limits->Depth)
+		{
+			lua_sethook(L, NULL, 0, 0); // left over by a call, or a Cancel left for the next call
+			return;
+		}
+		if(limits->Violation == NoViolation)
+		{
+			if(limits->Canceled)
+				limits->Violation = Cancellation;
+			else if(limits->Budget && (limits->Remaining -= limits->Slice) == 0)
+				limits->Violation = InstructionBudget;
+			else if(limits->Timeout > 0 && Now() >= limits->Expiry)
+				limits->Violation = Deadline;
+			if(limits->Violation == NoViolation)
+			{
+				if(limits->Limited())
+					lua_sethook(L, Hook, LUA_MASKCOUNT, limits->NextSlice());
+				else
+					lua_sethook(L, NULL, 0, 0); // left over by a Cancel racing the end of a call
+				return;
+			}
+			lua_sethook(L, Hook, LUA_MASKCOUNT, 1);
+		}
+		Error(L, limits->Violation);
+	}
+	static void Error(lua_State* L, LimitReason violation)
+	{
+		static const char* const messages[] = { "", "instruction budget exceeded", "deadline exceeded", "call canceled" };
+		luaL_error(L, "%s", messages[violation]);
+	}
+};
+
+#if LCBC_USE_CPP11
+/* Channel is a bounded queue of snapshots shared by any number of Lua states and threads. It is the
+   lock-free ring buffer of D. Vyukov: each cell has a sequence number telling whether it is ready to be
+   written or read at a given position, and producers and consumers claim positions with a CAS, so it
+   works for single and multiple producers and consumers alike. Values are copied as snapshots, so they
+   are made of nil, booleans, numbers, strings and tables. The blocking operations spin, then yield,
+   then sleep until their timeout (negative for none). Closing a channel makes the sends fail and the
+   receives fail once it is empty. A Channel object is a counted reference to the queue, that can be
+   passed to Lua as an Input, and read back with an Output. From Lua, require "channel" (preloaded by LuaT)
+   gives new(capacity); the channel methods are send(v, timeout), trysend(v), sendmany(list),
+   receive(timeout), tryreceive(), receivemany(max, timeout), close() and #. A receive returns the value,
+   or nil and "timeout" or "closed". The blocking methods also give up when the call running them is
+   canceled or reaches its deadline (see CallLimits), and raise its error. */
+class Channel
+{
+public:
+	explicit Channel(size_t capacity = 1024) : Q(new Queue(capacity)) {}
+	Channel(const Channel& src) : Q(src.Q) { Q->Retain(); }
+	~Channel() { Q->Release(); }
+	Channel& operator=(const Channel& src)
+	{
+		src.Q->Retain();
+		Q->Release();
+		Q = src.Q;
+		return *this;
+	}
+	bool TrySend(const Snapshot& message)
+	{
+		Snapshot copy(message);
+		return Q->TryPush(copy);
+	}
+	bool Send(const Snapshot& message, double timeout = -1)
+	{
+		Snapshot copy(message);
+		return Q->Push(copy, timeout);
+	}
+	bool TryReceive(Snapshot& message) { return Q->TryPop(message); }
+	bool Receive(Snapshot& message, double timeout = -1) { return Q->Pop(message, timeout); }
+	void Close() { Q->Closed = true; }
+	bool closed() const { return Q->Closed; }
+	// Number of messages, only exact when nobody is using the channel
+	size_t size() const { return Q->size(); }
+	size_t capacity() const { return Q->Mask + 1; }
+	void Push(lua_State* L) const;
+	void Attach(lua_State* L, int idx);
+	static int Open(lua_State* L);
+	// Makes require "channel" return the module
+	static void Preload(lua_State* L)
+	{
+		lua_getglobal(L, "package");
+		if(lua_istable(L, -1))
+		{
+			lua_getfield(L, -1, "preload");
+			lua_pushcfunction(L, Open);
+			lua_setfield(L, -2, "channel");
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+private:
+	class Queue
+	{
+	public:
+		Queue(size_t capacity) : Cells(NULL), Mask(1), Refs(1), Closed(false), Tail(0), Head(0)
+		{
+			while(Mask+1 < capacity)
+				Mask = 2*Mask + 1;
+			Cells = new Cell[Mask+1];
+			for(size_t i=0;i<=Mask;i++)
+				Cells[i].Sequence.store(i, memory_order_relaxed);
+		}
+		~Queue() { delete[] Cells; }
+		void Retain() { Refs.fetch_add(1, memory_order_relaxed); }
+		void Release()
+		{
+			if(Refs.fetch_sub(1, memory_order_acq_rel) == 1)
+				delete this;
+		}
+		// Moves message into the queue, leaving it empty; false if full or closed
+		bool TryPush(Snapshot& message)
+		{
+			if(Closed)
+				return false;
+			size_t pos = Tail.load(memory_order_relaxed);
+			Cell* cell;
+			for(;;)
+			{
+				cell = &Cells[pos & Mask];
+				size_t seq = cell->Sequence.load(memory_order_acquire);
+				ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+				if(diff == 0 && Tail.compare_exchange_weak(pos, pos+1, memory_order_relaxed))
+					break;
+				if(diff < 0)
+					return false;
+				if(diff > 0)
+					pos = Tail.load(memory_order_relaxed);
+			}
+			cell->Value.swap(message);
+			cell->Sequence.store(pos+1, memory_order_release);
+			return true;
+		}
+		bool TryPop(Snapshot& message)
+		{
+			size_t pos = Head.load(memory_order_relaxed);
+			Cell* cell;
+			for(;;)
+			{
+				cell = &Cells[pos & Mask];
+				size_t seq = cell->Sequence.load(memory_order_acquire);
+				ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos+1);
+				if(diff == 0 && Head.compare_exchange_weak(pos, pos+1, memory_order_relaxed))
+					break;
+				if(diff < 0)
+					return false;
+				if(diff > 0)
+					pos = Head.load(memory_order_relaxed);
+			}
+			message.Clear();
+			message.swap(cell->Value);
+			cell->Sequence.store(pos+Mask+1, memory_order_release);
+			return true;
+		}
+		bool Push(Snapshot& message, double timeout, const CallLimits* limits = NULL) { return Wait(&Queue::TryPush, message, timeout, limits); }
+		// Fails on timeout, once the channel is closed and empty, or when the call of limits is interrupted
+		bool Pop(Snapshot& message, double timeout, const CallLimits* limits = NULL) { return Wait(&Queue::TryPop, message, timeout, limits); }
+		size_t size() const
+		{
+			size_t tail = Tail.load(memory_order_relaxed), head = Head.load(memory_order_relaxed);
+			return tail > head ? tail - head : 0;
+		}
+		struct Cell
+		{
+			atomic<size_t> Sequence;
+			Snapshot Value;
+		};
+		Cell* Cells;
+		size_t Mask;
+		atomic<long> Refs;
+		atomic<bool> Closed;
+		// Producers and consumers on separate cache lines
+		char Pad1[64];
+		atomic<size_t> Tail;
+		char Pad2[64];
+		atomic<size_t> Head;
+	private:
+		bool Wait(bool (Queue::*op)(Snapshot&), Snapshot& message, double timeout, const CallLimits* limits)
+		{
+			chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout > 0 ? timeout : 0));
+			for(unsigned n=0;;n++)
+			{
+				bool closed = Closed;
+				if((this->*op)(message))
+					return true;
+				if(closed || timeout == 0 || (timeout > 0 && n >= 64 && chrono::steady_clock::now() >= deadline))
+					return false;
+				if(limits && n >= 64 && limits->Interrupted())
+					return false;
+				if(n >= 1024)
+					this_thread::sleep_for(chrono::microseconds(50));
+				else if(n >= 64)
+					this_thread::yield();
+			}
+		}
+	};
+	static Queue* Check(lua_State* L, int idx) { return *(Queue**)luaL_checkudata(L, idx, "LuaClassBasedChannel"); }
+	static void PushQueue(lua_State* L, Queue* q);
+	static int DoWrite(lua_State* L);
+	static bool Write(lua_State* L, int idx, Snapshot& message);
+	static int Result(lua_State* L, bool ok, Queue* q, CallLimits* limits = NULL);
+	static int New(lua_State* L);
+	static int Collect(lua_State* L);
+	static int Send(lua_State* L);
+	static int TrySend(lua_State* L);
+	static int SendMany(lua_State* L);
+	static int Receive(lua_State* L);
+	static int TryReceive(lua_State* L);
+	static int ReceiveMany(lua_State* L);
+	static int CloseChannel(lua_State* L);
+	static int Len(lua_State* L);
+	Queue* Q;
+};
+
+inline void Channel::PushQueue(lua_State* L, Queue* q)
+{
+	Queue** box = (Queue**)lua_newuserdata(L, sizeof(Queue*));
+	*box = q;
+	q->Retain();
+	if(luaL_newmetatable(L, "LuaClassBasedChannel"))
+	{
+		static const luaL_Reg methods[] = {
+			{ "send", Send }, { "trysend", TrySend }, { "sendmany", SendMany }, { "receive", Receive }, 
+			{ "tryreceive", TryReceive }, { "receivemany", ReceiveMany }, { "close", CloseChannel }, { NULL, NULL } };
+		lua_createtable(L, 0, sizeof(methods)/sizeof(methods[0])-1);
+		for(const luaL_Reg* m=methods;m->name;m++)
+		{
+			lua_pushcfunction(L, m->func);
+			lua_setfield(L, -2, m->name);
+		}
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, Len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, Collect);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+}
+
+inline void Channel::Push(lua_State* L) const { PushQueue(L, Q); }
+
+inline void Channel::Attach(lua_State* L, int idx)
+{
+	Queue* q = Check(L, idx);
+	q->Retain();
+	Q->Release();
+	Q = q;
+}
+
+inline int Channel::Open(lua_State* L)
+{
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, New);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+inline int Channel::New(lua_State* L)
+{
+	lua_Integer capacity = luaL_optinteger(L, 1, 1024);
+	luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+	Queue* q = new Queue((size_t)capacity);
+	PushQueue(L, q);
+	q->Release();
+	return 1;
+}
+
+inline int Channel::Collect(lua_State* L)
+{
+	Queue** box = (Queue**)lua_touserdata(L, 1);
+	if(*box)
+		(*box)->Release();
+	*box = NULL;
+	return 0;
+}
+
+inline int Channel::DoWrite(lua_State* L)
+{
+	Snapshot::Write(L, 2, *(Snapshot*)lua_touserdata(L, 1));
+	return 0;
+}
+
+// Writes the value at idx in a protected call, so that the snapshot is freed before the error is raised
+inline bool Channel::Write(lua_State* L, int idx, Snapshot& message)
+{
+	if(idx < 0)
+		idx = lua_gettop(L) + idx + 1;
+	lua_pushcfunction(L, DoWrite);
+	lua_pushlightuserdata(L, &message);
+	lua_pushvalue(L, idx);
+	return lua_pcall(L, 2, 0, 0) == 0;
+}
+
+inline int Channel::Result(lua_State* L, bool ok, Queue* q, CallLimits* limits)
+{
+	if(ok)
+	{
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	if(limits && limits->Interrupted())
+		limits->Raise(L);
+	lua_pushnil(L);
+	lua_pushstring(L, q->Closed ? "closed" : "timeout");
+	return 2;
+}
+
+inline int Channel::Send(lua_State* L)
+{
+	Queue* q = Check(L, 1);
+	double timeout = luaL_optnumber(L, 3, -1);
+	CallLimits* limits = timeout != 0 ? CallLimits::Find(L) : NULL;
+	bool written, sent = false;
+	{
+		Snapshot message;
+		written = Write(L, 2, message);
+		if(written)
+			sent = q->Push(message, timeout, limits);
+	}
+	if(!written)
+		lua_error(L);
+	return Result(L, sent, q, limits);
+}
+
+inline int Channel::TrySend(lua_State* L)
+{
+	lua_settop(L, 2);
+	lua_pushnumber(L, 0);
+	return Send(L);
+}
+
+// Sends the values of a sequence without blocking, until the channel is full; returns the number sent
+inline int Channel::SendMany(lua_State* L)
+{
+	Queue* q = Check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t len = lua_objlen(L, 2), count = 0;
+	bool written = true;
+	for(size_t i=1;i<=len;i++)
+	{
+		lua_rawgeti(L, 2, (int)i);
+		bool sent = false;
+		{
+			Snapshot message;
+			written = Write(L, -1, message);
+			if(written)
+				sent = q->TryPush(message);
+		}
+		if(!written || !sent)
+			break;
+		lua_pop(L, 1);
+		count++;
+	}
+	if(!written)
+		lua_error(L);
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+inline int Channel::Receive(lua_State* L)
+{
+	Queue* q = Check(L, 1);
+	double timeout = luaL_optnumber(L, 2, -1);
+	CallLimits* limits = timeout != 0 ? CallLimits::Find(L) : NULL;
+	Snapshot message;
+	if(!q->Pop(message, timeout, limits))
+		return Result(L, false, q, limits);
+	// Read raises errors on corrupted images only, which cannot come from a channel
+	Snapshot::Read(L, message.data(), message.size());
+	return 1;
+}
+
+inline int Channel::TryReceive(lua_State* L)
+{
+	lua_settop(L, 1);
+	lua_pushnumber(L, 0);
+	return Receive(L);
+}
+
+// Waits for a first value like receive, then takes up to max values without blocking; returns them in a sequence
+inline int Channel::ReceiveMany(lua_State* L)
+{
+	Queue* q = Check(L, 1);
+	lua_Integer max = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, max >= 1, 2, "max must be positive");
+	double timeout = luaL_optnumber(L, 3, -1);
+	CallLimits* limits = timeout != 0 ? CallLimits::Find(L) : NULL;
+	Snapshot message;
+	if(!q->Pop(message, timeout, limits))
+		return Result(L, false, q, limits);
+	lua_createtable(L, (int)(max < 1024 ? max : 1024), 0);
+	lua_Integer count = 0;
+	do
+	{
+		Snapshot::Read(L, message.data(), message.size());
+		lua_rawseti(L, -2, (int)++count);
+	} while(count < max && q->TryPop(message));
+	return 1;
+}
+
+inline int Channel::CloseChannel(lua_State* L)
+{
+	Check(L, 1)->Closed = true;
+	return 0;
+}
+
+inline int Channel::Len(lua_State* L)
+{
+	lua_pushinteger(L, (lua_Integer)Check(L, 1)->size());
+	return 1;
+}
+
+inline void Input::PushChannel(lua_State* L) const { ((const Channel*)PointerValue)->Push(L); }
+inline void Output::GetChannel(lua_State* L, int idx) const { ((Channel*)PointerValue)->Attach(L, idx); }
+#endif
+
+/* Bundle is an image of precompiled scripts embedded in the executable. Bundle::Main is the build
+   step: it compiles the given script files with the linked Lua version and writes a C++ source
+   defining the image as a constant byte array, with a static Bundle object registering it.
+   Once registered, the scripts are found in constant time: File(name) loads them without any
+   file access, and require finds module "a.b" as "a/b.lua" or "a/b/init.lua" (the searcher is
+   installed by LuaT when it opens the libraries, or by Install). Bundles are registered during
+   the static initialization, before any Lua state is created, and must not be destroyed while
+   in use. */
+class Bundle
+{
+public:
+	enum { Version = 1 };
+	Bundle(const void* image, size_t size) : Image((const unsigned char*)image), Size(size), Slots(NULL), Mask(0), Next(NULL) 
+	{
+		if(Index())
+		{
+			Next = First();
+			First() = this;
+		}
+	}
+	~Bundle()
+	{
+		for(Bundle** p=&First();*p;p=&(*p)->Next)
+			if(*p == this)
+			{
+				*p = Next;
+				break;
+			}
+		free(Slots);
+	}
+	bool valid() const { return Slots != NULL; }
+	// Finds a script in this bundle: returns its bytecode or NULL
+	const char* Find(const char* name, size_t& size) const;
+	// Finds a script in all the registered bundles
+	static const char* Lookup(const char* name, size_t& size)
+	{
+		if(name[0] == '.' && name[1] == '/')
+			name += 2;
+		for(const Bundle* bundle=First();bundle;bundle=bundle->Next)
+		{
+			const char* code = bundle->Find(name, size);
+			if(code)
+				return code;
+		}
+		return NULL;
+	}
+	static bool Registered() { return First() != NULL; }
+	// Loads a bundled script like luaL_loadfile; returns -1 if the name is not bundled
+	static int Load(lua_State* L, const char* name)
+	{
+		size_t size;
+		const char* code = Lookup(name, size);
+		if(!code)
+			return -1;
+		lua_pushfstring(L, "@%s", name);
+		int res = luaL_loadbuffer(L, code, size, lua_tostring(L, -1));
+		lua_remove(L, -2);
+		return res;
+	}
+	// Adds the bundle searcher to package.loaders (5.1) or package.searchers, just after the preload one
+	static void Install(lua_State* L);
+	/* Build step: bundle <output.cpp> <symbol> <root> <script files...>
+	   The bundled names are the file names without the root prefix, with '/' separators. */
+	static int Main(int argc, char* argv[]);
+private:
+	Bundle(const Bundle&);
+	Bundle& operator=(const Bundle&);
+	struct Slot
+	{
+		const char* Name;
+		size_t Length;
+		const char* Code;
+		size_t Size;
+	};
+	static Bundle*& First() { static Bundle* first = NULL; return first; }
+	static unsigned long Hash(const char* name, size_t len)
+	{
+		unsigned long hash = 2166136261UL;
+		for(size_t i=0;i<len;i++)
+			hash = ((hash ^ (unsigned char)name[i]) * 16777619UL) & 0xFFFFFFFFUL;
+		return hash;
+	}
+	static bool Varint(const unsigned char*& pos, const unsigned char* end, size_t& value)
+	{
+		value = 0;
+		for(int shift=0;shift<(int)sizeof(size_t)*8 && pos!=end;shift+=7)
+		{
+			int byte = *pos++;
+			value |= (size_t)(byte & 0x7F) << shift;
+			if(!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+	bool Index();
+	static int Searcher(lua_State* L);
+	const unsigned char* Image;
+	size_t Size;
+	Slot* Slots;
+	size_t Mask;
+	Bundle* Next;
+};
+
+// Image: "LCBB", version byte, count, then for each script its name and its bytecode, preceded by their sizes
+inline bool Bundle::Index()
+{
+	const unsigned char* pos = Image+5;
+	const unsigned char* end = Image+Size;
+	size_t count;
+	if(Size < 5 || memcmp(Image, "LCBB", 4) || Image[4] != Version || !Varint(pos, end, count) || count > Size)
+		return false;
+	size_t slots = 2;
+	while(slots < 2*count)
+		slots *= 2;
+	Slots = (Slot*)calloc(slots, sizeof(Slot));
+	if(!Slots)
+		return false;
+	Mask = slots-1;
+	for(size_t i=0;i<count;i++)
+	{
+		Slot slot;
+		if(!Varint(pos, end, slot.Length) || slot.Length > (size_t)(end-pos))
+			break;
+		slot.Name = (const char*)pos;
+		pos += slot.Length;
+		if(!Varint(pos, end, slot.Size) || slot.Size > (size_t)(end-pos))
+			break;
+		slot.Code = (const char*)pos;
+		pos += slot.Size;
+		size_t s = Hash(slot.Name, slot.Length) & Mask;
+		while(Slots[s].Name)
+			s = (s+1) & Mask;
+		Slots[s] = slot;
+		if(i+1 == count)
+			return true;
+	}
+	free(Slots);
+	Slots = NULL;
+	return false;
+}
+
+inline const char* Bundle::Find(const char* name, size_t& size) const
+{
+	if(!Slots)
+		return NULL;
+	size_t len = strlen(name);
+	for(size_t s=Hash(name, len)&Mask;Slots[s].Name;s=(s+1)&Mask)
+	{
+		const Slot& slot = Slots[s];
+		if(slot.Length == len && !memcmp(slot.Name, name, len))
+		{
+			size = slot.Size;
+			return slot.Code;
+		}
+	}
+	return NULL;
+}
+
+inline int Bundle::Searcher(lua_State* L)
+{
+	const char* module = luaL_checkstring(L, 1);
+	luaL_gsub(L, module, ".", "/");
+	const char* path = lua_tostring(L, -1);
+	lua_pushfstring(L, "%s.lua", path);
+	int res = Load(L, lua_tostring(L, -1));
+	if(res < 0)
+	{
+		lua_pushfstring(L, "%s/init.lua", path);
+		res = Load(L, lua_tostring(L, -1));
+	}
+	if(res < 0)
+	{
+		lua_pushfstring(L, "\n\tno bundled file '%s.lua'", path);
+		return 1;
+	}
+	if(res)
+		return luaL_error(L, "error loading module '%s' from bundle:\n\t%s", module, lua_tostring(L, -1));
+	lua_insert(L, -2);
+	return 2;
+}
+
+inline void Bundle::Install(lua_State* L)
+{
+	lua_getglobal(L, "package");
+	if(!lua_istable(L, -1))
+		return lua_pop(L, 1);
+#if LUA_VERSION_NUM >= 502
+	lua_getfield(L, -1, "searchers");
+#else
+	lua_getfield(L, -1, "loaders");
+#endif
+	if(lua_istable(L, -1))
+	{
+		int last = (int)lua_objlen(L, -1);
+		for(int i=last;i>=2;i--)
+		{
+			lua_rawgeti(L, -1, i);
+			lua_rawseti(L, -2, i+1);
+		}
+		lua_pushcfunction(L, Searcher);
+		lua_rawseti(L, -2, 2);
+	}
+	lua_pop(L, 2);
+}
+
+inline int Bundle::Main(int argc, char* argv[])
+{
+	if(argc < 4)
+	{
+		fprintf(stderr, "usage: %s <output.cpp> <symbol> <root> <script files...>\n", argv[0]);
+		return 1;
+	}
+	struct Image
+	{
+		char* Data;
+		size_t Size, Capacity;
+		bool Failed;
+		void Add(const void* data, size_t size)
+		{
+			if(Size + size > Capacity)
+			{
+				size_t capacity = Capacity ? 2*Capacity : 4096;
+				while(capacity < Size + size)
+					capacity *= 2;
+				char* grown = (char*)realloc(Data, capacity);
+				if(!grown)
+				{
+					Failed = true;
+					return;
+				}
+				Data = grown;
+				Capacity = capacity;
+			}
+			memcpy(Data+Size, data, size);
+			Size += size;
+		}
+		void Varint(size_t value)
+		{
+			do
+			{
+				char byte = (char)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+				Add(&byte, 1);
+				value >>= 7;
+			} while(value);
+		}
+		static int Write(lua_State* /*L*/, const void* data, size_t size, void* image)
+		{
+			((Image*)image)->Add(data, size);
+			return 0;
+		}
+	} image = { NULL, 0, 0, false };
+	image.Add("LCBB", 4);
+	char version = (char)Version;
+	image.Add(&version, 1);
+	image.Varint(argc-4);
+	lua_State* L = luaL_newstate();
+	size_t root = strlen(argv[3]);
+	int res = 0;
+	for(int i=4;i<argc && !res;i++)
+	{
+		const char* file = argv[i];
+		if(!strncmp(file, argv[3], root))
+			file += root;
+		while(*file == '/' || *file == '\\')
+			file++;
+		if(luaL_loadfile(L, argv[i]))
+		{
+			fprintf(stderr, "%s\n", lua_tostring(L, -1));
+			res = 1;
+			break;
+		}
+		const char* name = luaL_gsub(L, file, "\\", "/");
+		image.Varint(strlen(name));
+		image.Add(name, strlen(name));
+		Image code = { NULL, 0, 0, false };
+		lua_pushvalue(L, -2);
+#if LUA_VERSION_NUM >= 503
+		lua_dump(L, Image::Write, &code, 0);
+#else
+		lua_dump(L, Image::Write, &code);
+#endif
+		image.Varint(code.Size);
+		image.Add(code.Data, code.Size);
+		free(code.Data);
+		lua_settop(L, 0);
+		if(code.Failed || image.Failed)
+		{
+			fprintf(stderr, "not enough memory\n");
+			res = 1;
+		}
+	}
+	lua_close(L);
+	FILE* out = res ? NULL : fopen(argv[1], "w");
+	if(!res && !out)
+	{
+		fprintf(stderr, "cannot write %s\n", argv[1]);
+		res = 1;
+	}
+	if(out)
+	{
+		fprintf(out, "// Generated by lua::Bundle::Main, do not edit\n#include \"lgencall.hpp\"\n\n");
+		fprintf(out, "static const unsigned char %s[] = {", argv[2]);
+		for(size_t i=0;i<image.Size;i++)
+			fprintf(out, "%s%d,", i % 24 ? "" : "\n\t", (unsigned char)image.Data[i]);
+		fprintf(out, "\n};\n\nstatic const lua::Bundle %s_bundle(%s, sizeof(%s));\n", argv[2], argv[2], argv[2]);
+		if(fclose(out))
+			res = 1;
+	}
+	free(image.Data);
+	return res;
+}
+
+class Script
+{
+public:
+	Script(const char* snippet) : string(snippet), name(NULL), memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyString; pLoad=&Script::LoadString; }
+	Script(const char* snippet, const char* name_) : string(snippet), name(name_), memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyString; pLoad=&Script::LoadNamedString; }
+	Script(const wchar_t* snippet) : wstring(snippet), wname(NULL), memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyWString; pLoad=&Script::LoadWString; }
+	Script(const wchar_t* snippet, const wchar_t* name) : wstring(snippet), wname(name), memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyWString; pLoad=&Script::LoadWNamedString; }
+	Script(const QString& snippet) : qstring(&snippet), qname(NULL), memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyQString; pLoad=&Script::LoadQString; }
+	Script(const QString& snippet, const QString& name) : qstring(&snippet), qname(&name), memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyQString; pLoad=&Script::LoadQNamedString; }
+	// The key of a script run in an environment has an extra byte, so that it is compiled separately
+	void pushkey(lua_State* L) const
+	{
+		(this->*pKey)(L);
+		if(env && lua_toboolean(L, -1))
+		{
+			lua_pushlstring(L, "", 1);
+			lua_concat(L, 2);
+		}
+	}
+	int load(lua_State* L) const { return (this->*pLoad)(L); }
+	// True if the results are memoized (see Pure), kept ttl seconds (0 for ever)
+	bool memoized() const { return memo; }
+	// True if the input tables may be recycled after the call (see Transient)
+	bool recycling() const { return recycle; }
+	double lifetime() const { return ttl; }
+	const Environment* environment() const { return chunk ? env : NULL; }
+protected:
+	Script() : memo(false), recycle(false), ttl(0), env(NULL), chunk(true) { pKey=&Script::KeyNil; }
+	// The key of a named snippet ends with a null character and the name, which may select a bundled script
+	void KeyString(lua_State* L) const
+	{
+		lua_pushstring(L, string);
+		if(pLoad == &Script::LoadNamedString)
+			KeyName(L, name, strlen(name));
+	}
+	int LoadString(lua_State* L) const { return LoadText(L, string, strlen(string), string); }
+	int LoadNamedString(lua_State* L) const { return LoadNamed(L, string, name); }
+	void KeyWString(lua_State* L) const
+	{
+		lua_pushlstring(L, (const char*)wstring, wcslen(wstring)*sizeof(wchar_t));
+		if(pLoad == &Script::LoadWNamedString)
+			KeyName(L, (const char*)wname, wcslen(wname)*sizeof(wchar_t));
+	}
+	static void KeyName(lua_State* L, const char* name, size_t len)
+	{
+		lua_pushlstring(L, "", 1);
+		lua_pushlstring(L, name, len);
+		lua_concat(L, 3);
+	}
+	void KeyNil(lua_State* L) const { lua_pushnil(L); }
+	int LoadWString(lua_State* L) const 
+	{ 
+		WideString::Push(L, wstring); 
+		const char* str = lua_tostring(L, -1);
+		int res = LoadText(L, str, strlen(str), str); 
+		lua_remove(L, -2);
+		return res;
+	}
+	int LoadWNamedString(lua_State* L) const 
+	{ 
+		WideString::Push(L, wstring); 
+		WideString::Push(L, wname); 
+		int res = LoadNamed(L, lua_tostring(L, -2), lua_tostring(L, -1)); 
+		lua_remove(L, -2);
+		lua_remove(L, -2);
+		return res;
+	}
+	void KeyQString(lua_State* L) const;
+	// A named snippet is replaced by the bundled script of that name (without a leading '@' or '='), if any
+	int LoadNamed(lua_State* L, const char* snippet, const char* name) const
+	{
+		size_t size;
+		const char* code = Bundle::Lookup(name + (*name == '@' || *name == '='), size);
+		if(code)
+			return LoadText(L, code, size, name);
+		return LoadText(L, snippet, strlen(snippet), name);
+	}
+	/* Loads code like luaL_loadbuffer. The code of a script run in an environment is loaded as the
+	   factory of its closures instead, a function taking the environment and returning the closure
+	   (see Environment): the text is wrapped in a function, so that all the closures share the
+	   prototype compiled once. Precompiled code cannot be wrapped, nor, with the vararg compatibility
+	   of Lua 5.1, code that may use arg, which would name the implicit local of the wrapper: their
+	   factory loads the code again for each environment. */
+	int LoadText(lua_State* L, const char* code, size_t size, const char* name) const
+	{
+		if(!environment())
+			return luaL_loadbuffer(L, code, size, name);
+#if LUA_VERSION_NUM < 502 && defined(LUA_COMPAT_VARARG)
+		if((size && *code == '\033') || NamesArg(code, size))
+#else
+		if(size && *code == '\033')
+#endif
+		{
+			int res = luaL_loadbuffer(L, code, size, name);
+			if(res)
+				return res;
+			lua_pop(L, 1);
+			lua_pushlstring(L, code, size);
+			lua_pushstring(L, name);
+			lua_pushcclosure(L, LoadAgain, 2);
+			return 0;
+		}
+		// The wrapper stays on the first line, so that the line numbers of the errors are kept;
+		// the vararg expression keeps Lua 5.1 from creating the arg table of the closure on each call
+#if LUA_VERSION_NUM >= 502
+		Chunk chunk = { { "local _ENV = ...; return function(...) ", code, "\nend" }, { 0, size, 4 }, 0 };
+#elif defined(LUA_COMPAT_VARARG)
+		Chunk chunk = { { "return function(...) do local _ = ... end ", code, "\nend" }, { 0, size, 4 }, 0 };
+#else
+		Chunk chunk = { { "return function(...) ", code, "\nend" }, { 0, size, 4 }, 0 };
+#endif
+		chunk.sizes[0] = strlen(chunk.parts[0]);
+#if LUA_VERSION_NUM >= 502
+		return lua_load(L, ReadChunk, &chunk, name, "t");
+#else
+		return lua_load(L, ReadChunk, &chunk, name);
+#endif
+	}
+	struct Chunk
+	{
+		const char* parts[3];
+		size_t sizes[3];
+		int next;
+	};
+	static const char* ReadChunk(lua_State* /*L*/, void* data, size_t* size)
+	{
+		Chunk* chunk = (Chunk*)data;
+		while(chunk->next < 3)
+		{
+			int i = chunk->next++;
+			if(chunk->sizes[i])
+			{
+				*size = chunk->sizes[i];
+				return chunk->parts[i];
+			}
+		}
+		*size = 0;
+		return NULL;
+	}
+#if LUA_VERSION_NUM < 502 && defined(LUA_COMPAT_VARARG)
+	// True if the code contains the name arg, not as a field; it may be in a string or a comment
+	static bool NamesArg(const char* code, size_t size)
+	{
+		for(size_t i=0;i+3<=size;i++)
+		{
+			if(code[i] != 'a' || code[i+1] != 'r' || code[i+2] != 'g')
+				continue;
+			if(i && (isalnum((unsigned char)code[i-1]) || code[i-1] == '_' || code[i-1] == '.' || code[i-1] == ':'))
+				continue;
+			if(i+3 < size && (isalnum((unsigned char)code[i+3]) || code[i+3] == '_'))
+				continue;
+			return true;
+		}
+		return false;
+	}
+#endif
+	static int LoadAgain(lua_State* L);
+	int LoadQString(lua_State* L) const
+	{ 
+		QtString::Push(L, *qstring); 
+		const char* str = lua_tostring(L, -1);
+		int res = LoadText(L, str, strlen(str), str); 
+		lua_remove(L, -2);
+		return res;
+	}
+	int LoadQNamedString(lua_State* L) const
+	{ 
+		QtString::Push(L, *qstring); 
+		QtString::Push(L, *qname); 
+		int res = LoadNamed(L, lua_tostring(L, -2), lua_tostring(L, -1)); 
+		lua_remove(L, -2);
+		lua_remove(L, -2);
+		return res;
+	}
+
+	typedef void (Script::*pKey_t)(lua_State* L) const;
+	typedef int (Script::*pLoad_t)(lua_State* L) const;
+	pKey_t pKey;
+	pLoad_t pLoad;
+	union
+	{
+		const char* string;
+		const wchar_t* wstring;
+		const QString* qstring;
+	};
+	union
+	{
+		const char* name;
+		const wchar_t* wname;
+		const QString* qname;
+	};
+	friend class Compiler;
+	bool memo;
+	bool recycle;
+	double ttl;
+	const Environment* env;
+	// False if the function is not compiled for the call, so it must not be bound to an environment
+	bool chunk;
+
+};
+
+class File : public Script
+{
+public:
+	File(const char* filename) { string=filename; pLoad=(pLoad_t)&File::LoadFile; }
+	File(const wchar_t* filename) { wstring=filename; pLoad=(pLoad_t)&File::LoadWFile; }
+	File(const QString& filename) { qstring=&filename; pLoad=(pLoad_t)&File::LoadQFile; }
+private:
+	int LoadFile(lua_State* L) const { return Load(L, string); }
+	int LoadWFile(lua_State* L) const
+	{ 
+		WideString::Push(L, wstring); 
+		int res = Load(L, lua_tostring(L, -1)); 
+		lua_remove(L, -2);
+		return res;
+	}
+	int LoadQFile(lua_State* L) const
+	{ 
+		QtString::Push(L, *qstring); 
+		int res = Load(L, lua_tostring(L, -1)); 
+		lua_remove(L, -2);
+		return res;
+	}
+	// Bundled scripts are found first
+	static int Load(lua_State* L, const char* filename)
+	{
+		int res = Bundle::Load(L, filename);
+		return res >= 0 ? res : luaL_loadfile(L, filename);
+	}
+};
+
+class Global : public Script
+{
+public:
+	Global(const char* fctname) { string=fctname; pLoad=(pLoad_t)&Global::LoadGlobal; chunk=false; }
+	Global(const wchar_t* fctname) { wstring=fctname; pLoad=(pLoad_t)&Global::LoadWGlobal; chunk=false; }
+	Global(const QString& fctname) { qstring=&fctname; pLoad=(pLoad_t)&Global::LoadQGlobal; chunk=false; }
+private:
+	int LoadGlobal(lua_State* L) const { lua_getglobal(L, string); return 0; }
+	int LoadWGlobal(lua_State* L) const
+	{ 
+		WideString::Push(L, wstring); 
+		const char* str = lua_tostring(L, -1);
+		lua_getglobal(L, str); 
+		lua_remove(L, -2);
+		return 0;
+	}
+	int LoadQGlobal(lua_State* L) const
+	{ 
+		QtString::Push(L, *qstring); 
+		const char* str = lua_tostring(L, -1);
+		lua_getglobal(L, str); 
+		lua_remove(L, -2);
+		return 0;
+	}
+};
+
+/* Pure marks a script whose results only depend on its inputs, like a formatting function or a
+   table lookup: LuaT calls memoize its results (see ResultCache) for ttl seconds, or for ever if
+   ttl is 0. Scripts without a cache key, File and Global, and scripts run InEnvironment are not memoized. */
+class Pure : public Script
+{
+public:
+	Pure(const Script& script, double ttl_ = 0) : Script(script) { memo = true; ttl = ttl_; }
+};
+
+/* Transient marks a script which does not keep its input tables beyond the call, in globals, upvalues,
+   the registry or userdata: once table recycling is enabled (see TablePool), the input tables of its
+   calls that do not escape through the results are reused by the following calls. */
+class Transient : public Script
+{
+public:
+	Transient(const Script& script) : Script(script) { recycle = true; }
+};
+
+/* Environment is a table of globals for the scripts of one tenant, so that a single Lua state can
+   serve many isolated tenants. The missing globals are read from a base table, the globals of the
+   state by default, through a shared __index metatable; assignments create globals in the environment
+   only. The base itself is not copied, so the tenants must not modify the tables it contains, such as
+   string or math. A script run InEnvironment is compiled once for all the environments, as a cached
+   factory of closures (see Script::LoadText); each environment calls the factory the first time it
+   runs the script, getting its own closure of the shared prototype, with the environment as its
+   _ENV upvalue from Lua 5.2 or set by lua_setfenv with Lua 5.1. The closures are kept in a weak-keyed table of the environment, indexed by the cached
+   function, so a call never rebinds a closure that a suspended call of another tenant still runs,
+   and the functions created by a script keep the environment they were created in. Like TableView,
+   an environment retains its Lua state and must not be shared between threads. */
+class Environment
+{
+public:
+	Environment() : L(NULL), Ref(LUA_NOREF) {}
+	// Creates an environment of l reading the missing globals from base, or from the globals of l
+	explicit Environment(lua_State* l) : L(NULL), Ref(LUA_NOREF) { Create(l, NULL); }
+	Environment(lua_State* l, const TableView& base) : L(NULL), Ref(LUA_NOREF) { Create(l, &base); }
+	Environment(const Environment& src) : L(NULL), Ref(LUA_NOREF) { *this = src; }
+	~Environment() { Release(); }
+	Environment& operator=(const Environment& src)
+	{
+		if(this != &src)
+		{
+			Release();
+			if(src.valid())
+				Attach(src.L, src.Ref);
+		}
+		return *this;
+	}
+	bool valid() const { return Ref != LUA_NOREF; }
+	lua_State* state() const { return L; }
+	// Pushes the table of the environment
+	void Push(lua_State* L) const
+	{
+		if(!valid())
+			return lua_pushnil(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, Ref);
+		lua_rawgeti(L, -1, 1);
+		lua_remove(L, -2);
+	}
+	/* Makes the Lua function at idx use the environment. A factory shared by the environments, from
+	   the compile cache, is replaced by the closure of the environment it returns; another function
+	   is bound itself. */
+	void Apply(lua_State* L, int idx, bool shared) const
+	{
+		if(!valid() || !StateCopier::SameUniverse(this->L, L))
+			luaL_error(L, "invalid environment for this Lua state");
+		if(!lua_isfunction(L, idx) || (!shared && lua_iscfunction(L, idx)))
+			return;
+		if(idx < 0)
+			idx = lua_gettop(L) + idx + 1;
+		int top = lua_gettop(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, Ref);
+		if(!shared)
+		{
+			lua_rawgeti(L, top+1, 1);
+			Bind(L, idx);
+			lua_settop(L, top);
+			return;
+		}
+		lua_rawgeti(L, top+1, 2);
+		lua_pushvalue(L, idx);
+		lua_rawget(L, top+2);
+		if(!lua_isfunction(L, top+3))
+		{
+			lua_pop(L, 1);
+			lua_pushvalue(L, idx);
+			lua_rawgeti(L, top+1, 1);
+			lua_call(L, 1, 1);
+#if LUA_VERSION_NUM < 502
+			lua_rawgeti(L, top+1, 1);
+			lua_setfenv(L, top+3);
+#endif
+			lua_pushvalue(L, idx);
+			lua_pushvalue(L, top+3);
+			lua_rawset(L, top+2);
+		}
+		lua_replace(L, idx);
+		lua_settop(L, top);
+	}
+	void Release()
+	{
+		if(!valid())
+			return;
+		luaL_unref(L, LUA_REGISTRYINDEX, Ref);
+		Ref = LUA_NOREF;
+		if(IncrRetainCount(L, -1) < 0)
+			lua_close(L);
+		L = NULL;
+	}
+private:
+	// Sets the environment on top of the stack to the function at idx, and pops it
+	static void Bind(lua_State* L, int idx)
+	{
+#if LUA_VERSION_NUM >= 502
+		// A main chunk has _ENV as its only upvalue, named unless its debug information has been stripped
+		int env = lua_gettop(L);
+		const char* name = lua_getupvalue(L, idx, 1);
+		if(name)
+		{
+			bool isenv = !strcmp(name, "_ENV");
+			if(!isenv && (!*name || !strcmp(name, "?")))
+				isenv = lua_getupvalue(L, idx, 2) == NULL;
+			lua_settop(L, env);
+			if(isenv)
+				lua_setupvalue(L, idx, 1);
+		}
+		lua_settop(L, env-1);
+#else
+		lua_setfenv(L, idx);
+#endif
+	}
+	static void PushWeakTable(lua_State* L)
+	{
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushstring(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+	}
+	void Attach(lua_State* l, int ref)
+	{
+		L = l;
+		IncrRetainCount(L, 1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+		Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	void Create(lua_State* l, const TableView* base)
+	{
+		int top = lua_gettop(l);
+		lua_newtable(l);
+		if(base)
+		{
+			lua_createtable(l, 0, 1);
+			base->Push(l);
+			lua_setfield(l, -2, "__index");
+		}
+		else
+		{
+			// The metatable reading the globals is shared by all the environments
+			lua_getfield(l, LUA_REGISTRYINDEX, "LuaClassBasedEnvironment");
+			if(!lua_istable(l, -1))
+			{
+				lua_pop(l, 1);
+				lua_createtable(l, 0, 1);
+#if LUA_VERSION_NUM >= 502
+				lua_rawgeti(l, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+				lua_pushvalue(l, LUA_GLOBALSINDEX);
+#endif
+				lua_setfield(l, -2, "__index");
+				lua_pushvalue(l, -1);
+				lua_setfield(l, LUA_REGISTRYINDEX, "LuaClassBasedEnvironment");
+			}
+		}
+		lua_setmetatable(l, -2);
+		// The reference is a table { environment, closures of the environment }
+		lua_createtable(l, 2, 0);
+		lua_insert(l, -2);
+		lua_rawseti(l, -2, 1);
+		PushWeakTable(l);
+		lua_rawseti(l, -2, 2);
+		L = l;
+		IncrRetainCount(L, 1);
+		Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_settop(L, top);
+	}
+	lua_State* L;
+	int Ref;
+	friend class Script;
+};
+
+// Factory of the closures of a script run in an environment that cannot be wrapped: it loads the code again
+inline int Script::LoadAgain(lua_State* L)
+{
+	size_t size;
+	const char* code = lua_tolstring(L, lua_upvalueindex(1), &size);
+	if(luaL_loadbuffer(L, code, size, lua_tostring(L, lua_upvalueindex(2))))
+		lua_error(L);
+	lua_pushvalue(L, 1);
+	Environment::Bind(L, lua_gettop(L)-1);
+	return 1;
+}
+
+inline void Input::PushEnvironment(lua_State* L) const
+{
+	const Environment* env = (const Environment*)PointerValue;
+	if(env->valid() && !StateCopier::SameUniverse(env->state(), L))
+		luaL_error(L, "cannot pass an environment to another Lua state");
+	env->Push(L);
+}
+
+// InEnvironment runs a script with the globals of an Environment, without compiling it again for each
+// environment. A Global function is called as it is.
+class InEnvironment : public Script
+{
+public:
+	InEnvironment(const Script& script, const Environment& environment) : Script(script) { env = &environment; }
+};
+
+/* CompileCache keeps the functions compiled from the scripts, in the registry table LuaClassBasedCaller
+   indexed by the script keys. It belongs to the Lua state, so it is shared by all the LuaT objects
+   using it. Each entry is a table { function, referenced, pin count, approximate bytes }, the bytes
+   being the growth of the Lua memory during the compilation. When a limit on the number of entries
+   or on their bytes is set, entries are evicted with the CLOCK algorithm: a hand, kept in the registry
+   as the last key visited, goes around the table giving a second chance to the entries used since
+   its last visit; the hits only mark the entries as used while a limit is set. Pinned entries are
+   never evicted, even by Flush. The cache object is kept in the registry as LuaClassBasedCache and
+   cached by LuaT. */
+class CompileCache
+{
+public:
+	struct Stats
+	{
+		size_t Entries;
+		size_t Bytes;
+		unsigned long Hits;
+		unsigned long Misses;
+		unsigned long Evictions;
+	};
+	CompileCache() : MaxEntries(0), MaxBytes(0) { memset(&Counters, 0, sizeof(Counters)); }
+	static CompileCache* Get(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCache");
+		CompileCache* cache = (CompileCache*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(!cache)
+		{
+			cache = new(lua_newuserdata(L, sizeof(CompileCache))) CompileCache();
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCache");
+		}
+		return cache;
+	}
+	const Stats& stats() const { return Counters; }
+	// 0 means no limit; entries are evicted at once if needed
+	void SetLimits(lua_State* L, size_t entries, size_t bytes)
+	{
+		MaxEntries = entries;
+		MaxBytes = bytes;
+		int top = lua_gettop(L);
+		PushTable(L);
+		MakeRoom(L, top+1, 0, 0);
+		lua_settop(L, top);
+	}
+	// Pushes the function of script, compiling it unless it is found in the cache; raises the compilation errors.
+	// Returns false if the function is not kept in the cache, the script having no key
+	bool PushFunction(lua_State* L, const Script& script)
+	{
+		int top = lua_gettop(L);
+		script.pushkey(L);
+		if(!lua_toboolean(L, -1))
+		{
+			lua_pop(L, 1);
+			if(script.load(L))
+				lua_error(L);
+			return false;
+		}
+		PushTable(L);
+		lua_pushvalue(L, top+1);
+		lua_rawget(L, top+2);
+		if(lua_istable(L, -1))
+		{
+			Counters.Hits++;
+			// The referenced bit only matters to the evictions, so it is not maintained without limits
+			if(MaxEntries || MaxBytes)
+			{
+				lua_pushboolean(L, 1);
+				lua_rawseti(L, -2, 2);
+			}
+			lua_rawgeti(L, -1, 1);
+		}
+		else
+		{
+			Counters.Misses++;
+			lua_pop(L, 1);
+			size_t before = Memory(L);
+			if(script.load(L))
+				lua_error(L);
+			size_t after = Memory(L);
+			Add(L, top+2, top+1, top+3, after > before ? after - before : 0);
+		}
+		lua_replace(L, top+1);
+		lua_settop(L, top+1);
+		return true;
+	}
+	// Adds to the cache table at idx the function at fct with the key at key
+	void Add(lua_State* L, int idx, int key, int fct, size_t bytes)
+	{
+		MakeRoom(L, idx, 1, bytes);
+		lua_pushvalue(L, key);
+		lua_createtable(L, 4, 0);
+		lua_pushvalue(L, fct);
+		lua_rawseti(L, -2, 1);
+		lua_pushboolean(L, 0);
+		lua_rawseti(L, -2, 2);
+		lua_pushinteger(L, 0);
+		lua_rawseti(L, -2, 3);
+		lua_pushinteger(L, (lua_Integer)bytes);
+		lua_rawseti(L, -2, 4);
+		lua_rawset(L, idx);
+		Counters.Entries++;
+		Counters.Bytes += bytes;
+	}
+	// Adds (delta>0) or removes (delta<0) pins on the entry of script, compiling it if needed to pin it
+	void Pin(lua_State* L, const Script& script, int delta)
+	{
+		int top = lua_gettop(L);
+		if(delta > 0)
+		{
+			PushFunction(L, script);
+			lua_pop(L, 1);
+		}
+		PushTable(L);
+		script.pushkey(L);
+		if(lua_toboolean(L, -1))
+		{
+			lua_rawget(L, top+1);
+			if(lua_istable(L, -1))
+			{
+				lua_rawgeti(L, -1, 3);
+				lua_Integer pins = lua_tointeger(L, -1) + delta;
+				lua_pop(L, 1);
+				lua_pushinteger(L, pins > 0 ? pins : 0);
+				lua_rawseti(L, -2, 3);
+			}
+		}
+		lua_settop(L, top);
+	}
+	// Removes all the entries except the pinned ones
+	void Flush(lua_State* L)
+	{
+		int top = lua_gettop(L);
+		lua_newtable(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+		if(lua_istable(L, -1))
+		{
+			lua_pushnil(L);
+			while(lua_next(L, top+2))
+			{
+				lua_rawgeti(L, -1, 3);
+				if(lua_tointeger(L, -1) > 0)
+				{
+					lua_pushvalue(L, -3);
+					lua_pushvalue(L, -3);
+					lua_rawset(L, top+1);
+				}
+				lua_pop(L, 2);
+			}
+		}
+		lua_pop(L, 1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+		Recount(L);
+	}
+	// Updates the counts and resets the hand after the cache table has been replaced
+	void Recount(lua_State* L)
+	{
+		Counters.Entries = Counters.Bytes = 0;
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCacheHand");
+		PushTable(L);
+		lua_pushnil(L);
+		while(lua_next(L, -2))
+		{
+			lua_rawgeti(L, -1, 4);
+			Counters.Entries++;
+			Counters.Bytes += (size_t)lua_tointeger(L, -1);
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+	static void PushTable(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+		if(lua_istable(L, -1))
+			return;
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+	}
 private:
-	void Init(const T* args[], size_t len)
+	static size_t Memory(lua_State* L) { return (size_t)lua_gc(L, LUA_GCCOUNT, 0)*1024 + (size_t)lua_gc(L, LUA_GCCOUNTB, 0); }
+	bool Full(size_t entries, size_t bytes) const
 	{
-		Size = len;
-		for(size_t i=0;i<len;i++)
-			Arguments[i] = args[i];
+		return (MaxEntries && Counters.Entries + entries > MaxEntries) || (MaxBytes && Counters.Bytes + bytes > MaxBytes);
 	}
-	size_t Size;
-	const T* Arguments[32];
+	// Evicts entries from the table at idx until entries more entries taking bytes fit in the limits.
+	// The hand only stops on live keys, so that lua_next can always continue from it.
+	void MakeRoom(lua_State* L, int idx, size_t entries, size_t bytes)
+	{
+		for(size_t steps=2*Counters.Entries+2;steps && Counters.Entries && Full(entries, bytes);steps--)
+		{
+			lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCacheHand");
+			if(!lua_next(L, idx))
+			{
+				lua_pushnil(L);
+				lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCacheHand");
+				continue;
+			}
+			lua_rawgeti(L, -1, 3);
+			lua_rawgeti(L, -2, 2);
+			bool pinned = lua_tointeger(L, -2) > 0, referenced = lua_toboolean(L, -1) != 0;
+			lua_pop(L, 2);
+			if(pinned || referenced)
+			{
+				if(referenced)
+				{
+					lua_pushboolean(L, 0);
+					lua_rawseti(L, -2, 2);
+				}
+				lua_pop(L, 1);
+				lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCacheHand");
+				continue;
+			}
+			lua_rawgeti(L, -1, 4);
+			size_t size = (size_t)lua_tointeger(L, -1);
+			lua_pop(L, 2);
+			lua_pushnil(L);
+			lua_rawset(L, idx);
+			Counters.Entries--;
+			Counters.Bytes -= size < Counters.Bytes ? size : Counters.Bytes;
+			Counters.Evictions++;
+		}
+	}
+	size_t MaxEntries;
+	size_t MaxBytes;
+	Stats Counters;
 };
 
-template<class C>
-class ErrorT
+#if LCBC_USE_CPP11
+/* Compiler compiles scripts on a worker thread with its own Lua state, so that the first call of a
+   large script does not pay for its compilation. Warmup queues scripts, copying their text; the
+   worker compiles them in order and dumps their bytecode. Between calls, LuaT::Install loads the
+   bytecode compiled since its previous Install into the compile cache of its state; loading bytecode
+   is much faster than compiling. Install returns true once every queued script is installed, which
+   tells when a node can take traffic. Only the scripts with a cache key are compiled: strings and
+   wide strings, with or without name. The others, and the scripts failing to compile, are compiled
+   by their first call as usual. Warmup and ready can be called from any thread; the Compiler
+   must outlive the Install calls using it. */
+class Compiler
 {
 public:
-	ErrorT(C message) : Message(message)  {}
-	operator C() const { return Message; }
-	C str() const { return Message; }
+	Compiler() : Id(++Counter()), First(NULL), Last(NULL), Pending(0), Stopping(false), Worker(&Compiler::Run, this) {}
+	~Compiler()
+	{
+		{
+			lock_guard<mutex> lock(Lock);
+			Stopping = true;
+		}
+		Wake.notify_all();
+		Worker.join();
+		while(First)
+		{
+			Unit* unit = First;
+			First = unit->Next;
+			delete unit;
+		}
+	}
+	void Warmup(const Script& script) { Warmup(&script, 1); }
+	void Warmup(const Script* scripts, size_t count)
+	{
+		for(size_t i=0;i<count;i++)
+		{
+			Unit* unit = NewUnit(scripts[i]);
+			if(!unit)
+				continue;
+			lock_guard<mutex> lock(Lock);
+			if(Last)
+				Last->Next = unit;
+			else
+				First = unit;
+			Last = unit;
+			Pending++;
+		}
+		Wake.notify_all();
+	}
+	// True once all the queued scripts are compiled
+	bool ready() const { return Pending == 0; }
+	size_t pending() const { return Pending; }
+	// Waits until all the queued scripts are compiled, at most timeout seconds; returns ready()
+	bool Wait(double timeout) const
+	{
+		chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout));
+		while(!ready() && chrono::steady_clock::now() < deadline)
+			this_thread::sleep_for(chrono::milliseconds(1));
+		return ready();
+	}
+	// Protected function loading in the cache the scripts compiled since the previous Install in the state
+	struct InstallArgs
+	{
+		Compiler* Source;
+		bool Ready;
+	};
+	static int DoInstall(lua_State* L);
 private:
-	C Message;
+	Compiler(const Compiler&);
+	Compiler& operator=(const Compiler&);
+	// A queued script; the compiled fields are written by the worker before Done is set
+	struct Unit
+	{
+		Unit() : Kind(0), Text(NULL), Name(NULL), Key(NULL), KeySize(0), Code(NULL), CodeSize(0), Done(false), Next(NULL) {}
+		~Unit() { free(Text); free(Name); free(Key); free(Code); }
+		static char* Copy(const void* data, size_t size)
+		{
+			char* copy = (char*)malloc(size);
+			if(copy)
+				memcpy(copy, data, size);
+			return copy;
+		}
+		int Kind;
+		char* Text;
+		char* Name;
+		char* Key;
+		size_t KeySize;
+		char* Code;
+		size_t CodeSize;
+		atomic<bool> Done;
+		Unit* Next;
+	};
+	static atomic<unsigned long>& Counter() { static atomic<unsigned long> counter(0); return counter; }
+	// Copies the text and the name of script, or returns NULL if it has no cache key
+	static Unit* NewUnit(const Script& script)
+	{
+		int kind = script.pKey == &Script::KeyString ? 1 : script.pKey == &Script::KeyWString ? 2 : 0;
+		if(!kind)
+			return NULL;
+		Unit* unit = new Unit;
+		unit->Kind = kind;
+		if(kind == 1)
+		{
+			unit->Text = Unit::Copy(script.string, strlen(script.string)+1);
+			if(script.pLoad == &Script::LoadNamedString)
+				unit->Name = Unit::Copy(script.name, strlen(script.name)+1);
+		}
+		else
+		{
+			unit->Text = Unit::Copy(script.wstring, (wcslen(script.wstring)+1)*sizeof(wchar_t));
+			if(script.pLoad == &Script::LoadWNamedString)
+				unit->Name = Unit::Copy(script.wname, (wcslen(script.wname)+1)*sizeof(wchar_t));
+		}
+		return unit;
+	}
+	void Run()
+	{
+		lua_State* L = luaL_newstate();
+		for(Unit* unit=NULL;;)
+		{
+			{
+				unique_lock<mutex> lock(Lock);
+				Unit* next;
+				while(!Stopping && !(next = unit ? unit->Next : First))
+					Wake.wait(lock);
+				if(Stopping)
+					break;
+				unit = next;
+			}
+			if(L && unit->Text)
+			{
+				lua_pushcfunction(L, DoCompile);
+				lua_pushlightuserdata(L, unit);
+				lua_pcall(L, 1, 0, 0);
+				lua_settop(L, 0);
+			}
+			unit->Done = true;
+			Pending--;
+		}
+		if(L)
+			lua_close(L);
+	}
+	static int DoCompile(lua_State* L)
+	{
+		Unit* unit = (Unit*)lua_touserdata(L, 1);
+		const wchar_t* wtext = (const wchar_t*)unit->Text;
+		const wchar_t* wname = (const wchar_t*)unit->Name;
+		Script script = unit->Kind == 1 ? (unit->Name ? Script(unit->Text, unit->Name) : Script(unit->Text)) : (wname ? Script(wtext, wname) : Script(wtext));
+		if(script.load(L))
+			return 0;
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+#if LUA_VERSION_NUM >= 503
+		lua_dump(L, Writer, &b, 0);
+#else
+		lua_dump(L, Writer, &b);
+#endif
+		luaL_pushresult(&b);
+		script.pushkey(L);
+		size_t keySize, codeSize;
+		const char* key = lua_tolstring(L, -1, &keySize);
+		const char* code = lua_tolstring(L, -2, &codeSize);
+		char* keyCopy = Unit::Copy(key, keySize);
+		char* codeCopy = Unit::Copy(code, codeSize);
+		if(!keyCopy || !codeCopy)
+		{
+			free(keyCopy);
+			free(codeCopy);
+			return 0;
+		}
+		unit->Key = keyCopy;
+		unit->KeySize = keySize;
+		unit->Code = codeCopy;
+		unit->CodeSize = codeSize;
+		return 0;
+	}
+	static int Writer(lua_State* /*L*/, const void* data, size_t size, void* buffer)
+	{
+		luaL_addlstring((luaL_Buffer*)buffer, (const char*)data, size);
+		return 0;
+	}
+	unsigned long Id;
+	Unit* First;
+	Unit* Last;
+	atomic<size_t> Pending;
+	bool Stopping;
+	mutable mutex Lock;
+	condition_variable Wake;
+	thread Worker;
 };
 
-typedef ErrorT<const char*> ErrorA;
-typedef ErrorT<const wchar_t*> ErrorW;
-#if defined(_UNICODE) || defined(UNICODE)
-typedef ErrorW Error;
-#else
-typedef ErrorA Error;
+/* The last unit installed in a state is kept in the registry table LuaClassBasedInstalled,
+   indexed by the compiler id, so that a new compiler at the same address starts again */
+inline int Compiler::DoInstall(lua_State* L)
+{
+	InstallArgs* args = (InstallArgs*)lua_touserdata(L, 1);
+	Compiler* compiler = args->Source;
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedInstalled");
+	if(!lua_istable(L, 2))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedInstalled");
+	}
+	lua_pushnumber(L, (lua_Number)compiler->Id);
+	lua_rawget(L, 2);
+	Unit* unit = (Unit*)lua_touserdata(L, 3);
+	lua_pop(L, 1);
+	{
+		lock_guard<mutex> lock(compiler->Lock);
+		unit = unit ? unit->Next : compiler->First;
+	}
+	CompileCache* cache = CompileCache::Get(L);
+	CompileCache::PushTable(L);
+	Unit* last = NULL;
+	for(;unit && unit->Done;)
+	{
+		if(unit->Code)
+		{
+			lua_pushlstring(L, unit->Key, unit->KeySize);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, 3);
+			if(lua_isnil(L, -1) && !luaL_loadbuffer(L, unit->Code, unit->CodeSize, "=warmup"))
+				cache->Add(L, 3, 4, 6, unit->CodeSize);
+			lua_settop(L, 3);
+		}
+		last = unit;
+		lock_guard<mutex> lock(compiler->Lock);
+		unit = unit->Next;
+	}
+	if(last)
+	{
+		lua_pushnumber(L, (lua_Number)compiler->Id);
+		lua_pushlightuserdata(L, last);
+		lua_rawset(L, 2);
+	}
+	args->Ready = !unit && compiler->ready();
+	return 0;
+}
 #endif
 
-typedef Array<Input> Inputs;
-typedef Array<Output> Outputs;
+/* ResultCache memoizes the results of the scripts marked Pure, in the registry table LuaClassBasedMemo.
+   The key of an entry is the script key followed by the snapshot of the inputs, so only calls whose
+   inputs are nil, booleans, numbers, strings and tables are memoized; the other calls just run the
+   script. An entry is a table { expiry, slot, count, results... }: a hit reads the outputs from it
+   without running the script. The cache belongs to the Lua state and keeps at most MaxEntries entries
+   (0 disables it). The oldest entries are evicted first: the registry table LuaClassBasedMemoOrder
+   is a ring of the keys in insertion order, and an entry is evicted when its slot is reused. */
+class ResultCache
+{
+public:
+	enum { DefaultEntries = 1024 };
+	struct Stats
+	{
+		size_t Entries;
+		unsigned long Hits;
+		unsigned long Misses;
+		unsigned long Expirations;
+		unsigned long Evictions;
+	};
+	ResultCache() : MaxEntries(DefaultEntries), Next(0) { memset(&Counters, 0, sizeof(Counters)); }
+	static ResultCache* Get(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedMemoCache");
+		ResultCache* cache = (ResultCache*)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(!cache)
+		{
+			cache = new(lua_newuserdata(L, sizeof(ResultCache))) ResultCache();
+			lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedMemoCache");
+		}
+		return cache;
+	}
+	const Stats& stats() const { return Counters; }
+	void SetLimit(lua_State* L, size_t entries)
+	{
+		MaxEntries = entries;
+		Flush(L);
+	}
+	void Flush(lua_State* L)
+	{
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedMemo");
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedMemoOrder");
+		Counters.Entries = 0;
+		Next = 0;
+	}
+	/* Pushes the key of the call, or nil if it cannot be memoized, then the inputs, recording their tables
+	   in pool if not NULL. On a hit, the key and the inputs are replaced by the cache entry and its results,
+	   and it returns true. */
+	bool Lookup(lua_State* L, const Script& script, const Inputs& inputs, TablePool* pool)
+	{
+		int base = lua_gettop(L) + 1;
+		int count = (int)inputs.size();
+		lua_checkstack(L, count + 8);
+		script.pushkey(L);
+		{
+			TablePool::Recording recording(L, pool);
+			for(int i=0;i<count;i++)
+				inputs.get(i).Push(L);
+		}
+		if(!MaxEntries || !lua_toboolean(L, base) || !PushKey(L, base, count))
+		{
+			lua_pushnil(L);
+			lua_replace(L, base);
+			return false;
+		}
+		PushTable(L, "LuaClassBasedMemo");
+		lua_pushvalue(L, base);
+		lua_rawget(L, -2);
+		if(lua_istable(L, -1))
+		{
+			lua_rawgeti(L, -1, 1);
+			lua_Number expiry = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+			if(expiry == 0 || expiry > Now())
+			{
+				Counters.Hits++;
+				lua_replace(L, base);
+				lua_settop(L, base);
+				lua_rawgeti(L, base, 3);
+				int results = (int)lua_tointeger(L, -1);
+				lua_pop(L, 1);
+				lua_checkstack(L, results);
+				for(int i=1;i<=results;i++)
+					lua_rawgeti(L, base, 3+i);
+				return true;
+			}
+			lua_pushvalue(L, base);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+			Counters.Entries--;
+			Counters.Expirations++;
+		}
+		lua_pop(L, 2);
+		Counters.Misses++;
+		return false;
+	}
+	// Stores the values above the key at base, unless the key is nil
+	void Store(lua_State* L, int base, double ttl)
+	{
+		if(!lua_toboolean(L, base))
+			return;
+		int count = lua_gettop(L) - base;
+		PushTable(L, "LuaClassBasedMemo");
+		PushTable(L, "LuaClassBasedMemoOrder");
+		int memo = base + count + 1, order = memo + 1, slot = (int)Next + 1;
+		lua_rawgeti(L, order, slot);
+		if(!lua_isnil(L, -1))
+		{
+			lua_pushvalue(L, -1);
+			lua_rawget(L, memo);
+			if(lua_istable(L, -1))
+			{
+				lua_rawgeti(L, -1, 2);
+				if(lua_tointeger(L, -1) == slot)
+				{
+					lua_pushvalue(L, -3);
+					lua_pushnil(L);
+					lua_rawset(L, memo);
+					Counters.Entries--;
+					Counters.Evictions++;
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		lua_pushvalue(L, base);
+		lua_rawseti(L, order, slot);
+		lua_pushvalue(L, base);
+		lua_createtable(L, count+3, 0);
+		lua_pushnumber(L, ttl > 0 ? Now() + ttl : 0);
+		lua_rawseti(L, -2, 1);
+		lua_pushinteger(L, slot);
+		lua_rawseti(L, -2, 2);
+		lua_pushinteger(L, count);
+		lua_rawseti(L, -2, 3);
+		for(int i=1;i<=count;i++)
+		{
+			lua_pushvalue(L, base+i);
+			lua_rawseti(L, -2, 3+i);
+		}
+		lua_rawset(L, memo);
+		lua_settop(L, base + count);
+		Counters.Entries++;
+		Next = (Next + 1) % MaxEntries;
+	}
+private:
+	// Wall clock time in seconds; only to the second without C++11
+	static double Now()
+	{
+#if LCBC_USE_CPP11
+		return CallLimits::Now();
+#else
+		return (double)time(NULL);
+#endif
+	}
+	static void PushTable(lua_State* L, const char* name)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, name);
+		if(lua_istable(L, -1))
+			return;
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, name);
+	}
+	/* Appends the snapshot of { count, inputs... } to the script key at base. The snapshot is written
+	   in a protected call, as unsupported values raise an error, and freed before anything else can. */
+	static bool PushKey(lua_State* L, int base, int count)
+	{
+		Snapshot image;
+		lua_pushcfunction(L, DoWrite);
+		lua_pushlightuserdata(L, &image);
+		lua_createtable(L, count+1, 0);
+		lua_pushinteger(L, count);
+		lua_rawseti(L, -2, 1);
+		for(int i=1;i<=count;i++)
+		{
+			lua_pushvalue(L, base+i);
+			lua_rawseti(L, -2, i+1);
+		}
+		lua_pushvalue(L, base);
+		if(lua_pcall(L, 3, 1, 0))
+		{
+			lua_pop(L, 1);
+			return false;
+		}
+		lua_replace(L, base);
+		return true;
+	}
+	static int DoWrite(lua_State* L)
+	{
+		Snapshot* image = (Snapshot*)lua_touserdata(L, 1);
+		Snapshot::Write(L, 2, *image);
+		lua_pushvalue(L, 3);
+		lua_pushlstring(L, image->data(), image->size());
+		lua_concat(L, 2);
+		return 1;
+	}
+	size_t MaxEntries;
+	size_t Next;
+	Stats Counters;
+};
 
-class Script
+/* StateTemplate describes how to build new Lua states quickly: the libraries to open, some of them
+   only when their global name is first read (lazy), the modules to preload, scripts compiled once
+   and put in the call cache of each state (Warm), and scripts run in each new state (Run).
+   The scripts are compiled only once, in a private state of the template, and copied as bytecode.
+   A LuaT built from a template records its globals, the libraries, package.loaded and the compile
+   cache as baseline: Reset() brings the state back to it, one level deep (the fields of the
+   libraries are restored, not the content of tables created by scripts).
+   The base, package and string libraries cannot be lazy: the string methods need the metatable
+   of strings. Lazy opening is done by a metatable on the globals table. */
+class StateTemplate
 {
 public:
-	Script(const char* snippet) : string(snippet) { pKey=&Script::KeyString; pLoad=&Script::LoadString; }
-	Script(const char* snippet, const char* name_) : string(snippet), name(name_) { pKey=&Script::KeyString; pLoad=&Script::LoadNamedString; }
-	Script(const wchar_t* snippet) : wstring(snippet) { pKey=&Script::KeyWString; pLoad=&Script::LoadWString; }
-	Script(const wchar_t* snippet, const wchar_t* name) : wstring(snippet), wname(name) { pKey=&Script::KeyWString; pLoad=&Script::LoadWNamedString; }
-	Script(const QString& snippet) : qstring(&snippet) { pKey=&Script::KeyQString; pLoad=&Script::LoadQString; }
-	Script(const QString& snippet, const QString& name) : qstring(&snippet), qname(&name) { pKey=&Script::KeyQString; pLoad=&Script::LoadQNamedString; }
-	void pushkey(lua_State* L) const { (this->*pKey)(L); }
-	int load(lua_State* L) const { return (this->*pLoad)(L); }
-protected:
-	Script() { pKey=&Script::KeyNil; }
-	void KeyString(lua_State* L) const { lua_pushstring(L, string); }
-	int LoadString(lua_State* L) const { return luaL_loadstring(L, string); }
-	int LoadNamedString(lua_State* L) const { return luaL_loadbuffer(L, string, strlen(string), name); }
-	void KeyWString(lua_State* L) const { lua_pushlstring(L, (const char*)wstring, wcslen(wstring)*sizeof(wchar_t)); }
-	void KeyNil(lua_State* L) const { lua_pushnil(L); }
-	int LoadWString(lua_State* L) const 
+	enum Library
 	{ 
-		WideString::Push(L, wstring); 
-		int res = luaL_loadstring(L, lua_tostring(L, -1)); 
-		lua_remove(L, -2);
-		return res;
+		Base=1, Package=2, Coroutine=4, Table=8, IO=16, OS=32, String=64, Math=128, Debug=256, Bit32=512, Utf8=1024,
+		AllLibraries=0xFFFF
+	};
+	StateTemplate(unsigned libraries = AllLibraries, unsigned lazy = 0) : Libraries(libraries), Lazy(lazy & ~(Base|Package|String))
+	{
+		Store = luaL_newstate();
+		for(int i=0;i<3;i++)
+		{
+			lua_newtable(Store);
+			lua_rawseti(Store, LUA_REGISTRYINDEX, FirstList+i);
+		}
 	}
-	int LoadWNamedString(lua_State* L) const 
-	{ 
-		WideString::Push(L, wstring); 
-		WideString::Push(L, wname); 
-		int res = luaL_loadbuffer(L, lua_tostring(L, -2), strlen(lua_tostring(L, -2)), lua_tostring(L, -1)); 
-		lua_remove(L, -2);
-		lua_remove(L, -2);
-		return res;
+	~StateTemplate() { lua_close(Store); }
+	// Preloads a module, opened by require with its function
+	void Preload(const char* name, lua_CFunction open)
+	{
+		lua_rawgeti(Store, LUA_REGISTRYINDEX, Preloads);
+		lua_pushcfunction(Store, open);
+		lua_setfield(Store, -2, name);
+		lua_pop(Store, 1);
 	}
-	void KeyQString(lua_State* L) const;
-	int LoadQString(lua_State* L) const
-	{ 
-		QtString::Push(L, *qstring); 
-		int res = luaL_loadstring(L, lua_tostring(L, -1)); 
-		lua_remove(L, -2);
-		return res;
+	// Preloads a module written in Lua; returns the compilation error or NULL
+	const char* Preload(const char* name, const Script& script)
+	{
+		lua_pushstring(Store, name);
+		return Compile(Preloads, script);
+	}
+	// Compiles a script once, to be found in the call cache of each new state
+	const char* Warm(const Script& script)
+	{
+		script.pushkey(Store);
+		if(lua_isnil(Store, -1))
+		{
+			lua_pop(Store, 1);
+			return "only a script having a cache key can be warmed";
+		}
+		return Compile(Warmed, script);
+	}
+	// Adds a script run by each new state, after the libraries and the modules have been set up.
+	// It is tried at once in a new state: its error, if any, is returned. Later errors are ignored.
+	const char* Run(const Script& script)
+	{
+		lua_rawgeti(Store, LUA_REGISTRYINDEX, Runs);
+		lua_pushinteger(Store, (lua_Integer)lua_objlen(Store, -1)+1);
+		lua_remove(Store, -2);
+		const char* error = Compile(Runs, script);
+		if(error)
+			return error;
+		lua_State* L = luaL_newstate();
+		if(Apply(L))
+		{
+			error = lua_tostring(L, -1);
+			lua_pushstring(Store, error);
+			lua_rawseti(Store, LUA_REGISTRYINDEX, ErrorSlot);
+			lua_rawgeti(Store, LUA_REGISTRYINDEX, Runs);
+			lua_pushnil(Store);
+			lua_rawseti(Store, -2, (int)lua_objlen(Store, -2));
+			lua_pop(Store, 1);
+			lua_rawgeti(Store, LUA_REGISTRYINDEX, ErrorSlot);
+			error = lua_tostring(Store, -1);
+			lua_pop(Store, 1);
+		}
+		lua_close(L);
+		return error ? error : NULL;
+	}
+	// Creates a new state, owned by the caller
+	lua_State* Create() const
+	{
+		lua_State* L = luaL_newstate();
+		Apply(L);
+		lua_settop(L, 0);
+		return L;
+	}
+	// Records the current globals, libraries, loaded modules and call cache as the state baseline
+	static void SaveBaseline(lua_State* L);
+	// Brings the state back to its baseline; returns false if there is none
+	static bool RestoreBaseline(lua_State* L);
+private:
+	StateTemplate(const StateTemplate&);
+	StateTemplate& operator=(const StateTemplate&);
+	// Lists in the registry of Store: preloaded modules, warmed scripts and run scripts (by name, key or order)
+	enum { FirstList = 1, Preloads = FirstList, Warmed, Runs, ErrorSlot };
+	struct LibraryEntry
+	{
+		unsigned Flag;
+		const char* Name;
+		lua_CFunction Open;
+	};
+	static const LibraryEntry* Entries()
+	{
+		static const LibraryEntry entries[] = {
+#if LUA_VERSION_NUM >= 502
+			{ Base, "_G", luaopen_base },
+			{ Coroutine, LUA_COLIBNAME, luaopen_coroutine },
+#else
+			{ Base, "", luaopen_base },
+#endif
+			{ Package, LUA_LOADLIBNAME, luaopen_package },
+			{ Table, LUA_TABLIBNAME, luaopen_table },
+			{ IO, LUA_IOLIBNAME, luaopen_io },
+			{ OS, LUA_OSLIBNAME, luaopen_os },
+			{ String, LUA_STRLIBNAME, luaopen_string },
+			{ Math, LUA_MATHLIBNAME, luaopen_math },
+			{ Debug, LUA_DBLIBNAME, luaopen_debug },
+#if LUA_VERSION_NUM == 502
+			{ Bit32, LUA_BITLIBNAME, luaopen_bit32 },
+#endif
+#if LUA_VERSION_NUM >= 503
+			{ Utf8, LUA_UTF8LIBNAME, luaopen_utf8 },
+#endif
+			{ 0, NULL, NULL } };
+		return entries;
+	}
+	static void PushGlobals(lua_State* L)
+	{
+#if LUA_VERSION_NUM >= 502
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+		lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+	}
+	static void OpenLibrary(lua_State* L, const char* name, lua_CFunction open)
+	{
+#if LUA_VERSION_NUM >= 502
+		luaL_requiref(L, name, open, 1);
+		lua_pop(L, 1);
+#else
+		lua_pushcfunction(L, open);
+		lua_pushstring(L, name);
+		lua_call(L, 1, 0);
+#endif
+	}
+	// __index of the globals: upvalue 1 maps the names of the lazy libraries to their open functions
+	static int LazyIndex(lua_State* L)
+	{
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		if(!lua_iscfunction(L, -1))
+			return 0;
+		OpenLibrary(L, lua_tostring(L, 2), lua_tocfunction(L, -1));
+		lua_pushvalue(L, 2);
+		lua_rawget(L, 1);
+		return 1;
+	}
+	// Compiles script in Store and sets it, as bytecode, in the list at the key on the top of the stack
+	const char* Compile(int list, const Script& script)
+	{
+		if(script.load(Store))
+		{
+			lua_rawseti(Store, LUA_REGISTRYINDEX, ErrorSlot);
+			lua_pop(Store, 1);
+			lua_rawgeti(Store, LUA_REGISTRYINDEX, ErrorSlot);
+			const char* error = lua_tostring(Store, -1);
+			lua_pop(Store, 1);
+			return error;
+		}
+		luaL_Buffer code;
+		luaL_buffinit(Store, &code);
+#if LUA_VERSION_NUM >= 503
+		lua_dump(Store, Writer, &code, 0);
+#else
+		lua_dump(Store, Writer, &code);
+#endif
+		luaL_pushresult(&code);
+		lua_remove(Store, -2);
+		lua_rawgeti(Store, LUA_REGISTRYINDEX, list);
+		lua_insert(Store, -3);
+		lua_rawset(Store, -3);
+		lua_pop(Store, 1);
+		return NULL;
+	}
+	static int Writer(lua_State* /*L*/, const void* data, size_t size, void* buffer)
+	{
+		luaL_addlstring((luaL_Buffer*)buffer, (const char*)data, size);
+		return 0;
+	}
+	// Pushes on L the function compiled in the string at idx in Store
+	void LoadCode(lua_State* L, int idx) const
+	{
+		size_t size;
+		const char* code = lua_tolstring(Store, idx, &size);
+		if(luaL_loadbuffer(L, code, size, "=template"))
+			lua_error(L);
+	}
+	static int DoApply(lua_State* L)
+	{
+		const StateTemplate* tpl = (const StateTemplate*)lua_touserdata(L, 1);
+		tpl->Setup(L);
+		return 0;
+	}
+	// Sets up L; on error, returns non zero and leaves the message on the top of the stack of L
+	int Apply(lua_State* L) const
+	{
+#if LUA_VERSION_NUM >= 502
+		lua_pushcfunction(L, DoApply);
+		lua_pushlightuserdata(L, (void*)this);
+		return lua_pcall(L, 1, 0, 0);
+#else
+		return lua_cpcall(L, DoApply, (void*)this);
+#endif
 	}
-	int LoadQNamedString(lua_State* L) const
-	{ 
-		QtString::Push(L, *qstring); 
-		QtString::Push(L, *qname); 
-		int res = luaL_loadbuffer(L, lua_tostring(L, -2), strlen(lua_tostring(L, -2)), lua_tostring(L, -1)); 
-		lua_remove(L, -2);
-		lua_remove(L, -2);
-		return res;
+	void Setup(lua_State* L) const
+	{
+		lua_settop(L, 0);
+		lua_newtable(L);
+		for(const LibraryEntry* lib=Entries();lib->Flag;lib++)
+		{
+			if(!(Libraries & lib->Flag))
+				continue;
+			if(Lazy & lib->Flag)
+			{
+				lua_pushcfunction(L, lib->Open);
+				lua_setfield(L, 1, lib->Name);
+			}
+			else
+				OpenLibrary(L, lib->Name, lib->Open);
+		}
+		if(Lazy & Libraries)
+		{
+			PushGlobals(L);
+			lua_createtable(L, 0, 1);
+			lua_pushvalue(L, 1);
+			lua_pushcclosure(L, LazyIndex, 1);
+			lua_setfield(L, -2, "__index");
+			lua_setmetatable(L, -2);
+			lua_pop(L, 1);
+		}
+		lua_settop(L, 0);
+		lua_getglobal(L, "package");
+		if(lua_istable(L, 1))
+		{
+			lua_getfield(L, 1, "preload");
+#if LCBC_USE_CPP11
+			Channel::Preload(L);
+#endif
+			lua_rawgeti(Store, LUA_REGISTRYINDEX, Preloads);
+			lua_pushnil(Store);
+			while(lua_next(Store, -2))
+			{
+				if(lua_iscfunction(Store, -1))
+					lua_pushcfunction(L, lua_tocfunction(Store, -1));
+				else
+					LoadCode(L, -1);
+				lua_setfield(L, 2, lua_tostring(Store, -2));
+				lua_pop(Store, 1);
+			}
+			lua_pop(Store, 1);
+			if(Bundle::Registered())
+				Bundle::Install(L);
+		}
+		lua_settop(L, 0);
+		CompileCache* cache = CompileCache::Get(L);
+		CompileCache::PushTable(L);
+		lua_rawgeti(Store, LUA_REGISTRYINDEX, Warmed);
+		lua_pushnil(Store);
+		while(lua_next(Store, -2))
+		{
+			size_t len;
+			const char* key = lua_tolstring(Store, -2, &len);
+			lua_pushlstring(L, key, len);
+			LoadCode(L, -1);
+			cache->Add(L, 1, 2, 3, lua_objlen(Store, -1));
+			lua_settop(L, 1);
+			lua_pop(Store, 1);
+		}
+		lua_pop(Store, 1);
+		lua_settop(L, 0);
+		lua_rawgeti(Store, LUA_REGISTRYINDEX, Runs);
+		for(int i=1;i<=(int)lua_objlen(Store, -1);i++)
+		{
+			lua_rawgeti(Store, -1, i);
+			LoadCode(L, -1);
+			lua_pop(Store, 1);
+			lua_call(L, 0, 0);
+		}
+		lua_pop(Store, 1);
+		SaveBaseline(L);
 	}
-
-	typedef void (Script::*pKey_t)(lua_State* L) const;
-	typedef int (Script::*pLoad_t)(lua_State* L) const;
-	pKey_t pKey;
-	pLoad_t pLoad;
-	union
+	static void SaveTable(lua_State* L, int baseline, int idx)
 	{
-		const char* string;
-		const wchar_t* wstring;
-		const QString* qstring;
-	};
-	union
+		lua_pushvalue(L, idx);
+		lua_rawget(L, baseline);
+		bool saved = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if(saved)
+			return;
+		lua_pushvalue(L, idx);
+		lua_newtable(L);
+		lua_pushnil(L);
+		while(lua_next(L, idx))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+		}
+		lua_rawset(L, baseline);
+	}
+	static void RestoreTable(lua_State* L, int idx, int copy)
 	{
-		const char* name;
-		const wchar_t* wname;
-		const QString* qname;
-	};
-	
+		lua_pushnil(L);
+		while(lua_next(L, idx))
+		{
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, copy);
+			bool kept = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+			if(!kept)
+			{
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, idx);
+			}
+		}
+		lua_pushnil(L);
+		while(lua_next(L, copy))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, idx);
+		}
+	}
+	lua_State* Store;
+	unsigned Libraries;
+	unsigned Lazy;
 };
 
-class File : public Script
+// The baseline table has the copies of the saved tables indexed by the tables themselves,
+// the copy of the call cache at index 1 and the metatable of the globals (or false) at index 2.
+inline void StateTemplate::SaveBaseline(lua_State* L)
 {
-public:
-	File(const char* filename) { string=filename; pLoad=(pLoad_t)&File::LoadFile; }
-	File(const wchar_t* filename) { wstring=filename; pLoad=(pLoad_t)&File::LoadWFile; }
-	File(const QString& filename) { qstring=&filename; pLoad=(pLoad_t)&File::LoadQFile; }
-private:
-	int LoadFile(lua_State* L) const { return luaL_loadfile(L, string); }
-	int LoadWFile(lua_State* L) const
-	{ 
-		WideString::Push(L, wstring); 
-		int res = luaL_loadfile(L, lua_tostring(L, -1)); 
-		lua_remove(L, -2);
-		return res;
+	int top = lua_gettop(L);
+	lua_newtable(L);
+	int baseline = top+1;
+	PushGlobals(L);
+	int globals = top+2;
+	SaveTable(L, baseline, globals);
+	lua_pushnil(L);
+	while(lua_next(L, globals))
+	{
+		if(lua_istable(L, -1))
+			SaveTable(L, baseline, lua_gettop(L));
+		lua_pop(L, 1);
 	}
-	int LoadQFile(lua_State* L) const
-	{ 
-		QtString::Push(L, *qstring); 
-		int res = luaL_loadfile(L, lua_tostring(L, -1)); 
-		lua_remove(L, -2);
-		return res;
+	lua_getfield(L, globals, "package");
+	if(lua_istable(L, -1))
+	{
+		lua_getfield(L, -1, "loaded");
+		if(lua_istable(L, -1))
+			SaveTable(L, baseline, lua_gettop(L));
 	}
-};
+	lua_settop(L, globals);
+	lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+	if(lua_istable(L, -1))
+	{
+		lua_newtable(L);
+		RestoreTable(L, lua_gettop(L), lua_gettop(L)-1);
+		lua_rawseti(L, baseline, 1);
+	}
+	lua_settop(L, globals);
+	if(!lua_getmetatable(L, globals))
+		lua_pushboolean(L, 0);
+	lua_rawseti(L, baseline, 2);
+	lua_pushvalue(L, baseline);
+	lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedBaseline");
+	lua_settop(L, top);
+}
 
-class Global : public Script
+inline bool StateTemplate::RestoreBaseline(lua_State* L)
 {
-public:
-	Global(const char* fctname) { string=fctname; pLoad=(pLoad_t)&Global::LoadGlobal; }
-	Global(const wchar_t* fctname) { wstring=fctname; pLoad=(pLoad_t)&Global::LoadWGlobal; }
-	Global(const QString& fctname) { qstring=&fctname; pLoad=(pLoad_t)&Global::LoadQGlobal; }
-private:
-	int LoadGlobal(lua_State* L) const { lua_getglobal(L, string); return 0; }
-	int LoadWGlobal(lua_State* L) const
-	{ 
-		WideString::Push(L, wstring); 
-		const char* str = lua_tostring(L, -1);
-		lua_getglobal(L, str); 
-		lua_remove(L, -2);
-		return 0;
+	int top = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedBaseline");
+	if(!lua_istable(L, -1))
+	{
+		lua_settop(L, top);
+		return false;
 	}
-	int LoadQGlobal(lua_State* L) const
-	{ 
-		QtString::Push(L, *qstring); 
-		const char* str = lua_tostring(L, -1);
-		lua_getglobal(L, str); 
-		lua_remove(L, -2);
-		return 0;
+	int baseline = top+1;
+	PushGlobals(L);
+	lua_rawgeti(L, baseline, 2);
+	if(lua_toboolean(L, -1))
+		lua_setmetatable(L, -2);
+	else
+	{
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_setmetatable(L, -2);
 	}
-};
+	lua_settop(L, baseline);
+	lua_pushnil(L);
+	while(lua_next(L, baseline))
+	{
+		if(lua_istable(L, -2))
+			RestoreTable(L, lua_gettop(L)-1, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	lua_newtable(L);
+	lua_rawgeti(L, baseline, 1);
+	if(lua_istable(L, -1))
+		RestoreTable(L, lua_gettop(L)-1, lua_gettop(L));
+	lua_pop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+	CompileCache::Get(L)->Recount(L);
+	lua_settop(L, top);
+	return true;
+}
 
 template<class C, class E=ErrorT<C> >
 class LuaT
@@ -1637,20 +8319,50 @@ public:
 	{ 
 		L = luaL_newstate(); 
 		if(fOpenLibs)
+		{
 			luaL_openlibs(L); 
+			if(Bundle::Registered())
+				Bundle::Install(L);
+#if LCBC_USE_CPP11
+			Channel::Preload(L);
+#endif
+		}
+		Cache = CompileCache::Get(L);
 		FlushCache();
+		Limits = CallLimits::Get(L);
+		Pool = TablePool::Get(L);
+		Modes = WideString::Modes(L);
+		Views = Proxies::Get(L);
+	}
+	// Creates a state from a template; Reset brings it back to its initial state
+	LuaT(const StateTemplate& tpl)
+	{
+		L = tpl.Create();
+		Cache = CompileCache::Get(L);
+		Limits = CallLimits::Get(L);
+		Pool = TablePool::Get(L);
+		Modes = WideString::Modes(L);
+		Views = Proxies::Get(L);
 	}
 	LuaT(lua_State* l) 
 	{
 		L = l; 
 		Retain();
-		FlushCache();
+		Cache = CompileCache::Get(L);
+		Limits = CallLimits::Get(L);
+		Pool = TablePool::Get(L);
+		Modes = WideString::Modes(L);
+		Views = Proxies::Get(L);
 	}
 	LuaT(const LuaT& src)
 	{
 		L = src.L; 
 		Retain();
-		FlushCache();
+		Cache = src.Cache;
+		Limits = src.Limits;
+		Pool = src.Pool;
+		Modes = src.Modes;
+		Views = src.Views;
 	}
 	~LuaT() { Release(); }
 	LuaT& operator=(const LuaT& src) 
@@ -1658,22 +8370,65 @@ public:
 		Release(); 
 		L = src.L; 
 		Retain();
-		FlushCache();
+		Cache = src.Cache;
+		Limits = src.Limits;
+		Pool = src.Pool;
+		Modes = src.Modes;
+		Views = src.Views;
 		return *this;
 	}
 	operator lua_State*() const { return L; }
-	void FlushCache()
+	// Brings the state back to the baseline recorded by its template or by SetBaseline; returns false if there is none
+	bool Reset()
 	{
-		lua_createtable(L, 0, 0);
-		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
+		lua_settop(L, 0);
+		return StateTemplate::RestoreBaseline(L);
+	}
+	void SetBaseline() { StateTemplate::SaveBaseline(L); }
+	// Removes the compiled scripts from the cache shared by all the LuaT of the state, except the pinned ones
+	void FlushCache() { Cache->Flush(L); }
+	// Bounds the compile cache to entries scripts and about bytes of compiled code (0 for no limit)
+	void SetCacheLimits(size_t entries, size_t bytes = 0) { Cache->SetLimits(L, entries, bytes); }
+	CompileCache::Stats CacheStats() const { return Cache->stats(); }
+	// Compiles script if needed and keeps it in the cache until Unpin; returns the compilation error
+	C Pin(const Script& script) { return PinScript(script, 1); }
+	void Unpin(const Script& script) { PinScript(script, -1); }
+	// Limits the results memoized for the Pure scripts to entries calls (0 disables the memoization), and flushes them
+	void SetMemoLimit(size_t entries) { ResultCache::Get(L)->SetLimit(L, entries); }
+	void FlushMemo() { ResultCache::Get(L)->Flush(L); }
+	ResultCache::Stats MemoStats() const { return ResultCache::Get(L)->stats(); }
+	// Reuses up to tables input tables that the Transient scripts did not keep (0 disables it, see TablePool)
+	void SetTableRecycling(size_t tables) { Pool->Enable(L, tables); }
+#if LCBC_USE_CPP11
+	// Loads the scripts compiled by compiler since the previous Install; returns true if all its scripts are installed
+	bool Install(Compiler& compiler)
+	{
+		Compiler::InstallArgs args = { &compiler, false };
+		lua_settop(L, 0);
+#if LUA_VERSION_NUM >= 502
+		lua_pushcfunction(L, Compiler::DoInstall);
+		lua_pushlightuserdata(L, &args);
+		int res = lua_pcall(L, 1, 0, 0);
+#else
+		int res = lua_cpcall(L, Compiler::DoInstall, &args);
+#endif
+		lua_settop(L, 0);
+		return !res && args.Ready;
 	}
+#endif
 	void UCall(const Script& script, const Input& input, const Output& output = nil) { UCall(script, Inputs(input), Outputs(output)); }
 	void UCall(const Script& script, const Outputs& outputs) { UCall(script, Inputs(), outputs); }
 	void UCall(const Script& script, const Output& output) { UCall(script, Inputs(), Outputs(output)); }
 	void UCall(const Script& script, const Inputs& inputs = Inputs(), const Outputs& outputs = Outputs())
 	{
 		PrepareCall(script, inputs, outputs);
-		DoCall();
+		WideString::Scope scope(L, Modes);
+		size_t mark = Views->Mark();
+		{
+			CallLimits::Scope limits(L, Limits);
+			DoCall();
+		}
+		Views->Release(L, mark);
 	}
 	C PCall(const Script& script, const Input& input, const Output& output = nil) {  return PCall(script, Inputs(input), Outputs(output)); }
 	C PCall(const Script& script, const Outputs& outputs) { return PCall(script, Inputs(), outputs); }
@@ -1681,15 +8436,23 @@ public:
 	C PCall(const Script& script, const Inputs& inputs = Inputs(), const Outputs& outputs = Outputs())
 	{
 		PrepareCall(script, inputs, outputs);
+		WideString::Scope scope(L, Modes);
+		size_t mark = Views->Mark();
+		int res;
+		{
+			CallLimits::Scope limits(L, Limits);
 #if LUA_VERSION_NUM >= 502
-		lua_pushcfunction(L, DoCallS);
-		lua_pushlightuserdata(L, this);
-		if(lua_pcall(L, 1, 0, 0))
-			return GetString(lua_gettop(L));
+			lua_pushcfunction(L, DoCallS);
+			lua_pushlightuserdata(L, this);
+			res = lua_pcall(L, 1, 0, 0);
 #else
-		if(lua_cpcall(L, (lua_CFunction)DoCallS, this))
-			return GetString(lua_gettop(L));
+			res = lua_cpcall(L, (lua_CFunction)DoCallS, this);
 #endif
+			TablePool::Stop();
+		}
+		Views->Release(L, mark);
+		if(res)
+			return GetString(L, lua_gettop(L));
 		return NullString();
 	}
 	void ECall(const Script& script, const Input& input, const Output& output = nil) { ECall(script, Inputs(input), Outputs(output)); }
@@ -1703,10 +8466,27 @@ public:
 	}
 	void ThrowError(C error)
 #if LCBC_USE_EXCEPTIONS
-	{ throw E(error); }
+	{ 
+		if(Limits->Violation != NoViolation)
+			throw LimitErrorT<C,E>(error, Limits->Violation);
+		throw E(error); 
+	}
 #else
 	;
 #endif		
+	/* Limits applied to each following call made on the Lua state, by this object or its copies:
+	   number of virtual machine instructions and wall-clock seconds (processor time before C++11),
+	   0 meaning no limit. A call going beyond them fails with a LimitError. Tasks are not limited. */
+	void SetLimits(unsigned long instructions, double seconds = 0)
+	{
+		Limits->Budget = instructions;
+		Limits->Timeout = seconds;
+	}
+	/* Aborts the call in progress on the Lua state, or the next one if none is running; can be called
+	   from another thread. A coroutine created before the call is only stopped once it yields. */
+	void Cancel() { Limits->Cancel(L); }
+	// Limit having stopped the last call, if any
+	LimitReason Violation() const { return Limits->Violation; }
 	typedef const Input& ref;
 	template<class T> T TCall(const Script& script) { return DoTCall<T>(script, Inputs()); }
 	template<class T> T TCall(const Script& script, ref arg1) { return DoTCall<T>(script, arg1); }
@@ -1732,7 +8512,7 @@ public:
 
 	LuaT& operator << (const Input& input) { shift_inputs.add(input); return *this; }
 	LuaT& operator >> (const Output& output)  { shift_outputs.add(output); return *this; }
-	C NullString() { return NULL; }
+	static C NullString() { return NULL; }
 	C operator | (const Script& script) 
 	{ 
 		C error = PCall(script, shift_inputs, shift_outputs); 
@@ -1746,8 +8526,224 @@ public:
 		if(error != NullString())
 			ThrowError(error);
 	}
+
+	/* A Task runs a script in a coroutine, so that the script can wait for the C++ side with
+	   coroutine.yield without blocking the Lua state: many tasks can be in flight on one state.
+	   Start runs the script until it yields or ends: the outputs receive either the yielded values
+	   (typically a request for the C++ side) or the returned ones. Resume passes its inputs as the
+	   results of coroutine.yield and runs the script again until the next yield or its end.
+	   Both return the error message, valid as long as the task, or NULL. The coroutines of finished tasks are
+	   reused by the next tasks. Container proxies are only valid until Start or Resume returns.
+	   With C++20 coroutines, "co_await task" suspends the caller until the task has finished
+	   or failed (immediately if it already has), and returns true if it has finished normally. */
+	class Task
+	{
+	public:
+		enum Status { Idle, Suspended, Finished, Failed };
+		Task() : L(NULL), Cache(NULL), Modes(NULL), Views(NULL), Thread(NULL), Ref(LUA_NOREF), State(Idle) {}
+		~Task() { Release(); }
+		Status status() const { return State; }
+		bool done() const { return State == Finished || State == Failed; }
+		C Resume(const Input& input, const Output& output = nil) { return Resume(Inputs(input), Outputs(output)); }
+		C Resume(const Outputs& outputs) { return Resume(Inputs(), outputs); }
+		C Resume(const Output& output) { return Resume(Inputs(), Outputs(output)); }
+		C Resume(const Inputs& inputs = Inputs(), const Outputs& outputs = Outputs())
+		{
+			if(State != Suspended)
+				return ResumeError();
+			return Step(NULL, inputs, outputs);
+		}
+#if LCBC_HAS_COROUTINE
+		bool await_ready() const { return done(); }
+		void await_suspend(std::coroutine_handle<> handle) { Waiter = handle; }
+		bool await_resume() const { return State == Finished; }
+#endif
+	private:
+		friend class LuaT;
+		Task(const Task&);
+		Task& operator=(const Task&);
+		C Start(lua_State* l, CompileCache* cache, WideString::Converters* modes, Proxies* views, const Script& script, const Inputs& inputs, const Outputs& outputs)
+		{
+			Release();
+			L = l;
+			Cache = cache;
+			Modes = modes;
+			Views = views;
+			IncrRetainCount(L, 1);
+			lua_settop(L, 0);
+			Thread = AcquireThread(L);
+			Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			return Step(&script, inputs, outputs);
+		}
+		void Release()
+		{
+			if(!L)
+				return;
+			luaL_unref(L, LUA_REGISTRYINDEX, Ref);
+			Ref = LUA_NOREF;
+			Thread = NULL;
+			if(IncrRetainCount(L, -1) < 0)
+				lua_close(L);
+			L = NULL;
+		}
+		struct StepArgs
+		{
+			Task* This;
+			const Script* Code;
+			const Inputs* In;
+			const Outputs* Out;
+		};
+		C Step(const Script* script, const Inputs& inputs, const Outputs& outputs)
+		{
+			StepArgs args = { this, script, &inputs, &outputs };
+			WideString::Scope scope(L, Modes);
+			lua_settop(L, 0);
+			size_t mark = Views->Mark();
+#if LUA_VERSION_NUM >= 502
+			lua_pushcfunction(L, DoStepS);
+			lua_pushlightuserdata(L, &args);
+			int res = lua_pcall(L, 1, 0, 0);
+#else
+			int res = lua_cpcall(L, (lua_CFunction)DoStepS, &args);
+#endif
+			TablePool::Stop();
+			Views->Release(L, mark);
+			C error = NullString();
+			if(res)
+			{
+				// The message is kept on the stack of the failed coroutine, alive as long as the task
+				State = Failed;
+				lua_xmove(L, Thread, 1);
+				error = GetString(Thread, lua_gettop(Thread));
+			}
+			else if(State == Finished)
+				RecycleThread();
+#if LCBC_HAS_COROUTINE
+			// The awaiting coroutine may destroy the task: it is resumed last, the message being also kept in the registry
+			if(done() && Waiter)
+			{
+				if(res)
+				{
+					lua_pushvalue(Thread, -1);
+					lua_setfield(Thread, LUA_REGISTRYINDEX, "LuaClassBasedTaskError");
+				}
+				std::coroutine_handle<> waiter = Waiter;
+				Waiter = nullptr;
+				waiter.resume();
+			}
+#endif
+			return error;
+		}
+		static int DoStepS(lua_State* L)
+		{
+			const StepArgs* args = (const StepArgs*)lua_topointer(L, 1);
+			Task* task = args->This;
+			int top = lua_gettop(L);
+			if(args->Code)
+				PushScript(L, task->Cache, *args->Code);
+			PushInputs(L, *args->In, NULL);
+			int narg = lua_gettop(L) - top;
+			lua_xmove(L, task->Thread, narg);
+			if(args->Code)
+				narg--;
+#if LUA_VERSION_NUM >= 504
+			int nres;
+			int status = lua_resume(task->Thread, L, narg, &nres);
+#elif LUA_VERSION_NUM >= 502
+			int status = lua_resume(task->Thread, L, narg);
+			int nres = lua_gettop(task->Thread);
+#else
+			int status = lua_resume(task->Thread, narg);
+			int nres = lua_gettop(task->Thread);
+#endif
+			if(status != 0 && status != LUA_YIELD)
+			{
+				lua_xmove(task->Thread, L, 1);
+				lua_error(L);
+			}
+			task->State = status == LUA_YIELD ? Suspended : Finished;
+			lua_checkstack(L, nres + (int)args->Out->size());
+			lua_xmove(task->Thread, L, nres);
+			GetOutputs(L, top+1, *args->Out);
+			return 0;
+		}
+		// Pushes an idle coroutine, taken from the pool of finished tasks when possible
+		static lua_State* AcquireThread(lua_State* L)
+		{
+			lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedThreads");
+			int count = lua_istable(L, -1) ? (int)lua_objlen(L, -1) : 0;
+			if(count == 0)
+			{
+				lua_pop(L, 1);
+				return lua_newthread(L);
+			}
+			lua_rawgeti(L, -1, count);
+			lua_pushnil(L);
+			lua_rawseti(L, -3, count);
+			lua_remove(L, -2);
+			return lua_tothread(L, -1);
+		}
+		void RecycleThread()
+		{
+			lua_settop(Thread, 0);
+			lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedThreads");
+			if(!lua_istable(L, -1))
+			{
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedThreads");
+			}
+			lua_rawgeti(L, LUA_REGISTRYINDEX, Ref);
+			lua_rawseti(L, -2, (int)lua_objlen(L, -2)+1);
+			lua_pop(L, 1);
+			luaL_unref(L, LUA_REGISTRYINDEX, Ref);
+			Ref = LUA_NOREF;
+			Thread = NULL;
+		}
+
+		lua_State* L;
+		CompileCache* Cache;
+		WideString::Converters* Modes;
+		Proxies* Views;
+		lua_State* Thread;
+		int Ref;
+		Status State;
+#if LCBC_HAS_COROUTINE
+		std::coroutine_handle<> Waiter;
+#endif
+	};
+	friend class Task;
+	/* Save runs script and writes the snapshot of its first result to a file; Load maps a snapshot file
+	   and passes the rebuilt value to script. Both return the error message or NULL, like PCall. */
+	C Save(const char* filename, const Script& script, const Inputs& inputs = Inputs())
+	{
+		Snapshot snapshot;
+		C error = PCall(script, inputs, Outputs(Output(snapshot)));
+		if(error != NullString() || snapshot.Save(filename))
+			return error;
+		lua_pushfstring(L, "cannot write snapshot file %s", filename);
+		return GetString(L, -1);
+	}
+	C Load(const char* filename, const Script& script, const Outputs& outputs = Outputs())
+	{
+		Snapshot snapshot;
+		if(snapshot.Load(filename))
+			return PCall(script, Inputs(Input(snapshot)), outputs);
+		lua_settop(L, 0);
+		lua_pushfstring(L, "cannot read snapshot file %s", filename);
+		return GetString(L, -1);
+	}
+	C Start(Task& task, const Script& script, const Input& input, const Output& output = nil) { return Start(task, script, Inputs(input), Outputs(output)); }
+	C Start(Task& task, const Script& script, const Outputs& outputs) { return Start(task, script, Inputs(), outputs); }
+	C Start(Task& task, const Script& script, const Output& output) { return Start(task, script, Inputs(), Outputs(output)); }
+	C Start(Task& task, const Script& script, const Inputs& inputs = Inputs(), const Outputs& outputs = Outputs())
+	{
+		return task.Start(L, Cache, Modes, Views, script, inputs, outputs);
+	}
 private:
-	C GetString(int idx);
+	static C GetString(lua_State* L, int idx);
+	static C ResumeError();
 	void PrepareCall(const Script& script_, const Inputs& inputs_, const Outputs& outputs_)
 	{
 		lua_settop(L, 0);
@@ -1759,31 +8755,68 @@ private:
 	{
 		lua_settop(L, 0);
 		lua_pushcfunction(L, (lua_CFunction)traceback);
-		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedCaller");
-		script->pushkey(L);
-		if(lua_toboolean(L, -1))
+		TablePool* pool = script->recycling() && Pool->enabled() ? Pool : NULL;
+		if(pool)
+			pool->Begin(L);
+		if(script->memoized() && !script->environment())
+			return DoMemoizedCall(pool);
+		PushScript(L, Cache, *script);
+		PushInputs(L, *inputs, pool);
+		size_t fixed = FixedOutputs(*outputs);
+		if(lua_pcall(L, (int)inputs->size(), fixed < outputs->size() ? LUA_MULTRET : (int)outputs->size(), 1))
+			lua_error(L);
+		if(pool)
+			pool->Recycle(L, 2, lua_gettop(L));
+		GetOutputs(L, 2, *outputs);
+	}
+	// Runs the script only if its results for these inputs are not in the ResultCache
+	void DoMemoizedCall(TablePool* pool)
+	{
+		ResultCache* cache = ResultCache::Get(L);
+		if(!cache->Lookup(L, *script, *inputs, pool))
 		{
-			lua_rawget(L, -2);
-			if(!lua_isfunction(L, -1))
-			{
-				if(script->load(L))
-					lua_error(L);
-				script->pushkey(L);
-				lua_pushvalue(L, -2);
-				lua_rawset(L, -5);
-			}
+			PushScript(L, Cache, *script);
+			lua_insert(L, 3);
+			if(lua_pcall(L, (int)inputs->size(), LUA_MULTRET, 1))
+				lua_error(L);
+			cache->Store(L, 2, script->lifetime());
 		}
-		else if(script->load(L))
-			lua_error(L);
-		lua_replace(L, 2);
-		lua_settop(L, 2);
-		lua_checkstack(L, (int)inputs->size());
-		for(size_t i=0;i<inputs->size(); i++)
-			inputs->get(i).Push(L);
-		if(lua_pcall(L, (int)inputs->size(), (int)outputs->size(), 1))
-			lua_error(L);
-		for(size_t i=0;i<outputs->size(); i++)
-			outputs->get(i).Get(L, (int)i+2);
+		if(pool)
+			pool->Recycle(L, 3, lua_gettop(L));
+		GetOutputs(L, 3, *outputs);
+	}
+	// Pushes the function of script, compiling it unless it is found in the cache
+	static void PushScript(lua_State* L, CompileCache* cache, const Script& script)
+	{
+		bool shared = cache->PushFunction(L, script);
+		if(script.environment())
+			script.environment()->Apply(L, -1, shared);
+	}
+	// Pushes the inputs, recording their tables in pool if not NULL
+	static void PushInputs(lua_State* L, const Inputs& inputs, TablePool* pool)
+	{
+		lua_checkstack(L, (int)inputs.size());
+		TablePool::Recording recording(L, pool);
+		for(size_t i=0;i<inputs.size(); i++)
+			inputs.get(i).Push(L);
+	}
+	// Number of outputs taking one value each: a ResultsView takes all the values from its position
+	// (the outputs following it can only be the nil padding of Outputs)
+	static size_t FixedOutputs(const Outputs& outputs)
+	{
+		size_t fixed = 0;
+		while(fixed < outputs.size() && !outputs.get(fixed).MultipleResults())
+			fixed++;
+		return fixed;
+	}
+	// Reads the outputs from the values starting at index first; missing values are nil
+	static void GetOutputs(lua_State* L, int first, const Outputs& outputs)
+	{
+		int last = first + (int)FixedOutputs(outputs) - 1;
+		if(lua_gettop(L) < last)
+			lua_settop(L, last);
+		for(size_t i=0;i<outputs.size(); i++)
+			outputs.get(i).Get(L, first+(int)i);
 	}
 	static int DoCallS(lua_State* L)
 	{
@@ -1791,6 +8824,32 @@ private:
 		This->DoCall();
 		return 0;
 	}
+	struct PinArgs
+	{
+		const Script* Code;
+		int Delta;
+	};
+	static int DoPin(lua_State* L)
+	{
+		PinArgs* args = (PinArgs*)lua_touserdata(L, 1);
+		CompileCache::Get(L)->Pin(L, *args->Code, args->Delta);
+		return 0;
+	}
+	C PinScript(const Script& script, int delta)
+	{
+		PinArgs args = { &script, delta };
+		lua_settop(L, 0);
+#if LUA_VERSION_NUM >= 502
+		lua_pushcfunction(L, DoPin);
+		lua_pushlightuserdata(L, &args);
+		int res = lua_pcall(L, 1, 0, 0);
+#else
+		int res = lua_cpcall(L, DoPin, &args);
+#endif
+		if(res)
+			return GetString(L, -1);
+		return NullString();
+	}
 	template<class T> T DoTCall(const Script& script, const Inputs& inputs)
 	{
 		T value;
@@ -1815,19 +8874,15 @@ private:
 		lua_call(L, 2, 1);  /* call debug.traceback */
 		return 1;
 	}
-	lua_Integer IncrRetainCount(int incr)
-	{
-		lua_getfield(L, LUA_REGISTRYINDEX, "LuaClassBasedRetainCount");
-		lua_Integer count = lua_tointeger(L, -1);
-		count = count + incr;
-		lua_pushinteger(L, count);
-		lua_setfield(L, LUA_REGISTRYINDEX, "LuaClassBasedRetainCount");
-		return count;
-	}
-	void Retain() { IncrRetainCount(1); }
-	void Release() { if(IncrRetainCount(-1) < 0) lua_close(L); }
+	void Retain() { IncrRetainCount(L, 1); }
+	void Release() { if(IncrRetainCount(L, -1) < 0) lua_close(L); }
 
 	lua_State* L;
+	CompileCache* Cache;
+	CallLimits* Limits;
+	TablePool* Pool;
+	WideString::Converters* Modes;
+	Proxies* Views;
 	const Script* script;
 	const Inputs* inputs; 
 	const Outputs* outputs;
@@ -1843,27 +8898,41 @@ typedef LuaW Lua;
 #else
 typedef LuaA Lua;
 #endif
-template<> inline const char* LuaT<const char*>::GetString(int idx) { return lua_tostring(L, idx); }
-template<> inline const wchar_t* LuaT<const wchar_t*>::GetString(int idx) { return WideString::Get(L, idx); }
-template<> inline QString LuaT<QString>::GetString(int idx) { return QtString::Get(L, idx); }
+template<> inline const char* LuaT<const char*>::GetString(lua_State* L, int idx) { return lua_tostring(L, idx); }
+template<> inline const wchar_t* LuaT<const wchar_t*>::GetString(lua_State* L, int idx) { return WideString::Get(L, idx); }
+template<> inline QString LuaT<QString>::GetString(lua_State* L, int idx) { return QtString::Get(L, idx); }
+template<> inline const char* LuaT<const char*>::ResumeError() { return "cannot resume a task which is not suspended"; }
+#if LCBC_USE_WIDESTRING
+template<> inline const wchar_t* LuaT<const wchar_t*>::ResumeError() { return L"cannot resume a task which is not suspended"; }
+#else
+template<> inline const wchar_t* LuaT<const wchar_t*>::ResumeError() { return NULL; }
+#endif
+#if LCBC_USE_QT
+template<> inline QString LuaT<QString>::ResumeError() { return QString::fromLatin1("cannot resume a task which is not suspended"); }
+#else
+template<> inline QString LuaT<QString>::ResumeError() { return QString(); }
+#endif
 
 #if LCBC_USE_WIDESTRING
-template<> inline int WideString::Push<RawMode>(lua_State* /*L*/) { return 1; }
+template<> inline void WideString::Encode<RawMode>(lua_State* L, const wchar_t* wstr, size_t len) 
+{ 
+	lua_pushlstring(L, (const char*)wstr, len*sizeof(wchar_t));
+}
 
-template<> inline int WideString::Get<RawMode>(lua_State* L)
+template<> inline void WideString::Decode<RawMode>(lua_State* L, const char* str, size_t len)
 {
-	lua_pushlstring(L, "\0\0\0\0", sizeof(wchar_t));
-	lua_concat(L, 2);
-	return 1;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, str, len);
+	AddTerminator(&b);
+	luaL_pushresult(&b);
 }
 
-template<> inline int WideString::Push<LocaleMode>(lua_State* L)
+template<> inline void WideString::Encode<LocaleMode>(lua_State* L, const wchar_t* wstr, size_t len)
 {
-	size_t i, len;
+	size_t i;
 	luaL_Buffer b;
 	char buffer[10];
-	const wchar_t* wstr = (const wchar_t*)lua_tolstring(L, 1, &len);
-	len /= sizeof(wchar_t);
 	luaL_buffinit(L, &b);
 	for(i=0;i<len;i++)
 	{
@@ -1873,18 +8942,15 @@ template<> inline int WideString::Push<LocaleMode>(lua_State* L)
 		luaL_addlstring(&b, buffer, res);
 	}
 	luaL_pushresult(&b);
-	return 1;
 }
 
-template<> inline int WideString::Get<LocaleMode>(lua_State* L)
+template<> inline void WideString::Decode<LocaleMode>(lua_State* L, const char* psrc, size_t len)
 {
-	size_t i;
 	luaL_Buffer b;
 	wchar_t wchar;
-	size_t len, pos = 0;
-	const char* psrc = luaL_checklstring(L, 1, &len);
+	size_t pos = 0;
 	luaL_buffinit(L, &b);
-	for(i=0;i<len;i++)
+	while(pos < len)
 	{
 		int res = mbtowc(&wchar, psrc+pos, len-pos);
 		if(res == -1)
@@ -1897,61 +8963,54 @@ template<> inline int WideString::Get<LocaleMode>(lua_State* L)
 		luaL_addlstring(&b, (const char*)&wchar, sizeof(wchar));
 		pos += res;
 	}
-	wchar = 0;
-	luaL_addlstring(&b, (const char*)&wchar, sizeof(wchar)-1);
+	AddTerminator(&b);
 	luaL_pushresult(&b);
-	return 1;
 }
 
-template<> inline int WideString::Push<Utf8Mode>(lua_State* L)
+template<> inline void WideString::Encode<Utf8Mode>(lua_State* L, const wchar_t* wstr, size_t len)
 {
 	luaL_Buffer b;
-	size_t i, len;
+	size_t i;
 	wchar_t thres;
 	char str[8], car;
-	const wchar_t* wstr = (const wchar_t*)lua_tolstring(L, 1, &len);
-	len /= sizeof(wchar_t);
 	luaL_buffinit(L, &b);
 	for(i=0;i<len;i++)
 	{
-		char* pstr = str+sizeof(str);
 		unsigned int value = wstr[i];
-		*--pstr = 0;
 		if(value < 0x80)
-			*--pstr = (char)value;
-		else
 		{
-			if((value & 0xFC00) == 0xD800) // UTF-16 surrogate pair
-			{
-				value = 0x10000 + ((value & 0x3FF) << 10);
-				if(++i == len || ((wstr[i] & 0xFC00) != 0xDC00))
-					break;
-				value |= wstr[i] & 0x3FF;
-			}
-			for(thres=0x40;value>=(unsigned int)thres;thres>>=1)
-			{
-				*--pstr = (char)((value & 0x3F) | 0x80);
-				value >>= 6;
-			}
-			car = char((unsigned)-1 << (8-sizeof(str)+pstr-str) | value);
-			*--pstr = car;
+			luaL_addchar(&b, (char)value);
+			continue;
+		}
+		char* pstr = str+sizeof(str);
+		*--pstr = 0;
+		if((value & 0xFC00) == 0xD800) // UTF-16 surrogate pair
+		{
+			value = 0x10000 + ((value & 0x3FF) << 10);
+			if(++i == len || ((wstr[i] & 0xFC00) != 0xDC00))
+				break;
+			value |= wstr[i] & 0x3FF;
+		}
+		for(thres=0x40;value>=(unsigned int)thres;thres>>=1)
+		{
+			*--pstr = (char)((value & 0x3F) | 0x80);
+			value >>= 6;
 		}
+		car = char((unsigned)-1 << (8-sizeof(str)+pstr-str) | value);
+		*--pstr = car;
 		luaL_addlstring(&b, pstr, str+sizeof(str)-1-pstr);
 	}
 	luaL_pushresult(&b);
-	return 1;
 }
 
-template<> inline int WideString::Get<Utf8Mode>(lua_State* L)
+template<> inline void WideString::Decode<Utf8Mode>(lua_State* L, const char* str, size_t len)
 {
 	static const unsigned int min_value[] = {0xFFFFFFFF, 0x80, 0x800, 0x10000, 0x200000, 0xFFFFFFFF, 0xFFFFFFFF};
 	luaL_Buffer b;
 	int i,mask;
 	unsigned int value;
 	char car;
-	size_t len;
 	wchar_t wc;
-	const char* str = (const char*)luaL_checklstring(L, 1, &len);
 	const char* strend = str + len;
 	luaL_buffinit(L, &b);
 	while(str < strend)
@@ -1962,8 +9021,10 @@ template<> inline int WideString::Get<Utf8Mode>(lua_State* L)
 		else
 		{
 			for(i=1,mask=0x40;car & mask;i++,mask>>=1) ;
-			int len = i;
+			int seqlen = i;
 			value = car & (mask - 1);
+			if(strend - str < seqlen - 1)
+				luaL_error(L, "invalid UTF-8 string");
 			for(;i>1;i--)
 			{
 				car = *str++;
@@ -1971,7 +9032,7 @@ template<> inline int WideString::Get<Utf8Mode>(lua_State* L)
 					luaL_error(L, "invalid UTF-8 string");
 				value = (value << 6) | (car & 0x3F);
 			}
-			if(value < min_value[len-1])
+			if(value < min_value[seqlen-1])
 				luaL_error(L, "overlong character in UTF-8");
 		}
 		// For UTF-16, generate surrogate pair outside BMP 
@@ -1989,10 +9050,20 @@ template<> inline int WideString::Get<Utf8Mode>(lua_State* L)
 			luaL_addlstring(&b, (const char*)&wc, sizeof(wc));
 		}
 	}
-	wc = 0;
-	luaL_addlstring(&b, (const char*)&wc, sizeof(wc)-1);
+	AddTerminator(&b);
 	luaL_pushresult(&b);
-	return 1;
+}
+
+inline WideString::Converters WideString::Default()
+{
+	Converters converters = { &Encode<LCBC_WIDESTRING_MODE>, &Decode<LCBC_WIDESTRING_MODE> };
+	return converters;
+}
+#else
+inline WideString::Converters WideString::Default()
+{
+	Converters converters = { NULL, NULL };
+	return converters;
 }
 #endif
 
@@ -2000,6 +9071,8 @@ template<> inline int WideString::Get<Utf8Mode>(lua_State* L)
 inline void Script::KeyQString(lua_State* L) const 
 { 
 	lua_pushlstring(L, (const char*)qstring->unicode(), qstring->size()*sizeof(QChar)); 
+	if(pLoad == &Script::LoadQNamedString)
+		KeyName(L, (const char*)qname->unicode(), qname->size()*sizeof(QChar));
 }
 
 #else
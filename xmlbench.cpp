@@ -0,0 +1,192 @@
+/* Benchmark of the TinyXML conversions on a generated multi-MB document.
+
+   It compares the conversions of version 2.2.3, reproduced below in namespace before, with the
+   current ones: pushing a whole document as tables, reading one record through a full conversion
+   or through a ByReference view, and building a node from an XML string output. Build it with a
+   C++11 compiler, Lua and TinyXML, for example:
+
+	g++ -O2 -std=c++11 -I. -I<lua include> -I<tinyxml> xmlbench.cpp <tinyxml sources> -llua -o xmlbench
+	./xmlbench [megabytes]
+
+   Without tinyxml.h in the include path, it only tells so. Each case runs several times and the
+   best time is reported. */
+#if defined(__has_include)
+#if __has_include(<tinyxml.h>)
+#define LCBC_USE_TINYXML 1
+#endif
+#endif
+
+#include "lgencall.hpp"
+#include <chrono>
+
+#if LCBC_USE_TINYXML
+using namespace lua;
+
+namespace before
+{
+void PushNode(lua_State* L, const TiXmlNode* node);
+
+void PushElement(lua_State* L, const TiXmlElement* elem)
+{
+	lua_createtable(L, 0, 1);
+	lua_pushstring(L, elem->Value());
+	lua_rawseti(L, -2, 0);
+	for(const TiXmlAttribute* attrib = elem->FirstAttribute();attrib;attrib=attrib->Next())
+	{
+		lua_pushstring(L, attrib->Value());
+		if(lua_isnumber(L, -1))
+		{
+			lua_pushnumber(L, lua_tonumber(L, -1));
+			lua_replace(L, -2);
+		}
+		lua_setfield(L, -2, attrib->Name());
+	}
+	int i=0;
+	for(const TiXmlNode* child = elem->FirstChild();child;child = child->NextSibling(),i++)
+	{
+		PushNode(L, child);
+		lua_rawseti(L, -2, i+1);
+	}
+}
+
+void PushNode(lua_State* L, const TiXmlNode* node)
+{
+	switch(node->Type())
+	{
+	case TiXmlNode::TINYXML_ELEMENT:
+		PushElement(L, node->ToElement());
+		break;
+	case TiXmlNode::TINYXML_COMMENT:
+		lua_pushfstring(L, "<!--%s-->", node->Value());
+		break;
+	case TiXmlNode::TINYXML_TEXT:
+		lua_pushfstring(L, "%s%s", *node->Value() == '<' ? " " : "", node->Value());
+		break;
+	default:
+		lua_pushfstring(L, "<%s>", node->Value());
+		break;
+	}
+}
+
+void PushDocument(lua_State* L, const TiXmlDocument* doc)
+{
+	lua_createtable(L, 0, 0);
+	int i=0;
+	for(const TiXmlNode* child = doc->FirstChild();child;child = child->NextSibling(),i++)
+	{
+		PushNode(L, child);
+		lua_rawseti(L, -2, i+1);
+	}
+}
+
+// Lua function document(doc): the converted document given as a light userdata
+int Document(lua_State* L)
+{
+	PushDocument(L, (const TiXmlDocument*)lua_touserdata(L, 1));
+	return 1;
+}
+
+// A string output was parsed into a temporary document, then its first node was cloned
+TiXmlNode* GetNode(const char* str)
+{
+	TiXmlDocument doc;
+	doc.Parse(str);
+	return doc.FirstChild()->Clone();
+}
+
+// Lua function node(str): the node built from the string, given as a light userdata
+int Node(lua_State* L)
+{
+	lua_pushlightuserdata(L, GetNode(luaL_checkstring(L, 1)));
+	return 1;
+}
+}
+
+// Catalog of items with attributes, text, comments and nested elements, of about megabytes, without
+// whitespace between the elements so that the tree is the same whatever the whitespace handling
+static string Generate(double megabytes, int& items)
+{
+	string xml = "<?xml version=\"1.0\"?><catalog>";
+	char item[512];
+	for(items=0;xml.size() < megabytes*1024*1024;items++)
+	{
+		snprintf(item, sizeof(item), "<item id=\"%d\" sku=\"SKU-%06d\" price=\"%d.%02d\" stock=\"%d\" category=\"c%d\">"
+			"<title>Item number %d</title><!-- generated --><tags><tag>t%d</tag><tag>t%d</tag></tags></item>",
+			items+1, items, items % 1000, items % 100, items % 57, items % 16, items+1, items % 7, items % 11);
+		xml += item;
+	}
+	xml += "</catalog>";
+	return xml;
+}
+
+template<class F> static double Best(int runs, F f)
+{
+	double best = 0;
+	for(int i=0;i<runs;i++)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		f();
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if(!i || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+static void Report(const char* name, double before, double after)
+{
+	printf("%-34s %10.2f ms %10.2f ms %8.2fx\n", name, before, after, after > 0 ? before / after : 0);
+}
+
+int main(int argc, char* argv[])
+{
+	double megabytes = argc > 1 ? atof(argv[1]) : 8;
+	const int runs = 5;
+	int items;
+	string xml = Generate(megabytes, items);
+	TiXmlDocument doc;
+	doc.Parse(xml.c_str());
+	if(!doc.FirstChild())
+	{
+		fprintf(stderr, "cannot parse the generated document\n");
+		return 1;
+	}
+	printf("%.1f MB, %d items, best of %d runs\n\n", xml.size() / (1024.0*1024.0), items, runs);
+	printf("%-34s %13s %13s %9s\n", "", "before", "after", "speedup");
+
+	Lua L;
+	lua_State* l = L;
+	lua_register(l, "document", before::Document);
+	lua_register(l, "node", before::Node);
+
+	double old = Best(runs, [&]{ before::PushDocument(l, &doc); lua_pop(l, 1); lua_gc(l, LUA_GCCOLLECT, 0); });
+	double now = Best(runs, [&]{ Input(doc).Push(l); lua_pop(l, 1); lua_gc(l, LUA_GCCOLLECT, 0); });
+	Report("push the document", old, now);
+
+	// The last item: a script reads one attribute of one record
+	int id = 0;
+	const char* last = "local doc = ...; local items = doc[2] return items[#items].id";
+	double viewed = Best(runs, [&]{ L.ECall(last, Input(ByReference(doc)), Output(id)); });
+	old = Best(runs, [&]{ L.ECall("local doc = document(...); local items = doc[2] return items[#items].id", Input((void*)&doc), Output(id)); lua_gc(l, LUA_GCCOLLECT, 0); });
+	now = Best(runs, [&]{ L.ECall(last, Input(doc), Output(id)); lua_gc(l, LUA_GCCOLLECT, 0); });
+	Report("read the last item", old, now);
+	Report("read the last item by reference", old, viewed);
+	if(id != items)
+		fprintf(stderr, "unexpected item id %d\n", id);
+
+	// A script returns the catalog as an XML string, built into a node; both calls push the same string
+	string catalogXml = xml.substr(xml.find("<catalog>"));
+	TiXmlNode* node = NULL;
+	void* built = NULL;
+	old = Best(runs, [&]{ L.ECall("return node(...)", Input(catalogXml.c_str()), Output(built)); delete (TiXmlNode*)built; });
+	now = Best(runs, [&]{ L.ECall("return ...", Input(catalogXml.c_str()), Outputs(Output(node))); delete node; });
+	Report("build a node from a string", old, now);
+	return 0;
+}
+#else
+int main()
+{
+	printf("tinyxml.h was not found: define the include path of TinyXML to run the XML benchmark\n");
+	return 0;
+}
+#endif